@@ -0,0 +1,328 @@
+/*
+ * fwdbench -- count system calls and latency per forwarded command
+ *
+ * gcc -O2 -Wall -pthread -o fwdbench fwdbench.c
+ *
+ * usage: fwdbench [-n] [-c count] ../protozoa [--uring]
+ *
+ * Protozoa is started with a configuration which reads pelco_d on TCP port
+ * 7201 and writes pelco_d to UDP port 7202.  Commands are sent one at a
+ * time, each to the next receiver, and each one is timed until it arrives
+ * at the UDP port.  Commands are paced so that the pelco_d packet gap has
+ * always passed, and none of them are deferred.
+ *
+ * System calls made by all protozoa threads are counted with ptrace, from
+ * the first measured command until the last one arrives, so startup is not
+ * counted.  Tracing slows every system call down, so use -n to measure
+ * latency without it.
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IN_PORT (7201)
+#define OUT_PORT (7202)
+#define N_WARMUP (100)
+#define N_RECEIVERS (254)
+#define PACE_US (500)		/* N_RECEIVERS * PACE_US > pelco_d gap */
+#define MAX_THREADS (64)
+
+static const char config[] =
+	"pelco_d tcp://0.0.0.0:7201 -\tpelco_d udp://127.0.0.1:7202\n";
+
+static int n_cmds = 4000;
+static pid_t child;
+static int sock_out = -1;
+
+/* syscall counts are sampled by the tracer when the phase changes */
+static volatile int phase;
+static uint64_t n_calls;
+static uint64_t calls_start;
+static uint64_t calls_end;
+
+struct thread {
+	pid_t	tid;
+	bool	in_call;
+};
+
+static struct thread threads[MAX_THREADS];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct sockaddr_in local_addr(int port) {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return sa;
+}
+
+static void pelco_pan(uint8_t *mess, int receiver, int speed) {
+	int i;
+	mess[0] = 0xff;
+	mess[1] = receiver;
+	mess[2] = 0x00;
+	mess[3] = 0x02;
+	mess[4] = speed;
+	mess[5] = 0x00;
+	mess[6] = 0;
+	for(i = 1; i < 6; i++)
+		mess[6] += mess[i];
+}
+
+static int connect_input(void) {
+	struct sockaddr_in sa = local_addr(IN_PORT);
+	int i;
+
+	for(i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			return fd;
+		close(fd);
+		usleep(50000);
+	}
+	fprintf(stderr, "fwdbench: cannot connect to protozoa\n");
+	return -1;
+}
+
+/*
+ * forward	Send one command, and wait for it to arrive.
+ *
+ * return: latency (ns), or 0 if it did not arrive
+ */
+static uint64_t forward(int fd, int i) {
+	uint8_t mess[7];
+	uint8_t buf[64];
+	uint64_t t0;
+
+	pelco_pan(mess, 1 + i % N_RECEIVERS, 0x10 + (i / N_RECEIVERS) % 32);
+	t0 = now_ns();
+	if(write(fd, mess, sizeof(mess)) != sizeof(mess))
+		return 0;
+	if(recv(sock_out, buf, sizeof(buf), 0) != sizeof(mess))
+		return 0;
+	return now_ns() - t0;
+}
+
+static void pace(uint64_t t0, int i) {
+	uint64_t next = t0 + (uint64_t)(i + 1) * PACE_US * 1000;
+	uint64_t t = now_ns();
+	if(t < next)
+		usleep((next - t) / 1000);
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+/*
+ * drive	Send all commands through protozoa, and report latency.
+ */
+static void *drive(void *arg) {
+	bool traced = arg != NULL;
+	uint64_t *lat = calloc(n_cmds, sizeof(uint64_t));
+	uint64_t t0, total = 0;
+	int fd = connect_input();
+	int i, n_lost = 0;
+
+	if(fd < 0 || lat == NULL)
+		goto out;
+	t0 = now_ns();
+	for(i = 0; i < N_WARMUP; i++) {
+		forward(fd, i);
+		pace(t0, i);
+	}
+	phase = 1;
+	t0 = now_ns();
+	for(i = 0; i < n_cmds; i++) {
+		lat[i] = forward(fd, N_WARMUP + i);
+		if(lat[i] == 0)
+			n_lost++;
+		total += lat[i];
+		pace(t0, i);
+	}
+	phase = 2;
+	qsort(lat, n_cmds, sizeof(uint64_t), compare_u64);
+	printf("commands: %d  lost: %d\n", n_cmds, n_lost);
+	printf("latency (us): mean %.1f  p50 %.1f  p99 %.1f  max %.1f%s\n",
+		total / 1000.0 / n_cmds, lat[n_cmds / 2] / 1000.0,
+		lat[n_cmds * 99 / 100] / 1000.0, lat[n_cmds - 1] / 1000.0,
+		traced ? "  (traced)" : "");
+out:
+	free(lat);
+	/* close first, so the listening port is not left in TIME_WAIT */
+	if(fd >= 0)
+		close(fd);
+	usleep(100000);
+	kill(child, SIGKILL);
+	return NULL;
+}
+
+static struct thread *thread_find(pid_t tid) {
+	int i;
+	for(i = 0; i < MAX_THREADS; i++) {
+		if(threads[i].tid == tid)
+			return threads + i;
+	}
+	for(i = 0; i < MAX_THREADS; i++) {
+		if(threads[i].tid == 0) {
+			threads[i].tid = tid;
+			threads[i].in_call = false;
+			return threads + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * trace	Count system call entries of all protozoa threads, until it
+ *		exits.
+ */
+static void trace(void) {
+	int status;
+	pid_t tid;
+
+	waitpid(child, &status, 0);
+	ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD |
+		PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, child, 0, 0);
+	while((tid = waitpid(-1, &status, __WALL)) > 0) {
+		int sig = 0;
+
+		if(phase == 1 && calls_start == 0)
+			calls_start = n_calls;
+		else if(phase == 2 && calls_end == 0)
+			calls_end = n_calls;
+		if(!WIFSTOPPED(status)) {
+			struct thread *th = thread_find(tid);
+			if(th)
+				th->tid = 0;
+			if(tid == child)
+				break;
+			continue;
+		}
+		if(WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			struct thread *th = thread_find(tid);
+			if(th) {
+				th->in_call = !th->in_call;
+				if(th->in_call)
+					n_calls++;
+			}
+		} else if(WSTOPSIG(status) != SIGTRAP &&
+		          WSTOPSIG(status) != SIGSTOP)
+			sig = WSTOPSIG(status);
+		ptrace(PTRACE_SYSCALL, tid, 0, sig);
+	}
+	if(calls_end > calls_start) {
+		printf("system calls: %llu  per command: %.2f\n",
+			(unsigned long long)(calls_end - calls_start),
+			(double)(calls_end - calls_start) / n_cmds);
+	}
+}
+
+/*
+ * wait_port	Wait until a previous protozoa has released the input port.
+ *		Closing an io_uring releases its files some time after exit.
+ */
+static void wait_port(void) {
+	struct sockaddr_in sa = local_addr(IN_PORT);
+	int i;
+
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	for(i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int r = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+		close(fd);
+		if(r == 0)
+			return;
+		usleep(100000);
+	}
+}
+
+static int write_config(char *path) {
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return -1;
+	if(write(fd, config, strlen(config)) != (ssize_t)strlen(config)) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+int main(int argc, char *argv[]) {
+	char path[] = "/tmp/fwdbench.XXXXXX";
+	struct sockaddr_in sa = local_addr(OUT_PORT);
+	struct timeval timeout = { .tv_sec = 1 };
+	bool traced = true;
+	pthread_t driver;
+	int opt;
+
+	while((opt = getopt(argc, argv, "+nc:")) != -1) {
+		if(opt == 'n')
+			traced = false;
+		else if(opt == 'c')
+			n_cmds = atoi(optarg);
+		else
+			return 1;
+	}
+	if(optind >= argc || n_cmds <= 0) {
+		fprintf(stderr, "usage: fwdbench [-n] [-c count] protozoa "
+			"[options]\n");
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+	sock_out = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(bind(sock_out, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("fwdbench: bind");
+		return 1;
+	}
+	setsockopt(sock_out, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		sizeof(timeout));
+	if(write_config(path) < 0) {
+		perror("fwdbench: config");
+		return 1;
+	}
+	setenv("PROTOZOA_CONFIG", path, 1);
+	wait_port();
+	child = fork();
+	if(child == 0) {
+		if(freopen("/dev/null", "w", stdout) == NULL ||
+		   freopen("/dev/null", "w", stderr) == NULL)
+			_exit(1);
+		if(traced) {
+			ptrace(PTRACE_TRACEME, 0, 0, 0);
+			raise(SIGSTOP);
+		}
+		execv(argv[optind], argv + optind);
+		perror("fwdbench: exec");
+		_exit(1);
+	}
+	pthread_create(&driver, NULL, drive, traced ? &traced : NULL);
+	if(traced)
+		trace();
+	pthread_join(driver, NULL);
+	waitpid(child, NULL, 0);
+	unlink(path);
+	return 0;
+}
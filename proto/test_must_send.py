@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+
+"""Check that commands which must be sent are never dropped on a saturated
+   output.  Run protozoa with this configuration:
+
+	pelco_d udp://127.0.0.1:7001 1-255 pelco_d tcp://127.0.0.1:7003 0
+
+   The script accepts the output connection, but does not read from it while
+   it floods the input with pan commands for many receivers.  Once the output
+   is saturated, it sends stop, preset recall and stop for receiver 1.  Then
+   it drains the output and checks that all three reached it, in order."""
+
+import socket
+import sys
+import time
+
+def frame(receiver, cmd1, cmd2, data1, data2):
+	mess = [0xff, receiver, cmd1, cmd2, data1, data2]
+	mess.append(sum(mess[1:]) & 0xff)
+	return bytes(mess)
+
+STOP = frame(1, 0x00, 0x00, 0x00, 0x00)
+RECALL = frame(1, 0x00, 0x07, 0x00, 0x01)
+
+listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024)
+listener.bind(('127.0.0.1', 7003))
+listener.listen(1)
+ptz = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+# protozoa only connects once it has something to write
+listener.settimeout(0.2)
+out = None
+while out is None:
+	ptz.sendto(frame(2, 0x00, 0x02, 0x20, 0x00), ('127.0.0.1', 7001))
+	try:
+		out, _ = listener.accept()
+	except socket.timeout:
+		pass
+
+# flood without reading, so the output backs up
+end = time.time() + 1.0
+while time.time() < end:
+	for r in range(2, 200):
+		ptz.sendto(frame(r, 0x00, 0x02, 0x20, 0x00), ('127.0.0.1', 7001))
+
+# let protozoa read its input; UDP datagrams are lost if it falls behind
+time.sleep(0.2)
+for mess in (STOP, RECALL, STOP):
+	ptz.sendto(mess, ('127.0.0.1', 7001))
+	time.sleep(0.01)
+
+# drain the output until it goes quiet
+out.settimeout(1.0)
+data = b''
+end = time.time() + 10.0
+try:
+	while time.time() < end:
+		buf = out.recv(65536)
+		if not buf:
+			break
+		data += buf
+except socket.timeout:
+	pass
+
+# stop repeats are expected; a repeat looks like the same command again
+got = []
+for i in range(0, len(data) - 6, 7):
+	mess = data[i:i + 7]
+	if mess in (STOP, RECALL) and (not got or got[-1] != mess):
+		got.append(mess)
+want = [STOP, RECALL, STOP]
+if got != want:
+	print('FAIL: receiver 1 got', [m.hex() for m in got])
+	sys.exit(1)
+print('OK: stop, preset, stop reached the output (%d bytes)' % len(data))
@@ -0,0 +1,141 @@
+/*
+ * wheelbench -- compare deferred packet scheduling: red-black tree vs wheel
+ *
+ * gcc -O2 -I../src -o wheelbench wheelbench.c ../src/wheel.c \
+ *	../src/rbtree.c ../src/pool.c ../src/timeval.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "clump.h"
+#include "timeval.h"
+#include "wheel.h"
+
+#define N_ITEMS (4096)		/* 4 writers * 1024 manchester receivers */
+#define N_ROUNDS (200)
+
+struct item {
+	struct wheel_node	node;
+	int			n;
+};
+
+static struct item items[N_ITEMS];
+
+static const unsigned int deadlines[] = { 80, 80, 80, 15000 };
+
+static cl_compare_t compare_items(const void *value0, const void *value1) {
+	const struct item *i0 = value0;
+	const struct item *i1 = value1;
+	return timeval_compare(&i0->node.tv, &i1->node.tv);
+}
+
+static double elapsed(const struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+static void set_deadline(struct item *it, const struct timeval *now, int i) {
+	it->node.tv = *now;
+	timeval_adjust(&it->node.tv, deadlines[i & 3] + (i % 7));
+}
+
+static void advance(struct timeval *now, unsigned int ms) {
+	timeval_adjust(now, ms);
+}
+
+static void bench_tree(double *ns) {
+	struct cl_rbtree tree;
+	struct timeval now = { 1000, 0 };
+	struct timespec t0;
+	int r, i;
+
+	cl_rbtree_init(&tree, CL_DUP_ALLOW, compare_items);
+	for(r = 0; r < N_ROUNDS; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i++) {
+			cl_rbtree_remove(&tree, items + i);
+			set_deadline(items + i, &now, i + r);
+			cl_rbtree_add(&tree, items + i);
+		}
+		ns[0] += elapsed(&t0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i++) {
+			cl_rbtree_remove(&tree, items + i);
+			set_deadline(items + i, &now, i + r);
+			cl_rbtree_add(&tree, items + i);
+			cl_rbtree_peek(&tree);
+		}
+		ns[3] += elapsed(&t0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i += 2)
+			cl_rbtree_remove(&tree, items + i);
+		ns[1] += elapsed(&t0);
+		advance(&now, 20000);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while(cl_rbtree_peek(&tree)) {
+			struct item *it = cl_rbtree_peek(&tree);
+			if(timeval_compare(&it->node.tv, &now) == CL_GREATER)
+				break;
+			cl_rbtree_remove(&tree, it);
+		}
+		ns[2] += elapsed(&t0);
+	}
+	cl_rbtree_clear(&tree, NULL, NULL);
+}
+
+static void bench_wheel(double *ns) {
+	struct wheel whl;
+	struct timeval now = { 1000, 0 };
+	struct timespec t0;
+	int r, i;
+
+	wheel_init(&whl, &now);
+	for(i = 0; i < N_ITEMS; i++)
+		wheel_node_init(&items[i].node);
+	for(r = 0; r < N_ROUNDS; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i++) {
+			wheel_remove(&whl, &items[i].node);
+			set_deadline(items + i, &now, i + r);
+			wheel_add(&whl, &items[i].node);
+		}
+		ns[0] += elapsed(&t0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i++) {
+			wheel_remove(&whl, &items[i].node);
+			set_deadline(items + i, &now, i + r);
+			wheel_add(&whl, &items[i].node);
+			wheel_peek(&whl);
+		}
+		ns[3] += elapsed(&t0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(i = 0; i < N_ITEMS; i += 2)
+			wheel_remove(&whl, &items[i].node);
+		ns[1] += elapsed(&t0);
+		advance(&now, 20000);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while(wheel_expire(&whl, &now))
+			;
+		ns[2] += elapsed(&t0);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	double tree[4] = { 0, 0, 0, 0 };
+	double wheel[4] = { 0, 0, 0, 0 };
+	double n_ins = (double)N_ITEMS * N_ROUNDS;
+	double n_rem = n_ins / 2;
+
+	bench_tree(tree);
+	bench_wheel(wheel);
+	printf("%-8s %12s %12s %12s %12s\n", "", "insert", "defer+peek",
+		"cancel", "expire");
+	printf("%-8s %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", "rbtree",
+		tree[0] / n_ins, tree[3] / n_ins, tree[1] / n_rem,
+		tree[2] / n_rem);
+	printf("%-8s %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", "wheel",
+		wheel[0] / n_ins, wheel[3] / n_ins, wheel[1] / n_rem,
+		wheel[2] / n_rem);
+	return 0;
+}
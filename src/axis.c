@@ -24,6 +24,7 @@ static const char *default_speed = "100";
 static const char *axis_header = "GET /axis-cgi/com/ptz.cgi?";
 static const char *axis_header_config = "GET /axis-cgi/com/ptzconfig.cgi?";
 static const char *axis_trailer = " HTTP/1.0";
+static const char *axis_trailer_keepalive = " HTTP/1.1\r\nHost: ";
 static const char *axis_auth = "\r\nAuthorization: Basic ";
 static const char *axis_ending = "\r\n\r\n";
 
@@ -33,9 +34,7 @@ static const char *axis_ending = "\r\n\r\n";
  * msg: char string to add to the buffer
  */
 static void axis_add_to_buffer(struct ccwriter *wtr, const char *msg) {
-	char *mess = ccwriter_append(wtr, strlen(msg));
-	if(mess)
-		memcpy(mess, msg, strlen(msg));
+	ccwriter_append_bytes(wtr, msg, strlen(msg));
 }
 
 /*
@@ -241,12 +240,28 @@ static bool encode_preset(struct ccwriter *wtr, struct ccpacket *pkt,
 }
 
 /*
- * axis_do_write	Encode a packet to the axis protocol.
+ * axis_add_host	Add the Host header for an HTTP/1.1 request.  The port
+ *			is only included when it is not the default.
+ */
+static void axis_add_host(struct ccwriter *wtr) {
+	axis_add_to_buffer(wtr, axis_trailer_keepalive);
+	axis_add_to_buffer(wtr, wtr->chn->name);
+	if(strcmp(wtr->chn->service, "80") != 0) {
+		axis_add_to_buffer(wtr, ":");
+		axis_add_to_buffer(wtr, wtr->chn->service);
+	}
+}
+
+/*
+ * axis_encode		Encode a packet to an axis HTTP request.
  *
  * pkt: Packet to encode.
+ * keepalive: Flag to request a persistent (HTTP/1.1) connection
  * return: count of encoded packets
  */
-unsigned int axis_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
+static unsigned int axis_encode(struct ccwriter *wtr, struct ccpacket *pkt,
+	bool keepalive)
+{
 	bool somein = false;
 	if(!buffer_is_empty(&wtr->chn->txbuf)) {
 		log_println(wtr->chn->log, "axis: dropping packet(s)");
@@ -259,7 +274,10 @@ unsigned int axis_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
 	else
 		somein = encode_stop(wtr, somein);
 	if(somein) {
-		axis_add_to_buffer(wtr, axis_trailer);
+		if(keepalive)
+			axis_add_host(wtr);
+		else
+			axis_add_to_buffer(wtr, axis_trailer);
 		if(wtr->auth) {
 			axis_add_to_buffer(wtr, axis_auth);
 			axis_add_to_buffer(wtr, wtr->auth);
@@ -269,3 +287,26 @@ unsigned int axis_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
 	} else
 		return 0;
 }
+
+/*
+ * axis_do_write	Encode a packet to the axis protocol.
+ *
+ * pkt: Packet to encode.
+ * return: count of encoded packets
+ */
+unsigned int axis_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
+	return axis_encode(wtr, pkt, false);
+}
+
+/*
+ * axis_keepalive_do_write	Encode a packet to the axis protocol, using a
+ *				persistent HTTP/1.1 connection.
+ *
+ * pkt: Packet to encode.
+ * return: count of encoded packets
+ */
+unsigned int axis_keepalive_do_write(struct ccwriter *wtr,
+	struct ccpacket *pkt)
+{
+	return axis_encode(wtr, pkt, true);
+}
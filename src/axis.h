@@ -9,5 +9,7 @@
 
 /* There is no reader for axis protocol (http output only) */
 unsigned int axis_do_write(struct ccwriter *wtr, struct ccpacket *pkt);
+unsigned int axis_keepalive_do_write(struct ccwriter *wtr,
+	struct ccpacket *pkt);
 
 #endif
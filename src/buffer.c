@@ -12,25 +12,42 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#define _GNU_SOURCE	/* for sendmmsg */
 #include <assert.h>	/* for assert */
-#include <string.h>	/* for memmove */
+#include <string.h>	/* for memcpy, memset */
 #include <unistd.h>	/* for read, write */
 #include <sys/errno.h>	/* for errno */
+#include <sys/socket.h>	/* for sendmmsg, struct mmsghdr */
+#include <sys/uio.h>	/* for readv, writev */
 #include "buffer.h"	/* for struct buffer and prototypes */
 
+/*
+ * buffer_round_up	Round a size up to a power of two.
+ */
+static size_t buffer_round_up(size_t n_bytes) {
+	size_t size = 1;
+	while(size < n_bytes)
+		size <<= 1;
+	return size;
+}
+
 /*
  * buffer_init		Initialize a new I/O buffer.
  *
- * n_bytes: size of buffer (bytes)
+ * n_bytes: initial size of buffer (bytes)
+ * max: maximum size of buffer (bytes)
  * return: pointer to the buffer or NULL on error
  */
-struct buffer *buffer_init(struct buffer *buf, size_t n_bytes) {
-	buf->base = malloc(n_bytes);
+struct buffer *buffer_init(struct buffer *buf, size_t n_bytes, size_t max) {
+	buf->size = buffer_round_up(n_bytes);
+	buf->base = malloc(buf->size);
 	if(buf->base == NULL)
 		return NULL;
-	buf->end = buf->base + n_bytes;
-	buf->pin = buf->base;
-	buf->pout = buf->base;
+	buf->max = buf->size;
+	buf->hwm = buf->size;
+	buffer_set_limits(buf, max, max);
+	buf->pin = 0;
+	buf->pout = 0;
 	return buf;
 }
 
@@ -40,17 +57,30 @@ struct buffer *buffer_init(struct buffer *buf, size_t n_bytes) {
 void buffer_destroy(struct buffer *buf) {
 	free(buf->base);
 	buf->base = NULL;
-	buf->end = NULL;
-	buf->pin = NULL;
-	buf->pout = NULL;
+	buf->size = 0;
+	buf->max = 0;
+	buf->hwm = 0;
+	buf->pin = 0;
+	buf->pout = 0;
+}
+
+/*
+ * buffer_set_limits	Set the maximum size and high-water mark.
+ *
+ * max: maximum size of buffer (bytes); never less than current size
+ * hwm: high-water mark (bytes); never more than maximum size
+ */
+void buffer_set_limits(struct buffer *buf, size_t max, size_t hwm) {
+	buf->max = (max > buf->size) ? buffer_round_up(max) : buf->size;
+	buf->hwm = (hwm < buf->max) ? hwm : buf->max;
 }
 
 /*
  * buffer_clear		Clear the contents of the I/O buffer.
  */
 void buffer_clear(struct buffer *buf) {
-	buf->pin = buf->base;
-	buf->pout = buf->base;
+	buf->pin = 0;
+	buf->pout = 0;
 }
 
 /*
@@ -73,13 +103,14 @@ inline bool buffer_is_empty(const struct buffer *buf) {
 }
 
 /*
- * buffer_space		Get the space remaining in the I/O buffer.
+ * buffer_space		Get the space remaining in the I/O buffer, including
+ *			room to grow.
  *
  * return: space (bytes) remaining in buffer
  */
 inline size_t buffer_space(const struct buffer *buf) {
-	assert(buf->end >= buf->pin);
-	return buf->end - buf->pin;
+	assert(buf->max >= buffer_available(buf));
+	return buf->max - buffer_available(buf);
 }
 
 /*
@@ -92,13 +123,113 @@ inline bool buffer_is_full(const struct buffer *buf) {
 }
 
 /*
- * buffer_compact	Compact the I/O buffer to free up more space.
+ * buffer_is_high	Test if the I/O buffer is filled to the high-water mark.
+ *
+ * return: true if buffer is at (or above) the high-water mark
+ */
+inline bool buffer_is_high(const struct buffer *buf) {
+	return buffer_available(buf) >= buf->hwm;
+}
+
+/*
+ * buffer_offset	Get the ring offset of a buffer position.
+ */
+static inline size_t buffer_offset(const struct buffer *buf, size_t pos) {
+	return pos & (buf->size - 1);
+}
+
+/*
+ * buffer_is_wrapped	Test if the buffered data wraps around the ring.
+ */
+static inline bool buffer_is_wrapped(const struct buffer *buf) {
+	return buffer_offset(buf, buf->pout) + buffer_available(buf) > buf->size;
+}
+
+/*
+ * buffer_resize	Copy the data into a new ring starting at offset 0.
+ *
+ * size: new size of buffer (bytes)
+ * return: 0 on success; -1 on error
+ */
+static int buffer_resize(struct buffer *buf, size_t size) {
+	size_t a = buffer_available(buf);
+	size_t o = buffer_offset(buf, buf->pout);
+	size_t n = (o + a > buf->size) ? buf->size - o : a;
+	uint8_t *base = malloc(size);
+	if(base == NULL)
+		return -1;
+	memcpy(base, buf->base + o, n);
+	memcpy(base + n, buf->base, a - n);
+	free(buf->base);
+	buf->base = base;
+	buf->size = size;
+	buf->pout = 0;
+	buf->pin = a;
+	return 0;
+}
+
+/*
+ * buffer_reverse	Reverse a range of bytes in place.
  */
-static inline void buffer_compact(struct buffer *buf) {
+static void buffer_reverse(uint8_t *first, uint8_t *last) {
+	while(first < last) {
+		uint8_t b = *first;
+		*first++ = *--last;
+		*last = b;
+	}
+}
+
+/*
+ * buffer_linearize	Rotate the ring in place so that the data starts at
+ *			offset 0 and does not wrap around.
+ */
+static void buffer_linearize(struct buffer *buf) {
 	size_t a = buffer_available(buf);
-	memmove(buf->base, buf->pout, a);
-	buf->pout = buf->base;
-	buf->pin = buf->pout + a;
+	size_t o = buffer_offset(buf, buf->pout);
+	uint8_t *base = buf->base;
+
+	buffer_reverse(base, base + o);
+	buffer_reverse(base + o, base + buf->size);
+	buffer_reverse(base, base + buf->size);
+	buf->pout = 0;
+	buf->pin = a;
+}
+
+/*
+ * buffer_grow		Grow the I/O buffer to hold more data.
+ *
+ * n_bytes: total number of bytes which must fit
+ * return: 0 on success; -1 if the buffer cannot grow enough
+ */
+static int buffer_grow(struct buffer *buf, size_t n_bytes) {
+	if(n_bytes <= buf->size)
+		return 0;
+	if(n_bytes > buf->max)
+		return -1;
+	return buffer_resize(buf, buffer_round_up(n_bytes));
+}
+
+/*
+ * buffer_segments	Get the buffer segments for data or free space.
+ *
+ * iov: array of two iovecs to fill
+ * pos: buffer position of segments
+ * n_bytes: total number of bytes in segments
+ * return: number of segments
+ */
+static int buffer_segments(struct buffer *buf, struct iovec *iov, size_t pos,
+	size_t n_bytes)
+{
+	size_t o = buffer_offset(buf, pos);
+	iov[0].iov_base = buf->base + o;
+	if(o + n_bytes <= buf->size) {
+		iov[0].iov_len = n_bytes;
+		return 1;
+	}
+	iov[0].iov_len = buf->size - o;
+	iov[1].iov_base = buf->base;
+	iov[1].iov_len = n_bytes - iov[0].iov_len;
+	return 2;
 }
 
 /*
@@ -108,18 +239,27 @@ static inline void buffer_compact(struct buffer *buf) {
  * return: number of bytes read; -1 on error (with errno set)
  */
 ssize_t buffer_read(struct buffer *buf, int fd) {
+	struct iovec iov[2];
 	ssize_t n_bytes;
-	size_t count = buffer_space(buf);
-	if(count == 0) {
-		buffer_compact(buf);
-		count = buffer_space(buf);
-		if(count == 0) {
-			errno = ENOBUFS;
-			return -1;
-		}
+	size_t a = buffer_available(buf);
+	size_t count;
+	int n_seg;
+
+	if(a >= buf->hwm) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	/* grow when full, but never read past the high-water mark */
+	if(a == buf->size && buffer_grow(buf, a + 1) < 0) {
+		errno = ENOBUFS;
+		return -1;
 	}
+	count = buf->size - a;
+	if(count > buf->hwm - a)
+		count = buf->hwm - a;
+	n_seg = buffer_segments(buf, iov, buf->pin, count);
 	do {
-		n_bytes = read(fd, buf->pin, count);
+		n_bytes = readv(fd, iov, n_seg);
 	} while(n_bytes < 0 && errno == EINTR);
 	if(n_bytes > 0)
 		buf->pin += n_bytes;
@@ -133,20 +273,62 @@ ssize_t buffer_read(struct buffer *buf, int fd) {
  * return: number of bytes written; -1 on error (with errno set)
  */
 ssize_t buffer_write(struct buffer *buf, int fd) {
+	struct iovec iov[2];
 	ssize_t n_bytes;
 	size_t count = buffer_available(buf);
+	int n_seg;
+
 	if(count == 0) {
 		errno = ENOBUFS;
 		return -1;
 	}
+	n_seg = buffer_segments(buf, iov, buf->pout, count);
 	do {
-		n_bytes = write(fd, buf->pout, count);
+		n_bytes = writev(fd, iov, n_seg);
 	} while(n_bytes < 0 && errno == EINTR);
 	if(n_bytes > 0)
 		buffer_consume(buf, n_bytes);
 	return n_bytes;
 }
 
+/*
+ * buffer_send		Send data from the I/O buffer to a socket as separate
+ *			datagrams, with one system call.
+ *
+ * lens: lengths of datagrams at the output position
+ * n_msgs: number of datagrams (at most BUFFER_MSG_MAX)
+ * return: number of datagrams sent; -1 on error
+ */
+int buffer_send(struct buffer *buf, int fd, const size_t *lens,
+	unsigned int n_msgs)
+{
+	struct mmsghdr msgs[BUFFER_MSG_MAX];
+	struct iovec iov[BUFFER_MSG_MAX * 2];
+	size_t pos = buf->pout;
+	unsigned int i;
+	int n;
+
+	assert(n_msgs <= BUFFER_MSG_MAX);
+	memset(msgs, 0, sizeof(struct mmsghdr) * n_msgs);
+	for(i = 0; i < n_msgs; i++) {
+		struct msghdr *hdr = &msgs[i].msg_hdr;
+		hdr->msg_iov = iov + i * 2;
+		hdr->msg_iovlen = buffer_segments(buf, hdr->msg_iov, pos,
+			lens[i]);
+		pos += lens[i];
+	}
+	do {
+		n = sendmmsg(fd, msgs, n_msgs, 0);
+	} while(n < 0 && errno == EINTR);
+	if(n > 0) {
+		size_t n_bytes = 0;
+		for(i = 0; i < n; i++)
+			n_bytes += lens[i];
+		buffer_consume(buf, n_bytes);
+	}
+	return n;
+}
+
 /*
  * buffer_append	Append data to the I/O buffer.
  *
@@ -154,29 +336,49 @@ ssize_t buffer_write(struct buffer *buf, int fd) {
  * return: borrowed pointer to the appended data, or NULL on error
  */
 void *buffer_append(struct buffer *buf, size_t n_bytes) {
-	void *pin = buf->pin;
-	if(buffer_space(buf) < n_bytes)
+	size_t a = buffer_available(buf);
+	uint8_t *pin;
+
+	if(buffer_grow(buf, a + n_bytes) < 0)
 		return NULL;
+	/* appended data must be contiguous */
+	if(buffer_offset(buf, buf->pin) + n_bytes > buf->size &&
+	   !buffer_is_wrapped(buf))
+	{
+		if(a)
+			buffer_linearize(buf);
+		else
+			buffer_clear(buf);
+	}
+	pin = buf->base + buffer_offset(buf, buf->pin);
 	buf->pin += n_bytes;
 	return pin;
 }
 
 /*
- * buffer_input		Get the input position in the I/O buffer.
+ * buffer_truncate	Discard data appended after the first bytes available
+ *			in the I/O buffer.
  *
- * return: borrowed pointer to the buffer input position
+ * n_bytes: number of available bytes to keep
  */
-inline void *buffer_input(struct buffer *buf) {
-	return buf->pin;
+void buffer_truncate(struct buffer *buf, size_t n_bytes) {
+	if(n_bytes < buffer_available(buf)) {
+		buf->pin = buf->pout + n_bytes;
+		if(buf->pout == buf->pin)
+			buffer_clear(buf);
+	}
 }
 
 /*
- * buffer_output	Get the output position in the I/O buffer.
+ * buffer_output	Get the output position in the I/O buffer.  The
+ *			available data is made contiguous first.
  *
  * return: borrowed pointer to the buffer output position
  */
-inline void *buffer_output(struct buffer *buf) {
-	return buf->pout;
+void *buffer_output(struct buffer *buf) {
+	if(buffer_is_wrapped(buf))
+		buffer_linearize(buf);
+	return buf->base + buffer_offset(buf, buf->pout);
 }
 
 /*
@@ -190,3 +392,28 @@ void buffer_consume(struct buffer *buf, size_t n_bytes) {
 	if(buf->pout == buf->pin)
 		buffer_clear(buf);
 }
+
+/*
+ * buffer_copy		Copy data out of the I/O buffer without consuming it.
+ *
+ * offset: offset of data to copy, relative to the output position
+ * dst: destination to copy data
+ * n_bytes: maximum number of bytes to copy
+ * return: number of bytes copied
+ */
+size_t buffer_copy(const struct buffer *buf, size_t offset, void *dst,
+	size_t n_bytes)
+{
+	size_t a = buffer_available(buf);
+	size_t o, n;
+
+	if(offset >= a)
+		return 0;
+	if(n_bytes > a - offset)
+		n_bytes = a - offset;
+	o = buffer_offset(buf, buf->pout + offset);
+	n = (o + n_bytes > buf->size) ? buf->size - o : n_bytes;
+	memcpy(dst, buf->base + o, n);
+	memcpy((uint8_t *)dst + n, buf->base, n_bytes - n);
+	return n_bytes;
+}
@@ -2,32 +2,46 @@
 #define BUFFER_H
 
 #include <stdbool.h>	/* for bool */
+#include <stdint.h>	/* for uint8_t */
 #include <stdlib.h>	/* for size_t, ssize_t */
 
+#define BUFFER_MSG_MAX (32)	/* maximum datagrams sent with one call */
+
 /*
- * A buffer is used for I/O buffering. It consists of four pointers to a
- * heap memory buffer. Data is read into the buffer at "pin". Data is written
- * out of the buffer at "pout". So, base <= pout <= pin < end.
+ * A buffer is used for I/O buffering. It is a ring buffer in heap memory with
+ * a power-of-two capacity. Data is read into the buffer at "pin". Data is
+ * written out of the buffer at "pout". Both positions count up without
+ * wrapping, and are masked to get offsets into the ring. So, pout <= pin and
+ * pin - pout <= size. The capacity grows as needed, up to "max" bytes.
+ * Reading stops when the buffer fills up to the high-water mark ("hwm").
  */
 struct buffer {
-	void	*base;	/* base address of buffer */
-	void	*end;	/* end address of buffer */
-	void	*pin;	/* input pointer location */
-	void	*pout;	/* output pointer location */
+	uint8_t	*base;	/* base address of buffer */
+	size_t	size;	/* current capacity (power of two) */
+	size_t	max;	/* maximum capacity */
+	size_t	hwm;	/* high-water mark */
+	size_t	pin;	/* input position */
+	size_t	pout;	/* output position */
 };
 
-struct buffer *buffer_init(struct buffer *buf, size_t n_bytes);
+struct buffer *buffer_init(struct buffer *buf, size_t n_bytes, size_t max);
 void buffer_destroy(struct buffer *buf);
+void buffer_set_limits(struct buffer *buf, size_t max, size_t hwm);
 void buffer_clear(struct buffer *buf);
 size_t buffer_available(const struct buffer *buf);
 bool buffer_is_empty(const struct buffer *buf);
 size_t buffer_space(const struct buffer *buf);
 bool buffer_is_full(const struct buffer *buf);
+bool buffer_is_high(const struct buffer *buf);
 ssize_t buffer_read(struct buffer *buf, int fd);
 ssize_t buffer_write(struct buffer *buf, int fd);
+int buffer_send(struct buffer *buf, int fd, const size_t *lens,
+	unsigned int n_msgs);
 void *buffer_append(struct buffer *buf, size_t n_bytes);
-void *buffer_input(struct buffer *buf);
+void buffer_truncate(struct buffer *buf, size_t n_bytes);
 void *buffer_output(struct buffer *buf);
 void buffer_consume(struct buffer *buf, size_t n_bytes);
+size_t buffer_copy(const struct buffer *buf, size_t offset, void *dst,
+	size_t n_bytes);
 
 #endif
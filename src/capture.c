@@ -0,0 +1,589 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>		/* for errno, EINVAL */
+#include <fcntl.h>		/* for open, O_WRONLY, O_CREAT, O_APPEND */
+#include <pthread.h>		/* for pthread_create, pthread_key_create */
+#include <stdatomic.h>		/* for atomic_bool, atomic_size_t */
+#include <stdlib.h>		/* for malloc, calloc, free, atoi */
+#include <string.h>		/* for memcmp, memset, strcmp, strlen */
+#include <sys/eventfd.h>	/* for eventfd, eventfd_read, eventfd_write */
+#include <sys/timerfd.h>	/* for timerfd_create, timerfd_settime */
+#include <sys/uio.h>		/* for writev */
+#include <unistd.h>		/* for close, write */
+#include "capture.h"		/* for struct replay, prototypes */
+#include "timeval.h"		/* for time_now_ns */
+
+/** Size of a channel name:service */
+#define NAME_SZ (72)
+
+/** Bytes in a capture ring (power of two) */
+#define CAPTURE_RING_SZ (1 << 20)
+
+/** Capture rings (one for each capturing thread) */
+#define CAPTURE_RINGS (32)
+
+/*
+ * A ring passes records from one capturing thread to the writer thread, like
+ * a log ring.  Records are stored just as they are written to the file, so
+ * the writer can write out everything up to the tail at once.  Both
+ * positions count up without wrapping, and are masked to get bytes.
+ */
+struct capture_ring {
+	atomic_size_t	head;		/* next byte to write out */
+	_Alignas(64) atomic_size_t tail;	/* next byte to fill */
+	uint8_t		buf[CAPTURE_RING_SZ];	/* record bytes */
+};
+
+/** Capture file descriptor, or -1 if not capturing */
+static int cap_fd = -1;
+
+/** Names of captured channels, by ID (0 is unused) */
+static char cap_names[CAPTURE_CHANNELS][NAME_SZ];
+
+/** Number of channel IDs used */
+static unsigned int n_names = 1;
+
+/** Writer thread state; data records are written directly until started */
+static bool cap_running;
+static pthread_t cap_thread;
+static pthread_key_t cap_key;
+static int cap_wake = -1;
+static atomic_bool cap_awake;
+static atomic_bool cap_stop;
+static atomic_bool cap_used[CAPTURE_RINGS];
+static struct capture_ring * _Atomic cap_ring[CAPTURE_RINGS];
+static atomic_ullong cap_dropped;
+static struct log *cap_log;
+
+/*
+ * capture_record_init	Initialize a record header, stamped with the time.
+ */
+static void capture_record_init(struct capture_record *rec,
+	enum capture_type t, uint16_t chn, size_t n_bytes)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->ns = time_now_ns();
+	rec->len = n_bytes;
+	rec->chn = chn;
+	rec->type = t;
+}
+
+/*
+ * capture_writev	Write out all of an I/O vector to the capture file.
+ */
+static void capture_writev(struct iovec *iov, int n_iov) {
+	while(n_iov) {
+		ssize_t n = writev(cap_fd, iov, n_iov);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+		while(n_iov && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if(n_iov) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * capture_write	Write one record directly to the capture file.  The file
+ *			is opened for appending, so records written by different
+ *			threads are never interleaved.
+ */
+static void capture_write(enum capture_type t, uint16_t chn, const void *data,
+	size_t n_bytes)
+{
+	struct capture_record rec;
+	struct iovec iov[2];
+
+	capture_record_init(&rec, t, chn, n_bytes);
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = n_bytes;
+	capture_writev(iov, 2);
+}
+
+/*
+ * capture_drain	Write out all records in the rings.
+ *
+ * return: number of bytes written
+ */
+static size_t capture_drain(void) {
+	unsigned long long n_dropped;
+	size_t n_total = 0;
+	unsigned int i;
+
+	for(i = 0; i < CAPTURE_RINGS; i++) {
+		struct capture_ring *ring = atomic_load(&cap_ring[i]);
+		struct iovec iov[2];
+		size_t head, tail, off, n;
+
+		if(ring == NULL)
+			continue;
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		tail = atomic_load(&ring->tail);
+		if(head == tail)
+			continue;
+		off = head & (CAPTURE_RING_SZ - 1);
+		n = tail - head;
+		iov[0].iov_base = ring->buf + off;
+		iov[0].iov_len = (n < CAPTURE_RING_SZ - off) ? n :
+			CAPTURE_RING_SZ - off;
+		iov[1].iov_base = ring->buf;
+		iov[1].iov_len = n - iov[0].iov_len;
+		capture_writev(iov, iov[1].iov_len ? 2 : 1);
+		/* give the bytes back to the producer */
+		atomic_store_explicit(&ring->head, tail, memory_order_release);
+		n_total += n;
+	}
+	n_dropped = atomic_exchange(&cap_dropped, 0);
+	if(n_dropped)
+		log_println(cap_log, "capture: %llu records dropped", n_dropped);
+	return n_total;
+}
+
+/*
+ * capture_writer	Write out captured records until capture is closed.
+ */
+static void *capture_writer(void *arg) {
+	eventfd_t val;
+
+	while(true) {
+		bool stop = atomic_load(&cap_stop);
+		/* Clear the flag before draining, so that a record captured
+		 * during the drain always causes another wakeup */
+		atomic_store(&cap_awake, false);
+		if(capture_drain() == 0) {
+			if(stop)
+				break;
+			eventfd_read(cap_wake, &val);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * capture_release	Release the ring of a thread which is exiting, so
+ *			another thread can claim it.
+ *
+ * arg: flag of claimed ring
+ */
+static void capture_release(void *arg) {
+	atomic_store((atomic_bool *)arg, false);
+}
+
+/*
+ * capture_ring_get	Get the ring of the calling thread, claiming one if it
+ *			does not have one yet.
+ *
+ * return: borrowed pointer to ring, or NULL if none are available
+ */
+static struct capture_ring *capture_ring_get(void) {
+	atomic_bool *used = pthread_getspecific(cap_key);
+	struct capture_ring *ring;
+	unsigned int i;
+
+	if(used == NULL) {
+		for(i = 0; i < CAPTURE_RINGS; i++) {
+			bool f = false;
+			if(atomic_compare_exchange_strong(&cap_used[i], &f,
+				true))
+			{
+				break;
+			}
+		}
+		if(i == CAPTURE_RINGS)
+			return NULL;
+		used = cap_used + i;
+		pthread_setspecific(cap_key, used);
+	}
+	i = used - cap_used;
+	ring = atomic_load(&cap_ring[i]);
+	if(ring == NULL) {
+		ring = calloc(1, sizeof(struct capture_ring));
+		if(ring == NULL)
+			return NULL;
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_store(&cap_ring[i], ring);
+	}
+	return ring;
+}
+
+/*
+ * capture_ring_copy	Copy bytes into a ring, wrapping at the end.
+ *
+ * pos: ring position to copy to
+ * return: ring position after the bytes
+ */
+static size_t capture_ring_copy(struct capture_ring *ring, size_t pos,
+	const void *data, size_t n_bytes)
+{
+	size_t off = pos & (CAPTURE_RING_SZ - 1);
+	size_t n = (n_bytes < CAPTURE_RING_SZ - off) ? n_bytes :
+		CAPTURE_RING_SZ - off;
+
+	memcpy(ring->buf + off, data, n);
+	memcpy(ring->buf, (const uint8_t *)data + n, n_bytes - n);
+	return pos + n_bytes;
+}
+
+/*
+ * capture_queue	Queue one data record for the writer thread.  If the
+ *			ring of the calling thread is full, the record is
+ *			dropped (and counted), so forwarding never waits for
+ *			the capture file.
+ */
+static void capture_queue(uint16_t chn, const void *data, size_t n_bytes) {
+	struct capture_ring *ring = capture_ring_get();
+	struct capture_record rec;
+	size_t head, tail;
+
+	if(ring == NULL) {
+		atomic_fetch_add(&cap_dropped, 1);
+		return;
+	}
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if(CAPTURE_RING_SZ - (tail - head) < sizeof(rec) + n_bytes) {
+		atomic_fetch_add(&cap_dropped, 1);
+		return;
+	}
+	capture_record_init(&rec, CAPTURE_DATA, chn, n_bytes);
+	tail = capture_ring_copy(ring, tail, &rec, sizeof(rec));
+	tail = capture_ring_copy(ring, tail, data, n_bytes);
+	atomic_store(&ring->tail, tail);
+	/* Only the first record since the last drain needs a wakeup */
+	if(!atomic_exchange(&cap_awake, true))
+		eventfd_write(cap_wake, 1);
+}
+
+/*
+ * capture_open		Open a capture file, replacing any previous contents.
+ *
+ * path: path of capture file
+ * return: 0 on success; -1 on error
+ */
+int capture_open(const char *path) {
+	cap_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		0644);
+	if(cap_fd < 0)
+		return -1;
+	if(write(cap_fd, CAPTURE_MAGIC, 8) != 8) {
+		capture_close();
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * capture_start	Start writing data records on a background thread, so
+ *			that capturing input never blocks forwarding.  This
+ *			must be called after the process is daemonized.
+ *
+ * log: message logger, for counts of dropped records
+ * return: 0 on success; -1 on error (records are still written directly)
+ */
+int capture_start(struct log *log) {
+	unsigned int i;
+
+	if(cap_fd < 0)
+		return 0;
+	cap_log = log;
+	atomic_init(&cap_awake, false);
+	atomic_init(&cap_stop, false);
+	atomic_init(&cap_dropped, 0);
+	for(i = 0; i < CAPTURE_RINGS; i++) {
+		atomic_init(&cap_used[i], false);
+		atomic_init(&cap_ring[i], NULL);
+	}
+	cap_wake = eventfd(0, EFD_CLOEXEC);
+	if(cap_wake < 0)
+		return -1;
+	if(pthread_key_create(&cap_key, capture_release))
+		goto fail;
+	cap_running = true;
+	if(pthread_create(&cap_thread, NULL, capture_writer, NULL)) {
+		cap_running = false;
+		pthread_key_delete(cap_key);
+		goto fail;
+	}
+	return 0;
+fail:
+	close(cap_wake);
+	cap_wake = -1;
+	return -1;
+}
+
+/*
+ * capture_stop		Stop the writer thread, after all records are written.
+ */
+static void capture_stop(void) {
+	unsigned int i;
+
+	atomic_store(&cap_stop, true);
+	eventfd_write(cap_wake, 1);
+	pthread_join(cap_thread, NULL);
+	cap_running = false;
+	pthread_key_delete(cap_key);
+	close(cap_wake);
+	cap_wake = -1;
+	for(i = 0; i < CAPTURE_RINGS; i++) {
+		free(atomic_load(&cap_ring[i]));
+		atomic_store(&cap_ring[i], NULL);
+		atomic_store(&cap_used[i], false);
+	}
+}
+
+/*
+ * capture_close	Close the capture file.
+ */
+void capture_close(void) {
+	if(cap_running)
+		capture_stop();
+	if(cap_fd >= 0) {
+		close(cap_fd);
+		cap_fd = -1;
+	}
+}
+
+/*
+ * capture_channel	Get the ID of a channel, writing a name record if it
+ *			is new.  This is only called while the configuration
+ *			is loaded, before any shards are running.  The name
+ *			record is written directly, so it is in the file
+ *			before any data records for the channel.
+ *
+ * name: channel name
+ * service: service (port or serial baud rate)
+ * return: channel ID, or 0 if not capturing (or there are too many)
+ */
+uint16_t capture_channel(const char *name, const char *service) {
+	char buf[NAME_SZ];
+	unsigned int i;
+
+	if(cap_fd < 0)
+		return 0;
+	snprintf(buf, sizeof(buf), "%s:%s", name, service);
+	for(i = 1; i < n_names; i++) {
+		if(strcmp(cap_names[i], buf) == 0)
+			return i;
+	}
+	if(n_names >= CAPTURE_CHANNELS)
+		return 0;
+	memcpy(cap_names[i], buf, sizeof(buf));
+	n_names++;
+	capture_write(CAPTURE_NAME, i, buf, strlen(buf));
+	return i;
+}
+
+/*
+ * capture_input	Write a record of raw input read on a channel.
+ *
+ * chn: channel ID (from capture_channel)
+ * data: input data
+ * n_bytes: number of bytes of input
+ */
+void capture_input(uint16_t chn, const void *data, size_t n_bytes) {
+	if(chn == 0)
+		return;
+	while(n_bytes) {
+		size_t n = (n_bytes < CAPTURE_DATA_MAX) ? n_bytes :
+			CAPTURE_DATA_MAX;
+		if(cap_running)
+			capture_queue(chn, data, n);
+		else
+			capture_write(CAPTURE_DATA, chn, data, n);
+		data = (const uint8_t *)data + n;
+		n_bytes -= n;
+	}
+}
+
+/*
+ * replay_parse_mode	Parse a replay mode: "realtime" or "fast", followed
+ *			by ",ID" of the captured channel to replay.  Only one
+ *			channel can be replayed, since partial frames from
+ *			different channels must not be decoded together.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int replay_parse_mode(struct replay *rp, const char *mode) {
+	if(strncmp(mode, "realtime", 8) == 0) {
+		rp->fast = false;
+		mode += 8;
+	} else if(strncmp(mode, "fast", 4) == 0) {
+		rp->fast = true;
+		mode += 4;
+	} else
+		goto fail;
+	if(*mode != ',' || (rp->chn = atoi(mode + 1)) == 0) {
+		log_println(rp->log, "replay: mode needs a channel ID");
+		goto fail;
+	}
+	return 0;
+fail:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * replay_open		Open a capture file to replay.
+ *
+ * path: path of capture file
+ * mode: replay mode
+ * log: message logger
+ * return: file descriptor to poll; -1 on error
+ */
+int replay_open(struct replay *rp, const char *path, const char *mode,
+	struct log *log)
+{
+	char magic[8];
+
+	memset(rp, 0, sizeof(struct replay));
+	rp->log = log;
+	rp->fd = -1;
+	if(replay_parse_mode(rp, mode) < 0)
+		return -1;
+	rp->data = malloc(CAPTURE_DATA_MAX);
+	if(rp->data == NULL)
+		goto fail;
+	rp->file = fopen(path, "re");
+	if(rp->file == NULL)
+		goto fail;
+	if(fread(magic, sizeof(magic), 1, rp->file) != 1 ||
+	   memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	rp->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(rp->fd < 0)
+		goto fail;
+	if(replay_arm(rp) < 0)
+		goto fail;
+	return rp->fd;
+fail:
+	if(rp->fd >= 0)
+		close(rp->fd);
+	replay_close(rp);
+	return -1;
+}
+
+/*
+ * replay_close		Close the capture file.  The timerfd is closed with the
+ *			channel.
+ */
+void replay_close(struct replay *rp) {
+	if(rp->file)
+		fclose(rp->file);
+	free(rp->data);
+	rp->file = NULL;
+	rp->data = NULL;
+	rp->fd = -1;
+}
+
+/*
+ * replay_fetch		Read the next data record to replay.  Name records
+ *			are logged, so channel IDs can be found.
+ *
+ * return: true if a record was read; false at end of capture
+ */
+static bool replay_fetch(struct replay *rp) {
+	struct capture_record *rec = &rp->rec;
+
+	while(fread(rec, sizeof(*rec), 1, rp->file) == 1) {
+		if(rec->len > CAPTURE_DATA_MAX) {
+			log_println(rp->log, "replay: invalid record");
+			return false;
+		}
+		if(fread(rp->data, 1, rec->len, rp->file) != rec->len)
+			return false;
+		if(rec->type == CAPTURE_NAME) {
+			log_println(rp->log, "replay: channel %u %.*s",
+				rec->chn, (int)rec->len, rp->data);
+		} else if(rec->type == CAPTURE_DATA && rec->chn == rp->chn)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * replay_done		Log the totals at the end of a replay.
+ */
+static void replay_done(struct replay *rp) {
+	uint64_t ms = rp->start_ns ? (time_now_ns() - rp->start_ns) / 1000000 :
+		0;
+	log_println(rp->log, "replay: done, %llu records, %llu bytes in %llu ms",
+		rp->n_records, rp->n_bytes, (unsigned long long)ms);
+}
+
+/*
+ * replay_next		Get the next record which is due to be replayed.
+ *
+ * n_bytes: set to the number of bytes in the record
+ * return: record data (valid until the next call); NULL if none is due
+ */
+const uint8_t *replay_next(struct replay *rp, size_t *n_bytes) {
+	if(rp->eof)
+		return NULL;
+	if(!rp->ready) {
+		if(!replay_fetch(rp)) {
+			rp->eof = true;
+			replay_done(rp);
+			return NULL;
+		}
+		if(rp->start_ns == 0) {
+			rp->start_ns = time_now_ns();
+			rp->offset = rp->start_ns - rp->rec.ns;
+		}
+		rp->ready = true;
+	}
+	if(!rp->fast && rp->rec.ns + rp->offset > time_now_ns())
+		return NULL;
+	rp->ready = false;
+	rp->n_records++;
+	rp->n_bytes += rp->rec.len;
+	*n_bytes = rp->rec.len;
+	return rp->data;
+}
+
+/*
+ * replay_arm		Arm the timerfd for the next record.  In fast mode,
+ *			it expires at once, so other channels are polled
+ *			between batches.  At the end, it is disarmed.
+ *
+ * return: 0 on success; -1 on error
+ */
+int replay_arm(struct replay *rp) {
+	struct itimerspec its;
+	int flags = 0;
+
+	memset(&its, 0, sizeof(its));
+	if(rp->ready && !rp->fast) {
+		uint64_t ns = rp->rec.ns + rp->offset;
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+		flags = TFD_TIMER_ABSTIME;
+	} else if(!rp->eof)
+		its.it_value.tv_nsec = 1;
+	return timerfd_settime(rp->fd, flags, &its, NULL);
+}
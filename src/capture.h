@@ -0,0 +1,64 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>		/* for bool */
+#include <stdint.h>		/* for uint8_t, uint16_t, uint32_t, uint64_t */
+#include <stdio.h>		/* for FILE */
+#include "log.h"		/* for struct log */
+
+#define CAPTURE_MAGIC "PZCAPT01"	/* magic bytes at start of capture */
+#define CAPTURE_CHANNELS (256)	/* channel IDs in a capture */
+#define CAPTURE_DATA_MAX (65536)	/* largest record data (bytes) */
+#define REPLAY_BATCH (64)	/* records replayed for each read */
+
+enum capture_type {
+	CAPTURE_NAME,		/* channel name:service */
+	CAPTURE_DATA,		/* raw input data */
+};
+
+/*
+ * A capture file is the magic bytes followed by records, each a header and
+ * its data.  A name record gives the "name:service" of a channel ID, before
+ * any data records for that channel.
+ */
+struct capture_record {
+	uint64_t	ns;		/* monotonic time stamp (ns) */
+	uint32_t	len;		/* length of data (bytes) */
+	uint16_t	chn;		/* channel ID */
+	uint8_t		type;		/* record type (enum capture_type) */
+	uint8_t		reserved;
+};
+
+/*
+ * A replay reads data records from a capture file, either at the pace they
+ * were captured or as fast as possible.  A timerfd signals when the next
+ * record is due, so it can be polled like any other channel.
+ */
+struct replay {
+	FILE			*file;		/* capture file */
+	int			fd;		/* timerfd for next record */
+	struct log		*log;		/* message logger */
+	bool			fast;		/* replay as fast as possible */
+	uint16_t		chn;		/* channel ID to replay */
+	bool			ready;		/* next record has been read */
+	bool			eof;		/* end of capture reached */
+	struct capture_record	rec;		/* next record */
+	uint8_t			*data;		/* data of next record */
+	uint64_t		start_ns;	/* time first record replayed */
+	int64_t			offset;		/* replay minus capture time */
+	unsigned long long	n_records;	/* records replayed */
+	unsigned long long	n_bytes;	/* bytes replayed */
+};
+
+int capture_open(const char *path);
+int capture_start(struct log *log);
+void capture_close(void);
+uint16_t capture_channel(const char *name, const char *service);
+void capture_input(uint16_t chn, const void *data, size_t n_bytes);
+int replay_open(struct replay *rp, const char *path, const char *mode,
+	struct log *log);
+void replay_close(struct replay *rp);
+const uint8_t *replay_next(struct replay *rp, size_t *n_bytes);
+int replay_arm(struct replay *rp);
+
+#endif
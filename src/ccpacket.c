@@ -36,6 +36,8 @@ struct ccpacket {
 	int		tilt;		/* 0 (none) to SPEED_MAX (fast) */
 	int		preset;		/* preset number */
 	struct timeval	expire;		/* expiration time */
+	uint64_t	arrived;	/* time input arrived (ns), or 0 */
+	uint64_t	decoded;	/* time packet was decoded (ns) */
 };
 
 /** Create a camera control packet.
@@ -63,6 +65,8 @@ void ccpacket_clear(struct ccpacket *pkt) {
 	pkt->pan = 0;
 	pkt->tilt = 0;
 	pkt->preset = 0;
+	pkt->arrived = 0;
+	pkt->decoded = 0;
 }
 
 /** Set receiver for packet.
@@ -81,6 +85,14 @@ int ccpacket_get_receiver(const struct ccpacket *self) {
 	return self->receiver;
 }
 
+/** Get all flags of packet.
+ *
+ * @return Bitmask of flags.
+ */
+enum cc_flags ccpacket_get_flags(const struct ccpacket *self) {
+	return self->flags;
+}
+
 /** Get a valid menu command */
 static enum cc_flags ccpacket_menu(enum cc_flags mc) {
 	enum cc_flags m = mc & CC_MENU;
@@ -638,6 +650,39 @@ void ccpacket_log(struct ccpacket *pkt, struct log *log, const char *dir,
 	log_line_end(log);
 }
 
+/*
+ * ccpacket_set_arrived	Set the time input for a packet arrived, and the time
+ *			it was decoded.
+ *
+ * arrived: time input arrived (ns), or 0 for none
+ * decoded: time packet was decoded (ns)
+ */
+void ccpacket_set_arrived(struct ccpacket *pkt, uint64_t arrived,
+	uint64_t decoded)
+{
+	pkt->arrived = arrived;
+	pkt->decoded = decoded;
+}
+
+/*
+ * ccpacket_get_arrived	Get the time input for a packet arrived.
+ *
+ * return: time input arrived (ns); 0 if the packet was not read from input
+ *         (or is a repeat)
+ */
+uint64_t ccpacket_get_arrived(const struct ccpacket *pkt) {
+	return pkt->arrived;
+}
+
+/*
+ * ccpacket_get_decoded	Get the time a packet was decoded.
+ *
+ * return: time packet was decoded (ns)
+ */
+uint64_t ccpacket_get_decoded(const struct ccpacket *pkt) {
+	return pkt->decoded;
+}
+
 /*
  * ccpacket_copy	Copy a camera control packet.
  */
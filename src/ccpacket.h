@@ -56,6 +56,7 @@ void ccpacket_destroy(struct ccpacket *self);
 void ccpacket_clear(struct ccpacket *pkt);
 void ccpacket_set_receiver(struct ccpacket *self, int receiver);
 int ccpacket_get_receiver(const struct ccpacket *self);
+enum cc_flags ccpacket_get_flags(const struct ccpacket *self);
 void ccpacket_set_menu(struct ccpacket *self, enum cc_flags mc);
 enum cc_flags ccpacket_get_menu(const struct ccpacket *self);
 void ccpacket_set_camera(struct ccpacket *self, enum cc_flags cc);
@@ -93,6 +94,10 @@ bool ccpacket_has_autopan(const struct ccpacket *pkt);
 bool ccpacket_has_power(const struct ccpacket *pkt);
 void ccpacket_log(struct ccpacket *pkt, struct log *log, const char *dir,
 	const char *name);
+void ccpacket_set_arrived(struct ccpacket *pkt, uint64_t arrived,
+	uint64_t decoded);
+uint64_t ccpacket_get_arrived(const struct ccpacket *pkt);
+uint64_t ccpacket_get_decoded(const struct ccpacket *pkt);
 void ccpacket_copy(struct ccpacket *dest, struct ccpacket *src);
 
 #endif
@@ -12,9 +12,13 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <stdlib.h>
 #include <strings.h>
 #include "ccreader.h"
+#include "ccwriter.h"
+#include "shard.h"
 #include "stats.h"
+#include "trace.h"
 #include "joystick.h"
 #include "manchester.h"
 #include "pelco_d.h"
@@ -43,6 +47,7 @@ static int ccreader_set_protocol(struct ccreader *rdr, const char *protocol) {
 		ccreader_set_timeout(rdr, MANCHESTER_TIMEOUT);
 	} else if(strcasecmp(protocol, "pelco_d") == 0) {
 		rdr->do_read = pelco_d_do_read;
+		rdr->raw_write = pelco_d_do_write;
 		ccreader_set_timeout(rdr, PELCO_D_TIMEOUT);
 	} else if(strcasecmp(protocol, "pelco_p") == 0) {
 		rdr->do_read = pelco_p_do_read;
@@ -53,6 +58,7 @@ static int ccreader_set_protocol(struct ccreader *rdr, const char *protocol) {
 		ccreader_set_timeout(rdr, PELCO_P_TIMEOUT);
 	} else if(strcasecmp(protocol, "vicon") == 0) {
 		rdr->do_read = vicon_do_read;
+		rdr->raw_write = vicon_do_write;
 		ccreader_set_timeout(rdr, VICON_TIMEOUT);
 	} else {
 		log_println(rdr->log, "Unknown protocol: %s", protocol);
@@ -98,6 +104,21 @@ void ccreader_next_camera(struct ccreader *rdr) {
 		ccpacket_set_receiver(rdr->packet, receiver + 1);
 }
 
+/*
+ * ccreader_set_frame	Set the raw frame of the packet being decoded.  The
+ *			validated frame is passed through as-is to writers
+ *			of the same protocol with an unshifted receiver.
+ *
+ * frame: borrowed pointer to frame (valid until the packet is processed)
+ * n_bytes: size of frame (bytes)
+ */
+void ccreader_set_frame(struct ccreader *rdr, const uint8_t *frame,
+	size_t n_bytes)
+{
+	rdr->frame = frame;
+	rdr->n_frame = n_bytes;
+}
+
 /*
  * ccreader_init	Initialize a camera control reader.
  *
@@ -109,10 +130,19 @@ void ccreader_next_camera(struct ccreader *rdr) {
 struct ccreader *ccreader_init(struct ccreader *rdr, const char *name,
 	struct log *log, const char *protocol)
 {
+	rdr->raw_write = NULL;
 	rdr->packet = ccpacket_create();
+	rdr->frame = NULL;
+	rdr->n_frame = 0;
 	rdr->timeout = DEFAULT_TIMEOUT;
 	rdr->flags = 0;
 	rdr->head = NULL;
+	rdr->route_first = NULL;
+	rdr->routes = NULL;
+	rdr->n_packets = 0;
+	rdr->trace_id = 0;
+	rdr->stats = NULL;
+	rdr->shard = NULL;
 	rdr->name = name;
 	rdr->log = log;
 	if(ccreader_set_protocol(rdr, protocol) < 0)
@@ -124,6 +154,10 @@ struct ccreader *ccreader_init(struct ccreader *rdr, const char *name,
 /** Destroy a ccreader.
  */
 void ccreader_destroy(struct ccreader *rdr) {
+	free(rdr->route_first);
+	rdr->route_first = NULL;
+	free(rdr->routes);
+	rdr->routes = NULL;
 	if (rdr->packet) {
 		ccpacket_destroy(rdr->packet);
 		rdr->packet = NULL;
@@ -131,7 +165,113 @@ void ccreader_destroy(struct ccreader *rdr) {
 }
 
 /*
- * ccreader_add_writer		Add a writer to the camera control reader.
+ * ccnode_get_receiver	Get receiver address adjusted for the node.
+ *
+ * receiver: input receiver address
+ * return: output receiver address; 0 indicates drop packet
+ */
+static int ccnode_get_receiver(const struct ccnode *node, int receiver) {
+	if(receiver < node->range_first || receiver > node->range_last)
+		return 0;	/* Ignore if receiver address is out of range */
+	receiver += node->shift;
+	if(receiver < 0)
+		return 0;
+	else
+		return receiver;
+}
+
+/*
+ * ccnode_first_receiver	Get the first route table receiver for a node.
+ */
+static int ccnode_first_receiver(const struct ccnode *node) {
+	return (node->range_first > 0) ? node->range_first : 0;
+}
+
+/*
+ * ccnode_last_receiver		Get the last route table receiver for a node.
+ */
+static int ccnode_last_receiver(const struct ccnode *node) {
+	return (node->range_last < MAX_ROUTE_RECEIVER) ? node->range_last
+		: MAX_ROUTE_RECEIVER;
+}
+
+/*
+ * ccreader_build_routes	Build a route table from the writer list,
+ *				indexed by receiver address.  The routes for
+ *				each receiver are in writer list order.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int ccreader_build_routes(struct ccreader *rdr) {
+	unsigned int *first;
+	struct ccroute *routes;
+	struct ccnode *node;
+	unsigned int n_routes = 0;
+	int r;
+
+	first = calloc(MAX_ROUTE_RECEIVER + 2, sizeof(unsigned int));
+	if(first == NULL)
+		return -1;
+	/* count routes for each receiver */
+	for(node = rdr->head; node; node = node->next) {
+		for(r = ccnode_first_receiver(node);
+		    r <= ccnode_last_receiver(node); r++)
+		{
+			if(ccnode_get_receiver(node, r))
+				first[r + 1]++;
+		}
+	}
+	for(r = 0; r <= MAX_ROUTE_RECEIVER; r++) {
+		n_routes += first[r + 1];
+		first[r + 1] = n_routes;
+	}
+	routes = malloc((n_routes + 1) * sizeof(struct ccroute));
+	if(routes == NULL) {
+		free(first);
+		return -1;
+	}
+	/* fill in routes, using first[r] as the next slot temporarily */
+	for(node = rdr->head; node; node = node->next) {
+		for(r = ccnode_first_receiver(node);
+		    r <= ccnode_last_receiver(node); r++)
+		{
+			int rcv = ccnode_get_receiver(node, r);
+			if(rcv) {
+				struct ccroute *rt = routes + first[r]++;
+				rt->writer = node->writer;
+				rt->receiver = rcv;
+			}
+		}
+	}
+	/* restore first[r] from the (now filled) counts */
+	for(r = MAX_ROUTE_RECEIVER; r > 0; r--)
+		first[r] = first[r - 1];
+	first[0] = 0;
+	free(rdr->route_first);
+	free(rdr->routes);
+	rdr->route_first = first;
+	rdr->routes = routes;
+	return 0;
+}
+
+/*
+ * ccreader_compile_routes	Compile the route table, once all writers have
+ *				been added.  Without a table, packets are
+ *				written by walking the writer list.
+ */
+void ccreader_compile_routes(struct ccreader *rdr) {
+	if(ccreader_build_routes(rdr) < 0) {
+		log_println(rdr->log, "%s: route table error", rdr->name);
+		free(rdr->route_first);
+		rdr->route_first = NULL;
+		free(rdr->routes);
+		rdr->routes = NULL;
+	}
+}
+
+/*
+ * ccreader_add_writer		Add a writer to the camera control reader.  The
+ *				route table must be compiled again afterwards.
  *
  * wtr: camera control writer to link with the reader
  * range: range of receiver addresses
@@ -150,43 +290,94 @@ void ccreader_add_writer(struct ccreader *rdr, struct ccnode *node,
 }
 
 /*
- * ccnode_get_receiver	Get receiver address adjusted for the node.
+ * ccreader_write		Write a packet to one writer.  A writer running on
+ *				another shard is sent a copy of the packet.
  *
- * receiver: input receiver address
- * return: output receiver address; 0 indicates drop packet
+ * return: number of writers that wrote the packet
  */
-static int ccnode_get_receiver(const struct ccnode *node, int receiver) {
-	if(receiver < node->range_first || receiver > node->range_last)
-		return 0;	/* Ignore if receiver address is out of range */
-	receiver += node->shift;
-	if(receiver < 0)
-		return 0;
+static unsigned int ccreader_write(struct ccreader *rdr, struct ccwriter *wtr,
+	struct ccpacket *pkt, struct ccencode *enc)
+{
+	if(wtr->shard != rdr->shard)
+		return shard_send(rdr->shard, wtr, pkt, enc) ? 1 : 0;
 	else
-		return receiver;
+		return ccwriter_do_write_shared(wtr, pkt, enc);
 }
 
 /*
- * ccreader_do_writers		Write a packet to all linked writers.
+ * ccreader_do_nodes		Write a packet to all linked writers by walking
+ *				the writer list.
  *
  * return: number of writers that wrote the packet
  */
-static unsigned int ccreader_do_writers(struct ccreader *rdr) {
+static unsigned int ccreader_do_nodes(struct ccreader *rdr, int receiver,
+	struct ccencode *enc)
+{
 	unsigned int res = 0;
 	struct ccpacket *pkt = rdr->packet;
-	const int receiver = ccpacket_get_receiver(pkt);  /* "true" receiver */
 	struct ccnode *node = rdr->head;
 	while(node) {
 		int r = ccnode_get_receiver(node, receiver);
 		if(r) {
 			ccpacket_set_receiver(pkt, r);
-			res += ccwriter_do_write(node->writer, pkt);
+			res += ccreader_write(rdr, node->writer, pkt, enc);
 		}
 		node = node->next;
 	}
+	return res;
+}
+
+/*
+ * ccreader_do_routes		Write a packet to all routes for a receiver.
+ *
+ * return: number of writers that wrote the packet
+ */
+static unsigned int ccreader_do_routes(struct ccreader *rdr, int receiver,
+	struct ccencode *enc)
+{
+	unsigned int res = 0;
+	struct ccpacket *pkt = rdr->packet;
+	const struct ccroute *rt = rdr->routes + rdr->route_first[receiver];
+	const struct ccroute *end = rdr->routes +
+		rdr->route_first[receiver + 1];
+	for(; rt < end; rt++) {
+		ccpacket_set_receiver(pkt, rt->receiver);
+		res += ccreader_write(rdr, rt->writer, pkt, enc);
+	}
+	return res;
+}
+
+/*
+ * ccreader_do_writers		Write a packet to all linked writers.
+ *
+ * return: number of writers that wrote the packet
+ */
+static unsigned int ccreader_do_writers(struct ccreader *rdr) {
+	unsigned int res;
+	struct ccpacket *pkt = rdr->packet;
+	const int receiver = ccpacket_get_receiver(pkt);  /* "true" receiver */
+	struct ccencode enc;
+	ccencode_clear(&enc);
+	if(rdr->frame && rdr->raw_write) {
+		ccencode_put(&enc, rdr->raw_write, receiver, rdr->frame,
+			rdr->n_frame);
+	}
+	if(rdr->routes && receiver >= 0 && receiver <= MAX_ROUTE_RECEIVER)
+		res = ccreader_do_routes(rdr, receiver, &enc);
+	else
+		res = ccreader_do_nodes(rdr, receiver, &enc);
 	ccpacket_set_receiver(pkt, receiver);	/* restore "true" receiver */
 	return res;
 }
 
+/*
+ * ccreader_decode_error	Count one decode error, when the reader skips
+ *				over input which is not a valid packet.
+ */
+void ccreader_decode_error(struct ccreader *rdr) {
+	chn_stats_add(rdr->stats, STAT_ERRORS, 1);
+}
+
 /*
  * ccreader_process_packet_no_clear	Process a packet (but don't clear it)
  *					from the camera control reader.
@@ -197,7 +388,11 @@ unsigned int ccreader_process_packet_no_clear(struct ccreader *rdr) {
 	struct ccpacket *pkt = rdr->packet;
 	if (rdr->log->packet)
 		ccpacket_log(pkt, rdr->log, "IN", rdr->name);
-	ptz_stats_count(pkt, CC_DOM_IN);
+	trace_packet(pkt, rdr->trace_id, CC_DOM_IN);
+	chn_stats_add(rdr->stats, STAT_PKTS_IN, 1);
+	/* The cached time is when the poll returned with the input */
+	ccpacket_set_arrived(pkt, time_now_ns(), time_precise_ns());
+	rdr->n_packets++;
 	ccpacket_set_timeout(pkt, rdr->timeout);
 	return ccreader_do_writers(rdr);
 }
@@ -211,5 +406,27 @@ unsigned int ccreader_process_packet_no_clear(struct ccreader *rdr) {
 unsigned int ccreader_process_packet(struct ccreader *rdr) {
 	unsigned int res = ccreader_process_packet_no_clear(rdr);
 	ccpacket_clear(rdr->packet);
+	ccreader_set_frame(rdr, NULL, 0);
 	return res;
 }
+
+/*
+ * ccreader_read_peer	Read packets received from one peer.  The peer has its
+ *			own packet, so decoding state is never shared with
+ *			other peers.
+ *
+ * pkt: packet being decoded for the peer
+ * rxbuf: buffer of data received from the peer
+ * return: number of packets processed
+ */
+unsigned int ccreader_read_peer(struct ccreader *rdr, struct ccpacket *pkt,
+	struct buffer *rxbuf)
+{
+	struct ccpacket *packet = rdr->packet;
+	unsigned int n_packets = rdr->n_packets;
+
+	rdr->packet = pkt;
+	rdr->do_read(rdr, rxbuf);
+	rdr->packet = packet;
+	return rdr->n_packets - n_packets;
+}
@@ -4,8 +4,10 @@
 #include "buffer.h"
 #include "ccpacket.h"
 #include "log.h"
+#include "stats.h"
 
 #define DEFAULT_TIMEOUT (1000)
+#define MAX_ROUTE_RECEIVER (1024)	/* highest receiver in route table */
 
 enum rdr_flags_t {
 	PT_DEADZONE = (1 << 0),	/* pan/tilt values skip over deadzone */
@@ -24,12 +26,33 @@ struct ccnode {
 	struct	ccnode		*next;		/* next node in the list */
 };
 
+/*
+ * A route is one precomputed target for packets to a receiver address: the
+ * writer and the (shifted) receiver address to write.
+ */
+struct ccroute {
+	struct	ccwriter	*writer;	/* writer for this route */
+	int			receiver;	/* output receiver address */
+};
+
+struct ccwriter;
+struct shard;
+
 struct ccreader {
 	void	(*do_read)	(struct ccreader *rdr, struct buffer *rxbuf);
+	unsigned int (*raw_write) (struct ccwriter *wtr, struct ccpacket *pkt);
 	struct	ccpacket	*packet;	/* camera control packet */
+	const	uint8_t		*frame;		/* raw frame of packet */
+	size_t			n_frame;	/* size of raw frame (bytes) */
 	unsigned int		timeout;	/* time to hold commands (ms) */
 	enum rdr_flags_t	flags;		/* special reader flags */
 	struct	ccnode		*head;		/* head of writer list */
+	unsigned int		*route_first;	/* first route by receiver */
+	struct	ccroute		*routes;	/* routes for all receivers */
+	unsigned int		n_packets;	/* packets processed */
+	uint16_t		trace_id;	/* channel ID for packet trace */
+	struct	chn_stats	*stats;		/* counters of input channel */
+	struct	shard		*shard;		/* shard running the reader */
 	const char		*name;		/* channel name */
 	struct	log		*log;		/* message logger */
 };
@@ -39,9 +62,15 @@ struct ccreader *ccreader_init(struct ccreader *rdr, const char *name,
 void ccreader_destroy(struct ccreader *rdr);
 void ccreader_previous_camera(struct ccreader *rdr);
 void ccreader_next_camera(struct ccreader *rdr);
+void ccreader_set_frame(struct ccreader *rdr, const uint8_t *frame,
+	size_t n_bytes);
 void ccreader_add_writer(struct ccreader *rdr, struct ccnode *node,
 	struct ccwriter *wtr, const char *range, const char *shift);
+void ccreader_compile_routes(struct ccreader *rdr);
+void ccreader_decode_error(struct ccreader *rdr);
 unsigned int ccreader_process_packet_no_clear(struct ccreader *rdr);
 unsigned int ccreader_process_packet(struct ccreader *rdr);
+unsigned int ccreader_read_peer(struct ccreader *rdr, struct ccpacket *pkt,
+	struct buffer *rxbuf);
 
 #endif
@@ -12,7 +12,9 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <string.h>		/* for strcpy, strlen */
+#include <stdio.h>		/* for snprintf */
+#include <stdlib.h>		/* for aligned_alloc, calloc, free, malloc */
+#include <string.h>		/* for memcpy, strcpy, strlen */
 #include <strings.h>		/* for strcasecmp */
 #include "ccwriter.h"
 #include "stats.h"
@@ -23,6 +25,7 @@
 #include "pelco_d.h"
 #include "pelco_p.h"
 #include "timeval.h"
+#include "trace.h"
 #include "vicon.h"
 
 /*
@@ -31,7 +34,8 @@
 static int ccwriter_set_receivers(struct ccwriter *wtr, const int n_rcv) {
 	int i;
 
-	wtr->deferred = malloc(sizeof(struct deferred_pkt) * n_rcv);
+	wtr->deferred = aligned_alloc(_Alignof(struct deferred_pkt),
+		sizeof(struct deferred_pkt) * n_rcv);
 	if(wtr->deferred == NULL)
 		return -1;
 	for(i = 0; i < n_rcv; i++) {
@@ -52,6 +56,7 @@ static int ccwriter_set_receivers(struct ccwriter *wtr, const int n_rcv) {
 static int ccwriter_set_protocol(struct ccwriter *wtr, const char *protocol) {
 	if(strcasecmp(protocol, "manchester") == 0) {
 		wtr->do_write = manchester_do_write;
+		wtr->shared = true;
 		wtr->gaptime = MANCHESTER_GAPTIME;
 		wtr->timeout = MANCHESTER_TIMEOUT;
 		return ccwriter_set_receivers(wtr, MANCHESTER_MAX_ADDRESS);
@@ -62,16 +67,19 @@ static int ccwriter_set_protocol(struct ccwriter *wtr, const char *protocol) {
 		return ccwriter_set_receivers(wtr, PELCO_D_MAX_ADDRESS);
 	} else if(strcasecmp(protocol, "pelco_d") == 0) {
 		wtr->do_write = pelco_d_do_write;
+		wtr->shared = true;
 		wtr->gaptime = PELCO_D_GAPTIME;
 		wtr->timeout = PELCO_D_TIMEOUT;
 		return ccwriter_set_receivers(wtr, PELCO_D_MAX_ADDRESS);
 	} else if(strcasecmp(protocol, "pelco_p") == 0) {
 		wtr->do_write = pelco_p_do_write;
+		wtr->shared = true;
 		wtr->gaptime = PELCO_P_GAPTIME;
 		wtr->timeout = PELCO_P_TIMEOUT;
 		return ccwriter_set_receivers(wtr, PELCO_P_MAX_ADDRESS);
 	} else if(strcasecmp(protocol, "vicon") == 0) {
 		wtr->do_write = vicon_do_write;
+		wtr->shared = true;
 		wtr->gaptime = VICON_GAPTIME;
 		wtr->timeout = VICON_TIMEOUT;
 		return ccwriter_set_receivers(wtr, VICON_MAX_ADDRESS);
@@ -81,6 +89,12 @@ static int ccwriter_set_protocol(struct ccwriter *wtr, const char *protocol) {
 		wtr->gaptime = AXIS_GAPTIME;
 		wtr->timeout = AXIS_TIMEOUT;
 		return ccwriter_set_receivers(wtr, AXIS_MAX_ADDRESS);
+	} else if(strcasecmp(protocol, "axis_keepalive") == 0) {
+		wtr->do_write = axis_keepalive_do_write;
+		wtr->chn->flags |= FLAG_RESP_REQUIRED | FLAG_KEEPALIVE;
+		wtr->gaptime = AXIS_GAPTIME;
+		wtr->timeout = AXIS_TIMEOUT;
+		return ccwriter_set_receivers(wtr, AXIS_MAX_ADDRESS);
 	} else {
 		log_println(wtr->chn->log, "Unknown protocol: %s", protocol);
 		return -1;
@@ -103,6 +117,16 @@ struct ccwriter *ccwriter_init(struct ccwriter *wtr, struct channel *chn,
 	wtr->n_rcv = 0;
 	wtr->timeout = DEFAULT_TIMEOUT;
 	wtr->auth = NULL;
+	wtr->shard = NULL;
+	wtr->trace_id = trace_channel(chn->name, chn->service);
+	wtr->shared = false;
+	wtr->overflow = false;
+	wtr->src = NULL;
+	wtr->unwritten = 0;
+	wtr->next_unwritten = NULL;
+	wtr->route = calloc(ROUTE_STAGES, sizeof(struct histogram));
+	if(wtr->route == NULL)
+		return NULL;
 	if(auth && strlen(auth) > 0) {
 		wtr->auth = malloc(strlen(auth) + 1);
 		if(wtr->auth == NULL)
@@ -127,21 +151,35 @@ void ccwriter_destroy(struct ccwriter *wtr) {
 		deferred_pkt_destroy(dpkt);
 	}
 	free(wtr->deferred);
+	free(wtr->route);
 	memset(wtr, 0, sizeof(struct ccwriter));
 }
 
 /*
- * ccwriter_append	Append data to the camera control writer.
+ * ccwriter_reserve	Reserve space for data in the camera control writer.
  *
- * n_bytes: number of bytes to append
- * return: borrowed pointer to appended data
+ * n_bytes: number of bytes to reserve
+ * return: borrowed pointer to reserved space (not initialized)
  */
-void *ccwriter_append(struct ccwriter *wtr, size_t n_bytes) {
-	void *mess = buffer_append(&wtr->chn->txbuf, n_bytes);
+static void *ccwriter_reserve(struct ccwriter *wtr, size_t n_bytes) {
+	void *mess;
+	/* Don't queue stale packets while waiting to retry opening */
+	if(channel_is_parked(wtr->chn)) {
+		wtr->overflow = true;
+		return NULL;
+	}
+	/* Note when output was queued, to measure response latency or
+	 * serial queueing delay */
+	if((wtr->chn->flags & FLAG_RESP_REQUIRED || wtr->chn->byte_ns) &&
+	   buffer_is_empty(&wtr->chn->txbuf))
+		timeval_set_now(&wtr->chn->queued);
+	mess = buffer_append(&wtr->chn->txbuf, n_bytes);
 	if(mess) {
-		memset(mess, 0, n_bytes);
+		channel_touch(wtr->chn);
 		return mess;
 	} else {
+		wtr->overflow = true;
+		chn_stats_add(&wtr->chn->stats, STAT_OVERFLOWS, 1);
 		log_println(wtr->chn->log,
 			"ccwriter_append (%s): output buffer full",
 			wtr->chn->name);
@@ -150,13 +188,49 @@ void *ccwriter_append(struct ccwriter *wtr, size_t n_bytes) {
 }
 
 /*
- * ccwriter_too_soon	Test if the current packet is too soon after the
- * 			previous packet.
+ * ccwriter_append	Append data to the camera control writer.
+ *
+ * n_bytes: number of bytes to append
+ * return: borrowed pointer to appended data (zeroed)
+ */
+void *ccwriter_append(struct ccwriter *wtr, size_t n_bytes) {
+	void *mess = ccwriter_reserve(wtr, n_bytes);
+	if(mess)
+		memset(mess, 0, n_bytes);
+	return mess;
+}
+
+/*
+ * ccwriter_append_bytes	Append a copy of some bytes to the camera control
+ *				writer.
+ *
+ * data: bytes to copy
+ * n_bytes: number of bytes to append
+ * return: true on success; false if the bytes could not be appended
  */
-static bool ccwriter_too_soon(struct ccwriter *wtr,
+bool ccwriter_append_bytes(struct ccwriter *wtr, const void *data,
+	size_t n_bytes)
+{
+	void *mess = ccwriter_reserve(wtr, n_bytes);
+	if(mess) {
+		memcpy(mess, data, n_bytes);
+		return true;
+	} else
+		return false;
+}
+
+/*
+ * ccwriter_gap_left	Get the time left until the packet gap after the
+ *			previous packet has passed.
+ *
+ * return: time left (ms); zero or negative if the gap has passed
+ */
+static long ccwriter_gap_left(struct ccwriter *wtr,
 	const struct deferred_pkt *dpkt)
 {
-	return time_since(&dpkt->sent) < wtr->gaptime;
+	struct timeval now;
+	timeval_set_now(&now);
+	return wtr->gaptime - time_elapsed(&dpkt->sent, &now);
 }
 
 /*
@@ -165,39 +239,277 @@ static bool ccwriter_too_soon(struct ccwriter *wtr,
 static void ccwriter_check_deferred(struct ccwriter *wtr, struct ccpacket *pkt,
 	struct deferred_pkt *dpkt)
 {
-	timeval_set_now(&dpkt->sent);
+	/* The gap starts once the packet has been transmitted */
+	channel_wire_done(wtr->chn, &dpkt->sent);
 	/* If the packet expires after the protocol timeout, defer it to
 	 * be sent again after the "defer" interval passes. */
 	if(ccpacket_is_stop(pkt)) {
 		if(dpkt->n_cnt < 1) {
 			defer_packet(wtr->defer, dpkt, pkt, wtr->gaptime);
 			dpkt->n_cnt++;
-			return;
+			goto repeat;
 		} else
 			dpkt->n_cnt = 0;
 	} else if(ccpacket_is_expired(pkt, wtr->timeout)) {
 		defer_packet(wtr->defer, dpkt, pkt, wtr->timeout);
-		return;
+		goto repeat;
 	}
 	defer_packet(wtr->defer, dpkt, NULL, 0);
+	return;
+repeat:
+	/* A repeat is not new input, so it has no route latency */
+	ccpacket_set_arrived(dpkt->packet, 0, 0);
 }
 
 /*
- * ccwriter_do_write_	Process one packet for the writer.
+ * ccencode_clear	Clear all encodings from an encode cache.
+ */
+void ccencode_clear(struct ccencode *enc) {
+	enc->n_encodings = 0;
+}
+
+/*
+ * ccencode_find	Find a cached encoding for a writer.
+ *
+ * return: cached encoding, or NULL if not found
+ */
+static const struct ccencoding *ccencode_find(const struct ccencode *enc,
+	const struct ccwriter *wtr, int receiver)
+{
+	unsigned int i;
+	for(i = 0; i < enc->n_encodings; i++) {
+		const struct ccencoding *cen = enc->encoding + i;
+		if(cen->do_write == wtr->do_write && cen->receiver == receiver)
+			return cen;
+	}
+	return NULL;
+}
+
+/*
+ * ccencode_next	Get the next free encoding in the cache.
+ *
+ * n_bytes: number of encoded bytes
+ * return: free encoding, or NULL if cache is full or encoding is too big
+ */
+static struct ccencoding *ccencode_next(struct ccencode *enc, size_t n_bytes) {
+	if(enc->n_encodings >= CCENCODE_MAX || n_bytes > CCENCODE_SZ)
+		return NULL;
+	else
+		return enc->encoding + enc->n_encodings++;
+}
+
+/*
+ * ccencode_put		Put an encoding into the cache.
+ *
+ * do_write: protocol write function which would produce the encoding
+ * receiver: output receiver address
+ * mess: encoded bytes
+ * n_bytes: number of encoded bytes
+ */
+void ccencode_put(struct ccencode *enc, ccwriter_do_write_fn *do_write,
+	int receiver, const void *mess, size_t n_bytes)
+{
+	struct ccencoding *cen = ccencode_next(enc, n_bytes);
+	if(cen) {
+		cen->do_write = do_write;
+		cen->receiver = receiver;
+		cen->c = 1;
+		cen->n_bytes = n_bytes;
+		memcpy(cen->mess, mess, n_bytes);
+	}
+}
+
+/*
+ * ccencode_add		Add an encoding to the cache from the bytes which a
+ *			writer just appended to its transmit buffer.
+ *
+ * c: result of do_write
+ * offset: offset in transmit buffer of the encoded bytes
+ */
+static void ccencode_add(struct ccencode *enc, const struct ccwriter *wtr,
+	int receiver, unsigned int c, size_t offset)
+{
+	const struct buffer *txbuf = &wtr->chn->txbuf;
+	size_t n_bytes = buffer_available(txbuf) - offset;
+	struct ccencoding *cen = ccencode_next(enc, n_bytes);
+
+	if(cen) {
+		cen->do_write = wtr->do_write;
+		cen->receiver = receiver;
+		cen->c = c;
+		cen->n_bytes = buffer_copy(txbuf, offset, cen->mess, n_bytes);
+	}
+}
+
+/*
+ * ccwriter_encode	Encode a packet, reusing a cached encoding if possible.
+ *
+ * enc: encode cache (may be NULL)
+ * return: result of do_write
  */
-static int ccwriter_do_write_(struct ccwriter *wtr, struct ccpacket *pkt) {
+static unsigned int ccwriter_encode(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct ccencode *enc)
+{
+	int receiver = ccpacket_get_receiver(pkt);
+	const struct ccencoding *cen;
+	size_t offset;
 	unsigned int c;
-	struct deferred_pkt *dpkt =
-		wtr->deferred + ccpacket_get_receiver(pkt) - 1;
 
-	/* If it is too soon after the previous packet, defer until later */
-	if(ccwriter_too_soon(wtr, dpkt)) {
-		defer_packet(wtr->defer, dpkt, pkt, wtr->gaptime);
-		return 0;
+	if(enc == NULL)
+		return wtr->do_write(wtr, pkt);
+	/* A raw input frame is found here for any same-protocol writer */
+	cen = ccencode_find(enc, wtr, receiver);
+	if(cen) {
+		if(cen->n_bytes && !ccwriter_append_bytes(wtr, cen->mess,
+			cen->n_bytes))
+		{
+			return 0;
+		}
+		ptz_stats_encode_saved();
+		return cen->c;
 	}
+	/* Menu commands are adjusted by each protocol, so don't share */
+	if(!wtr->shared || ccpacket_get_menu(pkt))
+		return wtr->do_write(wtr, pkt);
+	offset = buffer_available(&wtr->chn->txbuf);
 	c = wtr->do_write(wtr, pkt);
+	if(!wtr->overflow)
+		ccencode_add(enc, wtr, receiver, c, offset);
+	return c;
+}
+
+/*
+ * ccwriter_sample	Add route latency samples for a packet read from input:
+ *			the time to decode it, and the time it waited (queued
+ *			between shards, deferred or pending) until it was
+ *			encoded.  Its write is sampled by ccwriter_wrote.
+ */
+static void ccwriter_sample(struct ccwriter *wtr, const struct ccpacket *pkt) {
+	uint64_t arrived = ccpacket_get_arrived(pkt);
+	uint64_t decoded = ccpacket_get_decoded(pkt);
+	uint64_t now;
+
+	if(arrived == 0)
+		return;
+	now = time_precise_ns();
+	histogram_add(wtr->route + ROUTE_DECODE, decoded - arrived);
+	histogram_add(wtr->route + ROUTE_QUEUE, now - decoded);
+	if(wtr->unwritten == 0) {
+		wtr->unwritten = now;
+		wtr->next_unwritten = wtr->chn->unwritten;
+		wtr->chn->unwritten = wtr;
+	}
+}
+
+/*
+ * ccwriter_wrote	Add route latency samples for each writer with commands
+ *			in the transmit buffer, once it has been written.  One
+ *			sample is taken for the oldest command of each writer.
+ *
+ * head: head of list of writers with output (unwritten or staged)
+ * written: true if the buffer was written; false if it was discarded
+ */
+void ccwriter_wrote(struct ccwriter **head, bool written) {
+	uint64_t now = written ? time_precise_ns() : 0;
+	struct ccwriter *wtr;
+
+	while((wtr = *head)) {
+		*head = wtr->next_unwritten;
+		if(written) {
+			histogram_add(wtr->route + ROUTE_WRITE,
+				now - wtr->unwritten);
+		}
+		wtr->unwritten = 0;
+		wtr->next_unwritten = NULL;
+	}
+}
+
+/*
+ * ccwriter_log_route	Log the route latency histograms of a writer.
+ */
+void ccwriter_log_route(const struct ccwriter *wtr) {
+	static const char *stage[ROUTE_STAGES] = { "decode", "queue", "write" };
+	char label[128];
+	int i;
+
+	for(i = 0; i < ROUTE_STAGES; i++) {
+		snprintf(label, sizeof(label), "route %s:%s -> %s:%s %s",
+			wtr->src ? wtr->src->name : "?",
+			wtr->src ? wtr->src->service : "", wtr->chn->name,
+			wtr->chn->service, stage[i]);
+		histogram_log(wtr->route + i, wtr->chn->log, label);
+	}
+}
+
+/*
+ * ccwriter_log_latency	Log pending latency histograms for all receivers,
+ *			and start a new interval.
+ */
+static void ccwriter_log_latency(struct ccwriter *wtr) {
+	char label[64];
+	int i;
+
+	for(i = 0; i < wtr->n_rcv; i++) {
+		struct deferred_pkt *dpkt = wtr->deferred + i;
+		if(dpkt->latency.head.n_samples) {
+			snprintf(label, sizeof(label), "latency %s:%s rcv %d",
+				wtr->chn->name, wtr->chn->service, i + 1);
+			histogram_coarse_log(&dpkt->latency, wtr->chn->log,
+				label);
+			histogram_coarse_clear(&dpkt->latency);
+		}
+	}
+}
+
+/*
+ * ccwriter_log_stats	Log the counters and pending latency histograms of all
+ *			receivers of a writer.
+ *
+ * ms: length of interval (ms)
+ */
+void ccwriter_log_stats(struct ccwriter *wtr, unsigned int ms) {
+	unsigned int i;
+
+	for(i = 0; i < wtr->n_rcv; i++) {
+		ptz_stats_report_rcv(&wtr->deferred[i].stats, wtr->chn->name,
+			wtr->chn->service, i + 1, ms);
+	}
+	ccwriter_log_latency(wtr);
+}
+
+/*
+ * ccwriter_send	Encode one packet into the transmit buffer.  If the
+ *			buffer fills up partway through, the partial message is
+ *			discarded, so it is never sent (or joined with the next
+ *			datagram).
+ *
+ * enc: encode cache (may be NULL)
+ * return: result of do_write; 0 if the buffer overflowed
+ */
+static unsigned int ccwriter_send(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct ccencode *enc, struct deferred_pkt *dpkt)
+{
+	struct buffer *txbuf = &wtr->chn->txbuf;
+	size_t n_bytes = buffer_available(txbuf);
+	unsigned int c;
+
+	wtr->overflow = false;
+	c = ccwriter_encode(wtr, pkt, enc);
+	if(wtr->overflow) {
+		buffer_truncate(txbuf, n_bytes);
+		return 0;
+	}
 	if(c > 0) {
-		ptz_stats_count(pkt, CC_DOM_OUT);
+		/* Remember how many bytes the command took on the line */
+		if(buffer_available(txbuf) >= n_bytes)
+			dpkt->cost = buffer_available(txbuf) - n_bytes;
+		else
+			dpkt->cost = buffer_available(txbuf);
+		channel_end_message(wtr->chn);
+		chn_stats_add(&wtr->chn->stats, STAT_PKTS_OUT, 1);
+		dpkt->stats.n[RCV_PKTS]++;
+		trace_packet(pkt, wtr->trace_id, CC_DOM_OUT);
+		ccwriter_sample(wtr, pkt);
 		ccwriter_check_deferred(wtr, pkt, dpkt);
 		if(wtr->chn->log->packet)
 			ccpacket_log(pkt, wtr->chn->log, "OUT", wtr->chn->name);
@@ -206,12 +518,216 @@ static int ccwriter_do_write_(struct ccwriter *wtr, struct ccpacket *pkt) {
 }
 
 /*
- * ccwriter_do_write	Process one packet for the writer.
+ * ccwriter_is_saturated	Test if an output line cannot take any more
+ *				commands right now.
+ *
+ * chn: output channel
  */
-int ccwriter_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
+static bool ccwriter_is_saturated(const struct channel *chn) {
+	return channel_backlog(chn) >= CCWRITER_TX_LOW &&
+	      !channel_is_parked(chn);
+}
+
+/*
+ * ccwriter_must_send	Test if a command must never be replaced by a newer
+ *			one.  Unlike movement, these commands are not repeated.
+ */
+static bool ccwriter_must_send(struct ccpacket *pkt) {
+	return ccpacket_is_stop(pkt) || ccpacket_get_preset_mode(pkt) ||
+	       ccpacket_get_menu(pkt);
+}
+
+/*
+ * ccwriter_is_prio	Test if a command is in the priority class, which is
+ *			sent before any other pending commands.
+ */
+static bool ccwriter_is_prio(struct ccpacket *pkt) {
+	return ccpacket_is_stop(pkt) || ccpacket_get_preset_mode(pkt) ||
+	       ccpacket_get_camera(pkt);
+}
+
+/*
+ * ccwriter_count_dropped	Count one command replaced by a newer one.
+ */
+static void ccwriter_count_dropped(struct ccwriter *wtr,
+	struct deferred_pkt *dpkt)
+{
+	chn_stats_add(&wtr->chn->stats, STAT_DROPPED, 1);
+	dpkt->stats.n[RCV_DROPPED]++;
+}
+
+/*
+ * ccwriter_hold	Hold a command behind a pending one which must be
+ *			sent.  Held commands which must be sent are kept in
+ *			order; only a held movement command is replaced by a
+ *			newer one.  A command is dropped if the queue is full.
+ */
+static void ccwriter_hold(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct deferred_pkt *dpkt)
+{
+	if(dpkt->n_held) {
+		struct ccpacket *tail = dpkt->held[dpkt->n_held - 1];
+		if(!ccwriter_must_send(tail)) {
+			ccwriter_count_dropped(wtr, dpkt);
+			ccpacket_copy(tail, pkt);
+			return;
+		}
+	}
+	if(dpkt->n_held >= HELD_MAX) {
+		ccwriter_count_dropped(wtr, dpkt);
+		log_println(wtr->chn->log, "ccwriter (%s:%s): dropped "
+			"command for receiver %d", wtr->chn->name,
+			wtr->chn->service, ccpacket_get_receiver(pkt));
+		return;
+	}
+	ccpacket_copy(dpkt->held[dpkt->n_held], pkt);
+	dpkt->n_held++;
+}
+
+/*
+ * ccwriter_pend	Hold a command until the output line can take it.  A
+ *			newer command for the same receiver replaces the one
+ *			pending, unless it must be sent; then the newer command
+ *			waits behind it.  It also waits behind a command which
+ *			must be sent and is deferred until the packet gap.
+ */
+static void ccwriter_pend(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct deferred_pkt *dpkt)
+{
+	if(dpkt->is_pending) {
+		if(ccwriter_must_send(dpkt->pending)) {
+			ccwriter_hold(wtr, pkt, dpkt);
+			goto cancel;
+		}
+		ccwriter_count_dropped(wtr, dpkt);
+	} else if(dpkt->is_gapped) {
+		ccwriter_hold(wtr, pkt, dpkt);
+		return;
+	} else
+		timeval_set_now(&dpkt->pended);
+	ccpacket_copy(dpkt->pending, pkt);
+	sched_add(&wtr->chn->sched, dpkt, ccwriter_is_prio(pkt));
+cancel:
+	/* An older deferred command must not replace this one */
+	defer_packet(wtr->defer, dpkt, NULL, 0);
+}
+
+/*
+ * ccwriter_unhold	Make the oldest held command pending, once the command
+ *			ahead of it has been sent.
+ */
+static void ccwriter_unhold(struct ccwriter *wtr, struct deferred_pkt *dpkt) {
+	if(dpkt->n_held && !dpkt->is_pending) {
+		struct ccpacket *pkt = dpkt->pending;
+		unsigned int i;
+		dpkt->pending = dpkt->held[0];
+		dpkt->n_held--;
+		for(i = 0; i < dpkt->n_held; i++)
+			dpkt->held[i] = dpkt->held[i + 1];
+		dpkt->held[dpkt->n_held] = pkt;
+		timeval_set_now(&dpkt->pended);
+		sched_add(&wtr->chn->sched, dpkt,
+			ccwriter_is_prio(dpkt->pending));
+	}
+}
+
+/*
+ * ccwriter_count_deferred	Count one packet which could not be sent yet.
+ */
+static void ccwriter_count_deferred(struct ccwriter *wtr,
+	struct deferred_pkt *dpkt)
+{
+	chn_stats_add(&wtr->chn->stats, STAT_DEFERRED, 1);
+	dpkt->stats.n[RCV_DEFERRED]++;
+}
+
+/*
+ * ccwriter_do_write_	Process one packet for the writer.
+ */
+static int ccwriter_do_write_(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct ccencode *enc)
+{
+	struct deferred_pkt *dpkt =
+		wtr->deferred + ccpacket_get_receiver(pkt) - 1;
+	long gap = ccwriter_gap_left(wtr, dpkt);
+	unsigned int c;
+
+	if(pkt == dpkt->packet) {
+		/* A deferred repeat is older than a command which became
+		 * pending after it was scheduled */
+		if(dpkt->is_pending)
+			return 0;
+		dpkt->is_gapped = false;
+	}
+	/* If an older command is pending, or must be sent after the gap,
+	 * queue the packet behind it */
+	if(dpkt->is_pending || dpkt->is_gapped) {
+		ccwriter_count_deferred(wtr, dpkt);
+		ccwriter_pend(wtr, pkt, dpkt);
+		return 0;
+	}
+	/* If it is too soon after the previous packet, defer until the gap
+	 * has passed */
+	if(gap > 0) {
+		ccwriter_count_deferred(wtr, dpkt);
+		defer_packet(wtr->defer, dpkt, pkt, gap);
+		dpkt->is_gapped = ccwriter_must_send(pkt);
+		return 0;
+	}
+	/* If the line is saturated, hold the packet until it drains */
+	if(ccwriter_is_saturated(wtr->chn)) {
+		ccwriter_count_deferred(wtr, dpkt);
+		ccwriter_pend(wtr, pkt, dpkt);
+		return 0;
+	}
+	c = ccwriter_send(wtr, pkt, enc, dpkt);
+	/* Even if the command could not be sent, the ones held behind it
+	 * must not be stuck */
+	ccwriter_unhold(wtr, dpkt);
+	return c;
+}
+
+/*
+ * ccwriter_flush	Encode pending commands on a channel while its line can
+ *			take them, in the order chosen by the channel
+ *			scheduler.  This is called after the channel is written.
+ *
+ * chn: output channel
+ */
+void ccwriter_flush(struct channel *chn) {
+	struct deferred_pkt *dpkt;
+	struct timeval now;
+
+	if(sched_is_empty(&chn->sched))
+		return;
+	timeval_set_now(&now);
+	while(!ccwriter_is_saturated(chn) && (dpkt = sched_next(&chn->sched))) {
+		struct ccwriter *wtr = dpkt->writer;
+		histogram_coarse_add(&dpkt->latency,
+			time_elapsed_us(&dpkt->pended, &now) * 1000);
+		ccwriter_do_write_(wtr, dpkt->pending, NULL);
+	}
+}
+
+/*
+ * ccwriter_do_write_shared	Process one packet for the writer, sharing
+ *				encodings with other writers.
+ *
+ * enc: encode cache for the packet (may be NULL)
+ */
+int ccwriter_do_write_shared(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct ccencode *enc)
+{
 	int receiver = ccpacket_get_receiver(pkt);
 	if(receiver > 0 && receiver <= wtr->n_rcv)
-		return ccwriter_do_write_(wtr, pkt);
+		return ccwriter_do_write_(wtr, pkt, enc);
 	else
 		return 0;
 }
+
+/*
+ * ccwriter_do_write	Process one packet for the writer.
+ */
+int ccwriter_do_write(struct ccwriter *wtr, struct ccpacket *pkt) {
+	return ccwriter_do_write_shared(wtr, pkt, NULL);
+}
@@ -5,8 +5,49 @@
 #include "channel.h"	/* for struct channel */
 #include "defer.h"	/* for struct deferred_pkt, defer */
 
+struct ccwriter;
+struct shard;
+
+typedef unsigned int (ccwriter_do_write_fn) (struct ccwriter *wtr,
+	struct ccpacket *pkt);
+
+#define CCENCODE_SZ (32)	/* maximum size of one shared encoding */
+#define CCENCODE_MAX (4)	/* maximum shared encodings per packet */
+#define CCWRITER_TX_LOW (64)	/* transmit bytes before commands pend */
+
+/*
+ * Stages of route latency, from input arrival to output write.
+ */
+enum route_stage {
+	ROUTE_DECODE,		/* arrival to packet decoded */
+	ROUTE_QUEUE,		/* decoded to encoded (queued / deferred) */
+	ROUTE_WRITE,		/* encoded to written */
+	ROUTE_STAGES,		/* number of stages */
+};
+
+/*
+ * An encoding is the output of one protocol for one packet and receiver.
+ * It can be shared by all writers with the same protocol.
+ */
+struct ccencoding {
+	ccwriter_do_write_fn	*do_write;	/* protocol write function */
+	int			receiver;	/* output receiver address */
+	unsigned int		c;		/* result of do_write */
+	size_t			n_bytes;	/* number of encoded bytes */
+	uint8_t			mess[CCENCODE_SZ]; /* encoded bytes */
+};
+
+/*
+ * An encode cache holds the encodings for one packet while it is written
+ * to all linked writers.
+ */
+struct ccencode {
+	struct ccencoding	encoding[CCENCODE_MAX];	/* cached encodings */
+	unsigned int		n_encodings;	/* number of encodings */
+};
+
 struct ccwriter {
-	unsigned int (*do_write) (struct ccwriter *wtr, struct ccpacket *pkt);
+	ccwriter_do_write_fn	*do_write;	/* protocol write function */
 	struct channel		*chn;		/* channel to write */
 	struct deferred_pkt	*deferred;	/* deferred packets */
 	unsigned int		n_rcv;		/* number of receivers */
@@ -14,6 +55,15 @@ struct ccwriter {
 	unsigned int		timeout;	/* time command is held (ms) */
 	char			*auth;		/* authentication token */
 	struct defer		*defer;		/* deferred packet handler */
+	struct shard		*shard;		/* shard running the writer */
+	uint16_t		trace_id;	/* channel ID for packet trace */
+	bool			shared;		/* encoding can be shared */
+	bool			overflow;	/* append failed on encode */
+	const struct channel	*src;		/* input channel of route */
+	struct histogram	*route;		/* route latency, by stage */
+	uint64_t		unwritten;	/* encode time (ns) of oldest
+						 * unwritten command, or 0 */
+	struct ccwriter		*next_unwritten; /* next with unwritten */
 	struct ccwriter		*next;		/* next writer */
 };
 
@@ -23,6 +73,17 @@ struct ccwriter *ccwriter_init(struct ccwriter *writer, struct channel *chn,
 	const char *protocol, const char *auth);
 void ccwriter_destroy(struct ccwriter *wtr);
 void *ccwriter_append(struct ccwriter *wtr, size_t n_bytes);
+bool ccwriter_append_bytes(struct ccwriter *wtr, const void *data,
+	size_t n_bytes);
 int ccwriter_do_write(struct ccwriter *wtr, struct ccpacket *pkt);
+void ccencode_clear(struct ccencode *enc);
+void ccencode_put(struct ccencode *enc, ccwriter_do_write_fn *do_write,
+	int receiver, const void *mess, size_t n_bytes);
+int ccwriter_do_write_shared(struct ccwriter *wtr, struct ccpacket *pkt,
+	struct ccencode *enc);
+void ccwriter_flush(struct channel *chn);
+void ccwriter_wrote(struct ccwriter **head, bool written);
+void ccwriter_log_route(const struct ccwriter *wtr);
+void ccwriter_log_stats(struct ccwriter *wtr, unsigned int ms);
 
 #endif
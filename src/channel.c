@@ -12,6 +12,7 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#define _GNU_SOURCE		/* for recvmmsg */
 #include <assert.h>		/* for assert */
 #include <errno.h>		/* for EINPROGRESS, EINTR */
 #include <fcntl.h>		/* for open, O_RDWR, O_NOCTTY, O_NONBLOCK */
@@ -21,8 +22,33 @@
 #include <string.h>		/* for memset, memcpy, strlen, strcpy */
 #include <termios.h>		/* for serial port stuff */
 #include "channel.h"		/* for struct channel and prototypes */
+#include "ccwriter.h"		/* for ccwriter_flush */
+#include "stats.h"		/* for ptz_stats_response, chn_stats_add */
+#include "timeval.h"		/* for timeval_set_now, time_from_now */
 
 #define BUFFER_SIZE 256
+#define BUFFER_MAX 65536
+
+/* Time to cache resolved addresses (ms) */
+#define ADDR_TTL (300 * 1000)
+
+/* Time to cache failed name lookups (ms) */
+#define ADDR_ERROR_TTL (30 * 1000)
+
+/* Wire time written ahead to keep a serial transmitter busy (us) */
+#define WIRE_AHEAD (5 * 1000)
+
+/* Maximum datagrams received with one system call */
+#define RECV_MSG_MAX (16)
+
+/* Largest datagram decoded (bytes) */
+#define DGRAM_MAX (512)
+
+/* Backlog of connections waiting to be accepted on a TCP listen channel */
+#define LISTEN_BACKLOG (16)
+
+/* Maximum clients connected to one TCP listen channel */
+#define CLIENT_MAX (64)
 
 /*
  * channel_log		Log a message related to the I/O channel.
@@ -52,36 +78,79 @@ struct channel* channel_init(struct channel *chn, const char *name,
 	chn->name[sizeof(chn->name) - 1] = '\0';
 	strncpy(chn->service, service, sizeof(chn->service));
 	chn->service[sizeof(chn->service) - 1] = '\0';
-	if(buffer_init(&chn->rxbuf, BUFFER_SIZE) == NULL)
+	if(buffer_init(&chn->rxbuf, BUFFER_SIZE, BUFFER_MAX) == NULL)
 		goto fail;
-	if(buffer_init(&chn->txbuf, BUFFER_SIZE) == NULL)
+	if(buffer_init(&chn->txbuf, BUFFER_SIZE, BUFFER_MAX) == NULL)
+		goto fail;
+	if(buffer_init(&chn->reqbuf, BUFFER_SIZE, BUFFER_MAX) == NULL)
 		goto fail;
 	chn->reader = NULL;
+	chn->pfd = -1;
+	wheel_node_init(&chn->retry);
+	wheel_node_init(&chn->pace);
+	sched_init(&chn->sched);
 	return chn;
 fail:
 	memset(chn, 0, sizeof(struct channel));
 	return NULL;
 }
 
+/*
+ * channel_set_buffer	Set the buffer limits for the I/O channel.
+ *
+ * max: maximum size of receive and transmit buffers (bytes)
+ * hwm: high-water mark of receive buffer (bytes)
+ */
+void channel_set_buffer(struct channel *chn, size_t max, size_t hwm) {
+	buffer_set_limits(&chn->rxbuf, max, hwm);
+	buffer_set_limits(&chn->txbuf, max, max);
+	buffer_set_limits(&chn->reqbuf, max, max);
+}
+
 /*
  * channel_destroy	Destroy the previously initialized I/O channel.
  */
 void channel_destroy(struct channel *chn) {
+	while(chn->clients)
+		channel_destroy_client(chn->clients);
 	channel_close(chn);
+	if(chn->lookup)
+		resolver_cancel(chn->resolver, chn->lookup);
+	if(chn->addr)
+		freeaddrinfo(chn->addr);
 	buffer_destroy(&chn->rxbuf);
 	buffer_destroy(&chn->txbuf);
+	buffer_destroy(&chn->reqbuf);
+	free(chn->dgrams);
+	free(chn->stage);
 	if (chn->reader)
 		ccreader_destroy(chn->reader);
+	if(chn->packet)
+		ccpacket_destroy(chn->packet);
 	memset(chn, 0, sizeof(struct channel));
 }
 
+/*
+ * channel_destroy_client	Remove a client channel from its listen channel,
+ *				then destroy and free it.
+ */
+void channel_destroy_client(struct channel *chn) {
+	struct channel **pc = &chn->parent->clients;
+	while(*pc != chn)
+		pc = &(*pc)->next;
+	*pc = chn->next;
+	chn->parent->n_clients--;
+	channel_destroy(chn);
+	free(chn);
+}
+
 /*
  * channel_is_sport	Test if the channel is a serial port.
  *
  * return: true if channel is a serial port; otherwise false
  */
 static inline bool channel_is_sport(const struct channel *chn) {
-	return chn->name[0] == '/';
+	return chn->name[0] == '/' && !(chn->flags & FLAG_FILE);
 }
 
 /*
@@ -91,9 +160,9 @@ static inline bool channel_is_sport(const struct channel *chn) {
  */
 static enum ch_flag_t channel_flags(const struct channel *chn) {
 	if(channel_is_sport(chn))
-		return FLAG_UDP | FLAG_TCP;
+		return FLAG_UDP | FLAG_TCP | FLAG_FILE;
 	else
-		return FLAG_UDP | FLAG_TCP | FLAG_LISTEN;
+		return FLAG_UDP | FLAG_TCP | FLAG_LISTEN | FLAG_FILE;
 }
 
 /*
@@ -111,15 +180,24 @@ bool channel_matches(struct channel *chn, const char *name, const char *service,
 }
 
 /*
- * channel_sport_baud_mask	Get the baud mask for a serial port channel.
+ * channel_sport_baud	Get the baud rate for a serial port channel.
  *
- * return: baud mask or B0 for invalid baud rate
+ * return: baud rate or 0 for invalid baud rate
  */
-static int channel_sport_baud_mask(struct channel *chn) {
+static int channel_sport_baud(struct channel *chn) {
 	/* serial port baud rate stored in chn->service */
 	int baud;
 	if(sscanf(chn->service, "%d", &baud) != 1)
-		return B0;
+		return 0;
+	return baud;
+}
+
+/*
+ * channel_sport_baud_mask	Get the baud mask for a baud rate.
+ *
+ * return: baud mask or B0 for invalid baud rate
+ */
+static int channel_sport_baud_mask(int baud) {
 	switch(baud) {
 		case 1200:
 			return B1200;
@@ -138,13 +216,42 @@ static int channel_sport_baud_mask(struct channel *chn) {
 	}
 }
 
+/*
+ * channel_wire_bits	Get the number of bits on the wire for each byte,
+ *			including start, parity and stop bits.
+ *
+ * cflag: terminal control mode flags
+ */
+static unsigned int channel_wire_bits(tcflag_t cflag) {
+	unsigned int bits = 1;		/* start bit */
+	switch(cflag & CSIZE) {
+		case CS5:
+			bits += 5;
+			break;
+		case CS6:
+			bits += 6;
+			break;
+		case CS7:
+			bits += 7;
+			break;
+		default:
+			bits += 8;
+			break;
+	}
+	if(cflag & PARENB)
+		bits++;
+	bits += (cflag & CSTOPB) ? 2 : 1;
+	return bits;
+}
+
 /*
  * channel_configure_sport	Configure a serial port for the I/O channel.
  *
  * baud: baud rate mask
+ * rate: baud rate (bits per second)
  * return: 0 on success; -1 on error
  */
-static int channel_configure_sport(struct channel *chn, int baud) {
+static int channel_configure_sport(struct channel *chn, int baud, int rate) {
 	struct termios ttyset;
 
 	ttyset.c_iflag = 0;
@@ -160,6 +267,8 @@ static int channel_configure_sport(struct channel *chn, int baud) {
 		return -1;
 	if(tcsetattr(chn->fd, TCSAFLUSH, &ttyset) < 0)
 		return -1;
+	chn->byte_ns = (uint64_t)channel_wire_bits(ttyset.c_cflag) *
+		1000000000 / rate;
 	return 0;
 }
 
@@ -169,15 +278,19 @@ static int channel_configure_sport(struct channel *chn, int baud) {
  * return: 0 on success; -1 on error
  */
 static int channel_open_sport(struct channel *chn) {
-	int baud;
+	int rate, baud;
 	do {
 		chn->fd = open(chn->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
 	} while(chn->fd < 0 && errno == EINTR);
 	if(chn->fd < 0)
 		goto fail;
-	baud = channel_sport_baud_mask(chn);
-	if((baud != B0) && channel_configure_sport(chn, baud) < 0)
+	rate = channel_sport_baud(chn);
+	baud = channel_sport_baud_mask(rate);
+	if((baud != B0) && channel_configure_sport(chn, baud, rate) < 0)
 		goto fail;
+	timeval_set_now(&chn->wire_idle);
+	chn->gauge_start = chn->wire_idle;
+	chn->queued = chn->wire_idle;
 	return 0;
 fail:
 	channel_log(chn, strerror(errno));
@@ -185,6 +298,22 @@ fail:
 	return -1;
 }
 
+/*
+ * channel_open_file	Open a capture file to replay on the I/O channel.  The
+ *			service is the replay mode.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int channel_open_file(struct channel *chn) {
+	chn->fd = replay_open(&chn->replay, chn->name, chn->service, chn->log);
+	if(chn->fd < 0) {
+		channel_log(chn, strerror(errno));
+		channel_close(chn);
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * channel_set_tcp_keepalive	Set keepalive option on a socket. This is
  *				needed because some sockets never write data,
@@ -236,27 +365,147 @@ fail:
 }
 
 /*
- * channel_open_bind	Open a channel socket and bind
+ * channel_is_localhost	Test if the I/O channel is a localhost address.
  *
- * return: 0 on success; -1 on error
+ * return: true if channel is defined to be a localhost address
  */
-static int channel_open_bind(struct channel *chn, int stype) {
+static bool channel_is_localhost(const struct channel *chn) {
+	if(strstr(chn->name, "localhost") == chn->name)
+		return true;
+	if(strstr(chn->name, "0.0.0.0") == chn->name)
+		return true;
+	return false;
+}
+
+/*
+ * channel_should_listen	Test if the I/O channel should listen.
+ *
+ * return: true if the channel should listen; otherwise false
+ */
+static bool channel_should_listen(const struct channel *chn) {
+	return (chn->flags & FLAG_LISTEN) && channel_is_localhost(chn);
+}
+
+/*
+ * channel_clear_addr	Clear the cached addresses for the I/O channel.
+ */
+static void channel_clear_addr(struct channel *chn) {
+	if(chn->addr) {
+		freeaddrinfo(chn->addr);
+		chn->addr = NULL;
+	}
+	chn->addr_error = 0;
+	timerclear(&chn->addr_expire);
+}
+
+/*
+ * channel_set_addr	Cache resolved addresses for the I/O channel.
+ *
+ * addr: resolved addresses (channel takes ownership), or NULL on error
+ * rc: getaddrinfo return code
+ */
+static void channel_set_addr(struct channel *chn, struct addrinfo *addr,
+	int rc)
+{
+	channel_clear_addr(chn);
+	chn->addr = addr;
+	chn->addr_error = rc;
+	timeval_set_now(&chn->addr_expire);
+	timeval_adjust(&chn->addr_expire, rc ? ADDR_ERROR_TTL : ADDR_TTL);
+}
+
+/*
+ * channel_addr_is_cached	Test if the channel has cached addresses (or
+ *				a cached lookup error).
+ */
+static bool channel_addr_is_cached(const struct channel *chn) {
+	return timerisset(&chn->addr_expire) &&
+	       time_from_now(&chn->addr_expire) > 0;
+}
+
+/*
+ * channel_addr_hints	Get getaddrinfo hints for the I/O channel.
+ */
+static void channel_addr_hints(const struct channel *chn,
+	struct addrinfo *hints)
+{
+	memset(hints, 0, sizeof(struct addrinfo));
+	hints->ai_family = AF_UNSPEC;
+	if(chn->flags & FLAG_UDP) {
+		hints->ai_socktype = SOCK_DGRAM;
+		if(chn->flags & FLAG_LISTEN)
+			hints->ai_flags = AI_PASSIVE;
+	} else {
+		hints->ai_socktype = SOCK_STREAM;
+		if(channel_should_listen(chn))
+			hints->ai_flags = AI_PASSIVE;
+	}
+}
+
+/*
+ * channel_resolve	Resolve the channel host name and service.  Numeric
+ *			addresses are resolved immediately; host names are
+ *			looked up by the resolver thread.  The result is
+ *			cached for a while.
+ *
+ * return: 0 if addresses are ready; -1 if pending or on error
+ */
+static int channel_resolve(struct channel *chn) {
 	struct addrinfo hints;
-	struct addrinfo *ai;
-	struct addrinfo *rai = NULL;
+	struct addrinfo *addr = NULL;
 	int rc;
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = stype;
-	hints.ai_flags = AI_PASSIVE;
-
-	rc = getaddrinfo(chn->name, chn->service, &hints, &rai);
-	if(rc) {
-		channel_log(chn, gai_strerror(rc));
+	if(chn->lookup)
 		return -1;
+	if(channel_addr_is_cached(chn))
+		return chn->addr_error ? -1 : 0;
+	channel_addr_hints(chn, &hints);
+	/* numeric lookups never block */
+	hints.ai_flags |= AI_NUMERICHOST | AI_NUMERICSERV;
+	if(getaddrinfo(chn->name, chn->service, &hints, &addr) == 0) {
+		channel_set_addr(chn, addr, 0);
+		return 0;
+	}
+	hints.ai_flags &= ~(AI_NUMERICHOST | AI_NUMERICSERV);
+	if(chn->resolver == NULL) {
+		rc = getaddrinfo(chn->name, chn->service, &hints, &addr);
+		if(rc)
+			channel_log(chn, gai_strerror(rc));
+		channel_set_addr(chn, rc ? NULL : addr, rc);
+		return rc ? -1 : 0;
 	}
-	for(ai = rai; ai; ai = ai->ai_next) {
+	chn->lookup = resolver_lookup(chn->resolver, chn->name, chn->service,
+		&hints, chn);
+	if(chn->lookup)
+		channel_log(chn, "resolving");
+	else
+		channel_log(chn, strerror(errno));
+	return -1;
+}
+
+/*
+ * channel_resolved	Handle a completed host name lookup for the channel.
+ *
+ * lk: completed lookup (result is taken by the channel)
+ */
+void channel_resolved(struct channel *chn, struct lookup *lk) {
+	chn->lookup = NULL;
+	if(lk->rc)
+		channel_log(chn, gai_strerror(lk->rc));
+	channel_set_addr(chn, lk->result, lk->rc);
+	lk->result = NULL;
+	channel_touch(chn);
+}
+
+/*
+ * channel_open_bind	Open a channel socket and bind
+ *
+ * return: 0 on success; -1 on error
+ */
+static int channel_open_bind(struct channel *chn) {
+	struct addrinfo *ai;
+
+	for(ai = chn->addr; ai; ai = ai->ai_next) {
 		chn->fd = socket(ai->ai_family, ai->ai_socktype,
 			ai->ai_protocol);
 		if(chn->fd < 0) {
@@ -265,16 +514,14 @@ static int channel_open_bind(struct channel *chn, int stype) {
 		}
 		if(channel_config_socket(chn, ai->ai_socktype) < 0)
 			break;
-		if(bind(chn->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
-			freeaddrinfo(rai);
+		if(bind(chn->fd, ai->ai_addr, ai->ai_addrlen) == 0)
 			return 0;
-		}
 		// Log bind error
 		channel_log(chn, strerror(errno));
 		break;
 	}
 	channel_log(chn, "Unable to bind");
-	freeaddrinfo(rai);
+	channel_clear_addr(chn);
 	return -1;
 }
 
@@ -283,23 +530,10 @@ static int channel_open_bind(struct channel *chn, int stype) {
  *
  * return: 0 on success; -1 on error
  */
-static int channel_open_connect(struct channel *chn, int stype) {
-	struct addrinfo hints;
+static int channel_open_connect(struct channel *chn) {
 	struct addrinfo *ai;
-	struct addrinfo *rai = NULL;
-	int rc;
-
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = stype;
-	hints.ai_flags = 0;
 
-	rc = getaddrinfo(chn->name, chn->service, &hints, &rai);
-	if(rc) {
-		channel_log(chn, gai_strerror(rc));
-		return -1;
-	}
-	for(ai = rai; ai; ai = ai->ai_next) {
+	for(ai = chn->addr; ai; ai = ai->ai_next) {
 		chn->fd = socket(ai->ai_family, ai->ai_socktype,
 			ai->ai_protocol);
 		if(chn->fd < 0) {
@@ -310,16 +544,13 @@ static int channel_open_connect(struct channel *chn, int stype) {
 			break;
 		if((connect(chn->fd, ai->ai_addr, ai->ai_addrlen) == 0) ||
 		   (errno == EINPROGRESS))
-		{
-			freeaddrinfo(rai);
 			return 0;
-		}
 		// Log connect error
 		channel_log(chn, strerror(errno));
 		break;
 	}
 	channel_log(chn, "Unable to connect");
-	freeaddrinfo(rai);
+	channel_clear_addr(chn);
 	return -1;
 }
 
@@ -329,7 +560,7 @@ static int channel_open_connect(struct channel *chn, int stype) {
  * return: 0 on success; -1 on error
  */
 static int channel_bind_udp(struct channel *chn) {
-	if(channel_open_bind(chn, SOCK_DGRAM) < 0) {
+	if(channel_open_bind(chn) < 0) {
 		channel_close(chn);
 		return -1;
 	} else
@@ -342,7 +573,7 @@ static int channel_bind_udp(struct channel *chn) {
  * return: 0 on success; -1 on error
  */
 static int channel_connect_udp(struct channel *chn) {
-	if(channel_open_connect(chn, SOCK_DGRAM) < 0) {
+	if(channel_open_connect(chn) < 0) {
 		channel_close(chn);
 		return -1;
 	} else
@@ -367,9 +598,9 @@ static int channel_open_udp(struct channel *chn) {
  * return: 0 on success; -1 on error
  */
 static int channel_listen_tcp(struct channel *chn) {
-	if(channel_open_bind(chn, SOCK_STREAM) < 0)
+	if(channel_open_bind(chn) < 0)
 		goto fail;
-	if(listen(chn->fd, 1) < 0) {
+	if(listen(chn->fd, LISTEN_BACKLOG) < 0) {
 		channel_log(chn, strerror(errno));
 		goto fail;
 	}
@@ -381,18 +612,93 @@ fail:
 }
 
 /*
- * channel_accept	Accept a tcp client connection on the I/O channel.
+ * channel_add_client	Add a client channel for an accepted connection.  The
+ *			client has its own receive buffer and packet, and is
+ *			decoded by the reader of the listen channel.
+ *
+ * fd: file descriptor of accepted connection
+ * addr: socket address of client
+ * addr_len: length of socket address
+ * return: client channel, or NULL on error
+ */
+static struct channel *channel_add_client(struct channel *chn, int fd,
+	const struct sockaddr *addr, socklen_t addr_len)
+{
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	struct channel *cli;
+
+	if(getnameinfo(addr, addr_len, host, sizeof(host), serv, sizeof(serv),
+	   NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+	{
+		strcpy(host, "?");
+		strcpy(serv, "?");
+	}
+	cli = aligned_alloc(_Alignof(struct channel), sizeof(struct channel));
+	if(cli == NULL)
+		return NULL;
+	if(channel_init(cli, host, serv, FLAG_TCP, chn->log) == NULL) {
+		free(cli);
+		return NULL;
+	}
+	cli->packet = ccpacket_create();
+	if(cli->packet == NULL) {
+		channel_destroy(cli);
+		free(cli);
+		return NULL;
+	}
+	ccpacket_copy(cli->packet, chn->reader->packet);
+	buffer_set_limits(&cli->rxbuf, chn->rxbuf.max, chn->rxbuf.hwm);
+	cli->fd = fd;
+	cli->parent = chn;
+	cli->next = chn->clients;
+	chn->clients = cli;
+	chn->n_clients++;
+	cli->dirty_head = chn->dirty_head;
+	cli->resolver = chn->resolver;
+	cli->shard = chn->shard;
+	channel_touch(cli);
+	return cli;
+}
+
+/*
+ * channel_accept	Accept a tcp client connection on the I/O channel.  The
+ *			channel keeps listening, and each connection is read as
+ *			a separate client channel.
  *
  * return: 0 on success; -1 on error
  */
 static int channel_accept(struct channel *chn) {
-	int fd = accept(chn->sfd, NULL, 0);
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct channel *cli;
+	int fd;
+
+	fd = accept(chn->sfd, (struct sockaddr *)&addr, &addr_len);
 	if(fd < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK ||
+		   errno == ECONNABORTED)
+			return 0;
 		channel_log(chn, strerror(errno));
 		return -1;
 	}
-	channel_log(chn, "accepting");
-	chn->fd = fd;
+	if(chn->n_clients >= CLIENT_MAX) {
+		channel_log(chn, "too many clients");
+		close(fd);
+		return 0;
+	}
+	cli = channel_add_client(chn, fd, (struct sockaddr *)&addr, addr_len);
+	if(cli == NULL) {
+		channel_log(chn, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	if(channel_config_socket(cli, SOCK_STREAM) < 0) {
+		channel_close(cli);
+		return 0;
+	}
+	log_println(chn->log, "channel: accepting %s:%s on %s:%s", cli->name,
+		cli->service, chn->name, chn->service);
 	return 0;
 }
 
@@ -402,35 +708,13 @@ static int channel_accept(struct channel *chn) {
  * return: 0 on success; -1 on error
  */
 static int channel_connect_tcp(struct channel *chn) {
-	if(channel_open_connect(chn, SOCK_STREAM) < 0) {
+	if(channel_open_connect(chn) < 0) {
 		channel_close(chn);
 		return -1;
 	} else
 		return 0;
 }
 
-/*
- * channel_is_localhost	Test if the I/O channel is a localhost address.
- *
- * return: true if channel is defined to be a localhost address
- */
-static bool channel_is_localhost(const struct channel *chn) {
-	if(strstr(chn->name, "localhost") == chn->name)
-		return true;
-	if(strstr(chn->name, "0.0.0.0") == chn->name)
-		return true;
-	return false;
-}
-
-/*
- * channel_should_listen	Test if the I/O channel should listen.
- *
- * return: true if the channel should listen; otherwise false
- */
-static bool channel_should_listen(const struct channel *chn) {
-	return (chn->flags & FLAG_LISTEN) && channel_is_localhost(chn);
-}
-
 /*
  * channel_open_tcp	Open a tcp port for the I/O channel.
  *
@@ -458,6 +742,14 @@ static inline void channel_clear_response(struct channel *chn) {
 int channel_open(struct channel *chn) {
 	assert(chn->fd == 0);
 	channel_clear_response(chn);
+	chn->flags &= ~FLAG_GOT_RESP;
+	http_resp_init(&chn->http);
+	if(chn->flags & FLAG_FILE) {
+		channel_log(chn, "replaying");
+		return channel_open_file(chn);
+	}
+	if(!channel_is_sport(chn) && channel_resolve(chn) < 0)
+		return -1;
 	if(channel_should_listen(chn))
 		channel_log(chn, "listening");
 	else
@@ -470,6 +762,22 @@ int channel_open(struct channel *chn) {
 		return channel_open_tcp(chn);
 }
 
+/*
+ * channel_keep_unanswered	Keep the unanswered request of a keep-alive
+ *				channel in the transmit buffer, so it is sent
+ *				again after reconnecting.  A newer request
+ *				queued behind it replaces it, as axis_encode
+ *				would have.
+ */
+static void channel_keep_unanswered(struct channel *chn) {
+	if(buffer_is_empty(&chn->txbuf)) {
+		struct buffer txbuf = chn->txbuf;
+		chn->txbuf = chn->reqbuf;
+		chn->reqbuf = txbuf;
+	}
+	buffer_clear(&chn->reqbuf);
+}
+
 /*
  * channel_close	Close the I/O channel.
  *
@@ -477,7 +785,21 @@ int channel_open(struct channel *chn) {
  */
 int channel_close(struct channel *chn) {
 	buffer_clear(&chn->rxbuf);
-	buffer_clear(&chn->txbuf);
+	if((chn->flags & FLAG_KEEPALIVE) && (chn->flags & FLAG_NEEDS_RESP))
+		channel_keep_unanswered(chn);
+	else {
+		buffer_clear(&chn->txbuf);
+		buffer_clear(&chn->reqbuf);
+	}
+	ccwriter_wrote(&chn->unwritten, false);
+	ccwriter_wrote(&chn->staged, false);
+	chn->msg_total = 0;
+	chn->n_msgs = 0;
+	/* pending commands are stale once the channel is closed */
+	sched_clear(&chn->sched);
+	peer_clear(&chn->peers);
+	if(chn->flags & FLAG_FILE)
+		replay_close(&chn->replay);
 	if(chn->fd < 0) {
 		chn->fd = 0;
 		return -1;
@@ -485,14 +807,15 @@ int channel_close(struct channel *chn) {
 	if(channel_is_open(chn)) {
 		channel_log(chn, "closing");
 		int r = close(chn->fd);
+		/* clients have their own channels, so this closes the
+		 * listening socket of a listen channel */
+		chn->fd = 0;
+		chn->sfd = 0;
 		if(r < 0) {
 			channel_log(chn, strerror(errno));
-			chn->fd = 0;
 			return -1;
-		} else {
-			chn->fd = chn->sfd;
+		} else
 			return 0;
-		}
 	} else
 		return 0;
 }
@@ -507,21 +830,38 @@ bool channel_is_open(const struct channel *chn) {
 }
 
 /*
- * channel_has_reader	Test if the I/O channel has a reader.
+ * channel_is_client	Test if the I/O channel is a client of a listen channel.
+ *
+ * return: true if channel is a client; otherwise false
+ */
+bool channel_is_client(const struct channel *chn) {
+	return chn->parent != NULL;
+}
+
+/*
+ * channel_has_reader	Test if the I/O channel has a reader.  Clients are
+ *			read by the reader of their listen channel.
  *
  * return: true if channel has a reader; otherwise false
  */
 bool channel_has_reader(const struct channel *chn) {
-	return chn->reader != NULL;
+	return chn->reader != NULL || channel_is_client(chn);
 }
 
 /*
- * channel_needs_reading	Test if the I/O channel needs reading.
+ * channel_needs_reading	Test if the I/O channel needs reading.  Reading
+ *				stops while the receive buffer is filled to the
+ *				high-water mark.  A keep-alive channel is read
+ *				while idle too, so a close by the server is
+ *				noticed before the next request is written.
  *
  * return: true if channel needs to be read; otherwise false
  */
 bool channel_needs_reading(const struct channel *chn) {
-	return channel_has_reader(chn) || (chn->flags & FLAG_NEEDS_RESP);
+	if(buffer_is_high(&chn->rxbuf))
+		return false;
+	return channel_has_reader(chn) ||
+	       (chn->flags & (FLAG_NEEDS_RESP | FLAG_KEEPALIVE));
 }
 
 /*
@@ -530,16 +870,161 @@ bool channel_needs_reading(const struct channel *chn) {
  * return true if channel needs to be writtin; otherwise false
  */
 bool channel_needs_writing(const struct channel *chn) {
-	return !(buffer_is_empty(&chn->txbuf) || (chn->flags &FLAG_NEEDS_RESP));
+	return !(buffer_is_empty(&chn->txbuf) || (chn->flags &FLAG_NEEDS_RESP) ||
+		channel_is_paced(chn));
 }
 
 /*
  * channel_is_waiting	Test if the I/O channel is waiting to read or write.
+ *			A keep-alive channel which has answered requests is
+ *			reconnected right after the server closes it.
  *
  * return: true if the channel is waiting; otherwise false
  */
 bool channel_is_waiting(const struct channel *chn) {
-	return (!buffer_is_empty(&chn->txbuf)) || (chn->reader != NULL);
+	return (!buffer_is_empty(&chn->txbuf)) || channel_has_reader(chn) ||
+	       ((chn->flags & FLAG_KEEPALIVE) && (chn->flags & FLAG_GOT_RESP));
+}
+
+/*
+ * channel_is_parked	Test if the I/O channel is parked (closed) until its
+ *			retry deadline.
+ *
+ * return: true if the channel is parked; otherwise false
+ */
+bool channel_is_parked(const struct channel *chn) {
+	return wheel_node_is_linked(&chn->retry);
+}
+
+/*
+ * channel_is_done	Test if the I/O channel has finished its requests.  An
+ *			HTTP server may close the connection after each
+ *			response, which is not a failure.  Nor is closing an
+ *			idle keep-alive connection.
+ *
+ * return: true if the channel is done; otherwise false
+ */
+bool channel_is_done(const struct channel *chn) {
+	if(!(chn->flags & FLAG_RESP_REQUIRED) ||
+	    (chn->flags & FLAG_NEEDS_RESP))
+		return false;
+	if(chn->flags & FLAG_KEEPALIVE)
+		return buffer_is_empty(&chn->txbuf);
+	else
+		return chn->flags & FLAG_GOT_RESP;
+}
+
+/*
+ * channel_wire_ready	Get the time when more bytes should be written to the
+ *			I/O channel, to keep the transmitter busy.
+ *
+ * tv: time when writing can resume
+ */
+void channel_wire_ready(const struct channel *chn, struct timeval *tv) {
+	*tv = chn->wire_idle;
+	timeval_adjust_us(tv, -WIRE_AHEAD);
+}
+
+/*
+ * channel_is_paced	Test if writing to the I/O channel is held back, because
+ *			the transmitter is busy with bytes already written.
+ *			Only serial ports are paced.
+ *
+ * return: true if the channel is paced; otherwise false
+ */
+bool channel_is_paced(const struct channel *chn) {
+	struct timeval now;
+	if(chn->byte_ns == 0)
+		return false;
+	timeval_set_now(&now);
+	return time_elapsed_us(&now, &chn->wire_idle) > WIRE_AHEAD;
+}
+
+/*
+ * channel_wire_done	Get the time when all bytes queued on the I/O channel
+ *			will have been transmitted on the wire.
+ *
+ * tv: time when transmitter will be idle
+ */
+void channel_wire_done(const struct channel *chn, struct timeval *tv) {
+	timeval_set_now(tv);
+	if(chn->byte_ns) {
+		if(time_elapsed_us(tv, &chn->wire_idle) > 0)
+			*tv = chn->wire_idle;
+		timeval_adjust_us(tv, (uint64_t)channel_backlog(chn) *
+			chn->byte_ns / 1000);
+	}
+}
+
+/*
+ * channel_log_gauges	Log link utilization and queueing delay gauges, and
+ *			start a new gauge interval.
+ *
+ * now: current time
+ */
+static void channel_log_gauges(struct channel *chn, const struct timeval *now) {
+	long elapsed = time_elapsed_us(&chn->gauge_start, now);
+	if(chn->n_wire) {
+		/* Bytes written ahead can be counted before they are sent */
+		double util = (chn->wire_busy < elapsed)
+		            ? 100.0 * chn->wire_busy / elapsed
+		            : 100.0;
+		log_println(chn->log, "channel: %s:%s  util: %.1f%%  queued "
+			"avg: %.1f ms  max: %.1f ms", chn->name, chn->service,
+			util,
+			chn->wire_queued / 1000.0 / chn->n_wire,
+			chn->wire_queued_max / 1000.0);
+	}
+	chn->gauge_start = *now;
+	chn->wire_busy = 0;
+	chn->wire_queued = 0;
+	chn->wire_queued_max = 0;
+	chn->n_wire = 0;
+}
+
+/*
+ * channel_log_stats	Log the link gauges and peer rates of a channel, and
+ *			start a new interval.
+ *
+ * now: current time
+ * ms: length of interval (ms)
+ */
+void channel_log_stats(struct channel *chn, const struct timeval *now,
+	long ms)
+{
+	channel_log_gauges(chn, now);
+	peer_log_rates(chn->peers, chn->log, chn->name, chn->service, ms);
+}
+
+/*
+ * channel_wire_sent	Account for bytes written to a serial port.  They
+ *			are transmitted once the bytes written before them
+ *			have been.  The queueing delay includes time waiting
+ *			in the transmit buffer and in the driver.
+ *
+ * n_bytes: number of bytes written
+ */
+static void channel_wire_sent(struct channel *chn, size_t n_bytes) {
+	struct timeval now;
+	long us = (uint64_t)n_bytes * chn->byte_ns / 1000;
+	long queued, driver;
+
+	/* The bytes reach the driver now, not when the poll returned */
+	timeval_set_precise(&now);
+	driver = time_elapsed_us(&now, &chn->wire_idle);
+	if(driver < 0) {
+		driver = 0;
+		chn->wire_idle = now;
+	}
+	queued = time_elapsed_us(&chn->queued, &now) + driver;
+	/* Any bytes left in the buffer start waiting now */
+	chn->queued = now;
+	timeval_adjust_us(&chn->wire_idle, us);
+	chn->wire_busy += us;
+	chn->wire_queued += queued;
+	if(queued > chn->wire_queued_max)
+		chn->wire_queued_max = queued;
+	chn->n_wire++;
 }
 
 /*
@@ -554,15 +1039,15 @@ static inline bool channel_is_listening(const struct channel *chn) {
 /*
  * channel_log_buffer	Log buffer debug information.
  *
- * buf: buffer to debug
  * prefix: prefix to print on the log message
  * start: pointer to start of buffer debug information
+ * n_bytes: number of bytes to log
  */
-static void channel_log_buffer(struct channel *chn, struct buffer *buf,
-	const char *prefix, void *start)
+static void channel_log_buffer(struct channel *chn, const char *prefix,
+	const uint8_t *start, size_t n_bytes)
 {
-	uint8_t *mess;
-	uint8_t *stop = buffer_input(buf);
+	const uint8_t *mess;
+	const uint8_t *stop = start + n_bytes;
 
 	log_line_start(chn->log);
 	log_printf(chn->log, prefix);
@@ -579,8 +1064,27 @@ static void channel_log_buffer(struct channel *chn, struct buffer *buf,
  */
 static void channel_log_buffer_in(struct channel *chn, size_t n_bytes) {
 	if(chn->log->debug) {
-		channel_log_buffer(chn, &chn->rxbuf, "debug: IN",
-			buffer_input(&chn->rxbuf) - n_bytes);
+		struct buffer *rxbuf = &chn->rxbuf;
+		const uint8_t *stop = buffer_output(rxbuf) +
+			buffer_available(rxbuf);
+		channel_log_buffer(chn, "debug: IN", stop - n_bytes, n_bytes);
+	}
+}
+
+/*
+ * channel_capture	Capture raw input, which is at the end of the receive
+ *			buffer.  Clients are captured as their listen channel.
+ *
+ * n_bytes: number of bytes received
+ */
+static void channel_capture(struct channel *chn, size_t n_bytes) {
+	uint16_t id = channel_is_client(chn) ? chn->parent->capture_id :
+		chn->capture_id;
+	if(id) {
+		struct buffer *rxbuf = &chn->rxbuf;
+		const uint8_t *stop = buffer_output(rxbuf) +
+			buffer_available(rxbuf);
+		capture_input(id, stop - n_bytes, n_bytes);
 	}
 }
 
@@ -589,11 +1093,215 @@ static void channel_log_buffer_in(struct channel *chn, size_t n_bytes) {
  */
 static void channel_log_buffer_out(struct channel *chn) {
 	if(chn->log->debug) {
-		channel_log_buffer(chn, &chn->txbuf, "debug: OUT",
-			buffer_output(&chn->txbuf));
+		struct buffer *txbuf = &chn->txbuf;
+		channel_log_buffer(chn, "debug: OUT", buffer_output(txbuf),
+			buffer_available(txbuf));
+	}
+}
+
+/*
+ * channel_got_response	Handle a complete response to a request.
+ */
+static void channel_got_response(struct channel *chn) {
+	if(chn->flags & FLAG_NEEDS_RESP) {
+		ptz_stats_response(chn->flags & FLAG_KEEPALIVE,
+			time_since(&chn->queued));
+		channel_clear_response(chn);
+		chn->flags |= FLAG_GOT_RESP;
+		buffer_clear(&chn->reqbuf);
+	}
+}
+
+/*
+ * channel_read_response	Parse HTTP responses on a keep-alive channel.
+ *				A request may not be written until the previous
+ *				response is complete.
+ *
+ * n_bytes: number of bytes read
+ * return: number of bytes read; 0 if the channel should be closed
+ */
+static ssize_t channel_read_response(struct channel *chn, ssize_t n_bytes) {
+	int r;
+
+	while((r = http_resp_parse(&chn->http, &chn->rxbuf)) > 0) {
+		channel_got_response(chn);
+		if(chn->http.close)
+			return 0;
+		http_resp_init(&chn->http);
+	}
+	if(r < 0) {
+		channel_log(chn, "invalid HTTP response");
+		return 0;
+	}
+	return n_bytes;
+}
+
+/*
+ * channel_has_peers	Test if the I/O channel decodes datagrams separately
+ *			for each peer.  This is true for UDP listen channels
+ *			with a reader.
+ *
+ * return: true if the channel has peers; otherwise false
+ */
+static bool channel_has_peers(const struct channel *chn) {
+	return (chn->flags & FLAG_UDP) && (chn->flags & FLAG_LISTEN) &&
+	       channel_has_reader(chn);
+}
+
+/*
+ * channel_decode_dgram		Decode one datagram received from a peer.  A
+ *				partial frame at the end is discarded, so it is
+ *				never joined with the next datagram.
+ *
+ * dgram: datagram received
+ * n_bytes: size of datagram (bytes)
+ * addr: socket address of peer
+ * addr_len: length of socket address
+ */
+static void channel_decode_dgram(struct channel *chn, const uint8_t *dgram,
+	size_t n_bytes, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct buffer *rxbuf = &chn->rxbuf;
+	struct peer *peer;
+	uint8_t *mess;
+
+	peer = peer_find(&chn->peers, addr, addr_len, chn->reader->packet);
+	if(peer == NULL) {
+		channel_log(chn, strerror(errno));
+		return;
+	}
+	peer->n_dgrams++;
+	buffer_clear(rxbuf);
+	mess = buffer_append(rxbuf, n_bytes);
+	if(mess == NULL)
+		return;
+	memcpy(mess, dgram, n_bytes);
+	channel_log_buffer_in(chn, n_bytes);
+	channel_capture(chn, n_bytes);
+	peer->n_packets += ccreader_read_peer(chn->reader, peer->packet,rxbuf);
+	buffer_clear(rxbuf);
+}
+
+/*
+ * channel_recv		Receive datagrams on a UDP listen channel.  Several
+ *			datagrams are received with one system call, and each
+ *			is decoded for the peer which sent it.  Datagrams
+ *			larger than DGRAM_MAX are discarded.
+ *
+ * return: number of bytes received; -1 on error
+ */
+static ssize_t channel_recv(struct channel *chn) {
+	struct mmsghdr msgs[RECV_MSG_MAX];
+	struct iovec iov[RECV_MSG_MAX];
+	struct sockaddr_storage addrs[RECV_MSG_MAX];
+	ssize_t n_bytes = 0;
+	int i, n;
+
+	if(chn->dgrams == NULL) {
+		chn->dgrams = malloc(RECV_MSG_MAX * DGRAM_MAX);
+		if(chn->dgrams == NULL)
+			return -1;
+	}
+	memset(msgs, 0, sizeof(msgs));
+	for(i = 0; i < RECV_MSG_MAX; i++) {
+		iov[i].iov_base = chn->dgrams + i * DGRAM_MAX;
+		iov[i].iov_len = DGRAM_MAX;
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = addrs + i;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+	do {
+		n = recvmmsg(chn->fd, msgs, RECV_MSG_MAX, 0, NULL);
+	} while(n < 0 && errno == EINTR);
+	if(n < 0)
+		return -1;
+	for(i = 0; i < n; i++) {
+		n_bytes += msgs[i].msg_len;
+		/* a datagram too large for its slot would decode as a
+		 * partial frame, so it is discarded */
+		if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			channel_log(chn, "datagram truncated");
+			chn_stats_add(&chn->stats, STAT_DISCARDS, 1);
+			continue;
+		}
+		channel_decode_dgram(chn, iov[i].iov_base, msgs[i].msg_len,
+			(struct sockaddr *)(addrs + i),
+			msgs[i].msg_hdr.msg_namelen);
+	}
+	// Pretend we read 1 byte for empty datagrams, because zero
+	// indicates the channel has been closed
+	return n_bytes ? n_bytes : 1;
+}
+
+/*
+ * channel_stats	Get the counters of a channel.  Clients of a listen
+ *			channel are counted with it, since they come and go.
+ */
+static struct chn_stats *channel_stats(struct channel *chn) {
+	return channel_is_client(chn) ? &chn->parent->stats : &chn->stats;
+}
+
+/*
+ * channel_got_input	Handle input which was read into the receive buffer.
+ *
+ * n_bytes: number of bytes read
+ * return: number of bytes read; 0 if the channel should be closed
+ */
+static ssize_t channel_got_input(struct channel *chn, ssize_t n_bytes) {
+	chn->n_retry = 0;
+	chn_stats_add(channel_stats(chn), STAT_BYTES_IN, n_bytes);
+	if(chn->flags & FLAG_KEEPALIVE)
+		return channel_read_response(chn, n_bytes);
+	channel_got_response(chn);
+	if(channel_has_reader(chn)) {
+		channel_log_buffer_in(chn, n_bytes);
+		channel_capture(chn, n_bytes);
+		if(channel_is_client(chn)) {
+			ccreader_read_peer(chn->parent->reader, chn->packet,
+				&chn->rxbuf);
+		} else
+			chn->reader->do_read(chn->reader, &chn->rxbuf);
+		/* Input left in the buffer is kept; reading stops while it
+		 * is at the high-water mark */
+		return n_bytes;
+	} else {
+		/* Data is coming in on the channel, but we're not set up to
+		 * handle it -- just ignore. */
+		buffer_clear(&chn->rxbuf);
+		return 0;
 	}
 }
 
+/*
+ * channel_replay	Replay input from a capture file, up to a batch of
+ *			records which are due.  Each record is handled just
+ *			as if it had been read from the channel.
+ *
+ * return: number of bytes replayed (at least 1); -1 on error
+ */
+static ssize_t channel_replay(struct channel *chn) {
+	ssize_t total = 0;
+	int i;
+
+	for(i = 0; i < REPLAY_BATCH; i++) {
+		size_t n_bytes;
+		const uint8_t *data = replay_next(&chn->replay, &n_bytes);
+		if(data == NULL)
+			break;
+		if(n_bytes && channel_input(chn, data, n_bytes) < 0)
+			return -1;
+		total += n_bytes;
+	}
+	if(replay_arm(&chn->replay) < 0) {
+		channel_log(chn, strerror(errno));
+		return -1;
+	}
+	// Pretend we read 1 byte, because zero
+	// indicates the channel has been closed
+	return total ? total : 1;
+}
+
 /*
  * channel_read		Read from the I/O channel.
  *
@@ -602,28 +1310,171 @@ static void channel_log_buffer_out(struct channel *chn) {
 ssize_t channel_read(struct channel *chn) {
 	ssize_t n_bytes;
 
+	if(chn->flags & FLAG_FILE)
+		return channel_replay(chn);
 	if(channel_is_listening(chn)) {
 		int r = channel_accept(chn);
 		// Pretend we read 1 byte, because zero
 		// indicates the channel has been closed
 		return r < 0 ? -1 : 1;
 	}
-	n_bytes = buffer_read(&chn->rxbuf, chn->fd);
+	if(channel_has_peers(chn))
+		n_bytes = channel_recv(chn);
+	else
+		n_bytes = buffer_read(&chn->rxbuf, chn->fd);
 	if(n_bytes < 0)
 		channel_log(chn, strerror(errno));
 	if(n_bytes <= 0)
 		return n_bytes;
-	channel_clear_response(chn);
-	if(channel_has_reader(chn)) {
-		channel_log_buffer_in(chn, n_bytes);
-		chn->reader->do_read(chn->reader, &chn->rxbuf);
+	if(channel_has_peers(chn)) {
+		chn->n_retry = 0;
+		chn_stats_add(&chn->stats, STAT_BYTES_IN, n_bytes);
 		return n_bytes;
-	} else {
-		/* Data is coming in on the channel, but we're not set up to
-		 * handle it -- just ignore. */
-		buffer_clear(&chn->rxbuf);
-		return 0;
 	}
+	return channel_got_input(chn, n_bytes);
+}
+
+/*
+ * channel_reads_buffer	Test if input on the I/O channel is read straight
+ *			into the receive buffer.  Listen channels accepting
+ *			clients, UDP channels with peers and replay channels
+ *			need the file descriptor to be read by channel_read
+ *			instead.
+ *
+ * return: true if input is read into the receive buffer
+ */
+bool channel_reads_buffer(const struct channel *chn) {
+	return !(channel_is_listening(chn) || channel_has_peers(chn) ||
+	        (chn->flags & FLAG_FILE));
+}
+
+/*
+ * channel_input	Handle input which was read from the I/O channel into
+ *			another buffer (by io_uring, or from a capture file).
+ *			It is copied into the receive buffer, no more than the
+ *			high-water mark at a time, just as channel_read would
+ *			have read it.  If undecoded input fills the buffer to
+ *			the high-water mark, the oldest bytes are discarded to
+ *			make room, since this input cannot be held back.
+ *
+ * data: input data
+ * n_bytes: number of bytes of input
+ * return: number of bytes handled; 0 if the channel should be closed;
+ *         -1 on error
+ */
+ssize_t channel_input(struct channel *chn, const uint8_t *data,
+	size_t n_bytes)
+{
+	struct buffer *rxbuf = &chn->rxbuf;
+	ssize_t total = 0;
+
+	while(n_bytes) {
+		size_t a = buffer_available(rxbuf);
+		size_t n = (a < rxbuf->hwm) ? rxbuf->hwm - a : 0;
+		uint8_t *dst;
+		ssize_t r;
+
+		if(n == 0) {
+			n = (n_bytes < rxbuf->hwm) ? n_bytes : rxbuf->hwm;
+			buffer_consume(rxbuf, a + n - rxbuf->hwm);
+			chn_stats_add(channel_stats(chn), STAT_DISCARDS, 1);
+		}
+		if(n > n_bytes)
+			n = n_bytes;
+		dst = buffer_append(rxbuf, n);
+		if(dst == NULL) {
+			channel_log(chn, strerror(ENOBUFS));
+			return -1;
+		}
+		memcpy(dst, data, n);
+		r = channel_got_input(chn, n);
+		if(r <= 0)
+			return r;
+		data += n;
+		n_bytes -= n;
+		total += r;
+	}
+	return total;
+}
+
+/*
+ * channel_end_message	End one message in the transmit buffer.  On a UDP
+ *			channel, each message is sent as a separate datagram.
+ *			Once too many are queued, more are added to the last.
+ */
+void channel_end_message(struct channel *chn) {
+	size_t a = buffer_available(&chn->txbuf);
+	if(!(chn->flags & FLAG_UDP))
+		return;
+	/* the buffer may have been cleared since the previous message */
+	if(chn->msg_total > a) {
+		chn->msg_total = 0;
+		chn->n_msgs = 0;
+	}
+	if(a == chn->msg_total)
+		return;
+	if(chn->n_msgs < BUFFER_MSG_MAX)
+		chn->msg_len[chn->n_msgs++] = a - chn->msg_total;
+	else
+		chn->msg_len[chn->n_msgs - 1] += a - chn->msg_total;
+	chn->msg_total = a;
+}
+
+/*
+ * channel_send		Send buffered messages to a UDP channel, as one datagram
+ *			per message with a single system call.
+ *
+ * return: number of bytes sent; -1 on error
+ */
+static ssize_t channel_send(struct channel *chn) {
+	ssize_t n_bytes = 0;
+	int i, n;
+
+	channel_end_message(chn);
+	n = buffer_send(&chn->txbuf, chn->fd, chn->msg_len, chn->n_msgs);
+	if(n < 0)
+		return -1;
+	for(i = 0; i < n; i++)
+		n_bytes += chn->msg_len[i];
+	chn->n_msgs -= n;
+	chn->msg_total -= n_bytes;
+	memmove(chn->msg_len, chn->msg_len + n, sizeof(size_t) * chn->n_msgs);
+	ptz_stats_write(n);
+	return n_bytes;
+}
+
+/*
+ * channel_wrote	Update the I/O channel after writing bytes.
+ *
+ * n_bytes: number of bytes written
+ * unwritten: writers whose output was written, or NULL
+ */
+static void channel_wrote(struct channel *chn, ssize_t n_bytes,
+	struct ccwriter **unwritten)
+{
+	chn->n_retry = 0;
+	if(n_bytes > 0)
+		chn_stats_add(&chn->stats, STAT_BYTES_OUT, n_bytes);
+	if(chn->byte_ns && n_bytes > 0)
+		channel_wire_sent(chn, n_bytes);
+	if(unwritten)
+		ccwriter_wrote(unwritten, true);
+	ccwriter_flush(chn);
+}
+
+/*
+ * channel_keep_request		Copy a request about to be written to a
+ *				keep-alive channel, until it is answered.
+ */
+static void channel_keep_request(struct channel *chn) {
+	struct buffer *txbuf = &chn->txbuf;
+	size_t n_bytes = buffer_available(txbuf);
+	uint8_t *mess;
+
+	buffer_clear(&chn->reqbuf);
+	mess = buffer_append(&chn->reqbuf, n_bytes);
+	if(mess)
+		buffer_copy(txbuf, 0, mess, n_bytes);
 }
 
 /*
@@ -635,9 +1486,101 @@ ssize_t channel_write(struct channel *chn) {
 	ssize_t n_bytes;
 	if(chn->flags & FLAG_RESP_REQUIRED)
 		chn->flags |= FLAG_NEEDS_RESP;
+	if(chn->flags & FLAG_KEEPALIVE)
+		channel_keep_request(chn);
 	channel_log_buffer_out(chn);
-	n_bytes = buffer_write(&chn->txbuf, chn->fd);
+	if(chn->flags & FLAG_UDP)
+		n_bytes = channel_send(chn);
+	else {
+		n_bytes = buffer_write(&chn->txbuf, chn->fd);
+		ptz_stats_write(0);
+	}
 	if(n_bytes < 0)
 		channel_log(chn, strerror(errno));
+	else
+		channel_wrote(chn, n_bytes, &chn->unwritten);
 	return n_bytes;
 }
+
+/*
+ * channel_stage	Move buffered data to the stage area of the I/O channel,
+ *			to be written by io_uring.  The transmit buffer can then
+ *			be changed while the write is in flight.  The write is
+ *			accounted by channel_ring_wrote as it completes.
+ *
+ * lens: array to store message lengths (BUFFER_MSG_MAX), one for each
+ *       datagram on a UDP channel
+ * return: number of messages staged; -1 on error
+ */
+int channel_stage(struct channel *chn, size_t *lens) {
+	struct buffer *txbuf = &chn->txbuf;
+	size_t n_bytes = buffer_available(txbuf);
+	int n_msgs = 1;
+
+	if(chn->stage_sz < txbuf->max) {
+		free(chn->stage);
+		chn->stage_sz = 0;
+		chn->stage = malloc(txbuf->max);
+		if(chn->stage == NULL)
+			return -1;
+		chn->stage_sz = txbuf->max;
+	}
+	if(chn->flags & FLAG_RESP_REQUIRED)
+		chn->flags |= FLAG_NEEDS_RESP;
+	if(chn->flags & FLAG_KEEPALIVE)
+		channel_keep_request(chn);
+	channel_log_buffer_out(chn);
+	if(chn->flags & FLAG_UDP) {
+		channel_end_message(chn);
+		n_msgs = chn->n_msgs;
+		memcpy(lens, chn->msg_len, sizeof(size_t) * n_msgs);
+		chn->n_msgs = 0;
+		chn->msg_total = 0;
+		ptz_stats_write(n_msgs);
+	} else {
+		lens[0] = n_bytes;
+		ptz_stats_write(0);
+	}
+	chn->stage_len = buffer_copy(txbuf, 0, chn->stage, n_bytes);
+	chn->stage_off = 0;
+	buffer_consume(txbuf, n_bytes);
+	chn->staged = chn->unwritten;
+	chn->unwritten = NULL;
+	return n_msgs;
+}
+
+/*
+ * channel_ring_wrote	Update the I/O channel after a ring write (or send)
+ *			of staged bytes completes.
+ *
+ * n_bytes: number of staged bytes written
+ * done: true if all staged bytes have been written
+ */
+void channel_ring_wrote(struct channel *chn, ssize_t n_bytes, bool done) {
+	channel_wrote(chn, n_bytes, done ? &chn->staged : NULL);
+}
+
+/*
+ * channel_backlog	Get the number of bytes waiting to be written to the
+ *			I/O channel, including staged bytes which a ring write
+ *			has not finished yet.
+ */
+size_t channel_backlog(const struct channel *chn) {
+	size_t n_bytes = buffer_available(&chn->txbuf);
+	if(chn->ring_wr)
+		n_bytes += chn->stage_len - chn->stage_off;
+	return n_bytes;
+}
+
+/*
+ * channel_touch	Mark the I/O channel as needing its poll events updated.
+ *			This must be called whenever something outside of the
+ *			poller changes what the channel is waiting for.
+ */
+void channel_touch(struct channel *chn) {
+	if(chn->dirty_head && !(chn->flags & FLAG_DIRTY)) {
+		chn->flags |= FLAG_DIRTY;
+		chn->dirty = *chn->dirty_head;
+		*chn->dirty_head = chn;
+	}
+}
@@ -2,8 +2,19 @@
 #define CHANNEL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include "buffer.h"
+#include "capture.h"
 #include "ccreader.h"
+#include "http.h"
+#include "peer.h"
+#include "resolver.h"
+#include "sched.h"
+#include "stats.h"
+#include "wheel.h"
+
+#define BUFFER_MIN 64		/* minimum configurable buffer size */
 
 enum ch_flag_t {
 	FLAG_UDP = 1 << 0,		/* flag for UDP datagram protocol */
@@ -11,6 +22,10 @@ enum ch_flag_t {
 	FLAG_LISTEN = 1 << 2,		/* flag for TCP listen channel */
 	FLAG_RESP_REQUIRED = 1 << 3,	/* flag for response required */
 	FLAG_NEEDS_RESP = 1 << 4,	/* flag for needs response */
+	FLAG_DIRTY = 1 << 5,		/* flag for poll events out of date */
+	FLAG_GOT_RESP = 1 << 6,		/* flag for response since open */
+	FLAG_KEEPALIVE = 1 << 7,	/* flag for HTTP keep-alive responses */
+	FLAG_FILE = 1 << 8,		/* flag for capture file replay */
 };
 
 struct channel {
@@ -22,25 +37,98 @@ struct channel {
 
 	struct buffer	rxbuf;			/* receive buffer */
 	struct buffer	txbuf;			/* transmit buffer */
+	struct buffer	reqbuf;			/* unanswered keep-alive request */
 
 	struct ccreader *reader;		/* camera control reader */
+	struct channel	*parent;		/* listen channel of a client */
+	struct channel	*clients;		/* clients of a listen channel */
+	unsigned int	n_clients;		/* number of clients */
+	struct ccpacket	*packet;		/* packet being decoded (client) */
+	struct sched	sched;			/* pending command scheduler */
+	size_t		msg_len[BUFFER_MSG_MAX]; /* queued datagram lengths */
+	size_t		msg_total;		/* total of datagram lengths */
+	unsigned int	n_msgs;			/* number of queued datagrams */
 	struct log	*log;			/* message logger */
+	struct shard	*shard;			/* shard polling the channel */
 	struct channel	*next;			/* next channel in list */
+
+	int		pfd;			/* fd registered with poller (or -1) */
+	uint32_t	events;			/* events registered with poller */
+	struct channel	**dirty_head;		/* head of poller dirty list */
+	struct channel	*dirty;			/* next channel in dirty list */
+
+	struct resolver	*resolver;		/* resolver for host names */
+	struct lookup	*lookup;		/* host name lookup pending */
+	struct addrinfo	*addr;			/* cached resolved addresses */
+	int		addr_error;		/* cached getaddrinfo error */
+	struct timeval	addr_expire;		/* cached address expire time */
+
+	struct wheel_node retry;		/* time to retry opening */
+	unsigned int	n_retry;		/* retries since last I/O */
+
+	unsigned int	byte_ns;		/* wire time per byte (ns) */
+	struct timeval	wire_idle;		/* time transmitter goes idle */
+	struct wheel_node pace;			/* time to resume writing */
+	struct timeval	gauge_start;		/* start of gauge interval */
+	uint64_t	wire_busy;		/* wire time in interval (us) */
+	uint64_t	wire_queued;		/* queueing delay total (us) */
+	long		wire_queued_max;	/* largest queueing delay (us) */
+	unsigned int	n_wire;			/* writes in interval */
+
+	struct peer	*peers;			/* peers of UDP listen channel */
+	uint8_t		*dgrams;		/* datagram receive area */
+
+	struct http_resp http;			/* keep-alive response parser */
+	struct ccwriter	*unwritten;		/* writers awaiting a write */
+	struct ccwriter	*staged;		/* writers with staged output */
+	struct timeval	queued;			/* time output was queued */
+
+	unsigned int	ring_gen;		/* generation of ring operations */
+	uint8_t		ring_rd;		/* state of ring read */
+	unsigned int	ring_wr;		/* ring writes in flight */
+	uint8_t		*stage;			/* bytes staged for ring writes */
+	size_t		stage_sz;		/* size of stage area */
+	size_t		stage_len;		/* number of staged bytes */
+	size_t		stage_off;		/* staged bytes already written */
+
+	uint16_t	capture_id;		/* channel ID in capture file */
+	struct replay	replay;			/* capture file replay */
+
+	struct chn_stats stats;			/* counters (own cache line) */
 };
 
 struct channel* channel_init(struct channel *chn, const char *name,
 	const char *service, enum ch_flag_t flags, struct log *log);
 void channel_destroy(struct channel *chn);
+void channel_destroy_client(struct channel *chn);
+void channel_set_buffer(struct channel *chn, size_t max, size_t hwm);
 bool channel_matches(struct channel *chn, const char *name, const char *service,
 	enum ch_flag_t flags);
 int channel_open(struct channel *chn);
 int channel_close(struct channel *chn);
 bool channel_is_open(const struct channel *chn);
+bool channel_is_client(const struct channel *chn);
 bool channel_has_reader(const struct channel *chn);
 bool channel_needs_reading(const struct channel *chn);
 bool channel_needs_writing(const struct channel *chn);
 bool channel_is_waiting(const struct channel *chn);
+bool channel_is_parked(const struct channel *chn);
+bool channel_is_done(const struct channel *chn);
+bool channel_is_paced(const struct channel *chn);
+bool channel_reads_buffer(const struct channel *chn);
+void channel_wire_ready(const struct channel *chn, struct timeval *tv);
+void channel_wire_done(const struct channel *chn, struct timeval *tv);
 ssize_t channel_read(struct channel *chn);
+ssize_t channel_input(struct channel *chn, const uint8_t *data,
+	size_t n_bytes);
 ssize_t channel_write(struct channel *chn);
+int channel_stage(struct channel *chn, size_t *lens);
+void channel_ring_wrote(struct channel *chn, ssize_t n_bytes, bool done);
+size_t channel_backlog(const struct channel *chn);
+void channel_touch(struct channel *chn);
+void channel_end_message(struct channel *chn);
+void channel_resolved(struct channel *chn, struct lookup *lk);
+void channel_log_stats(struct channel *chn, const struct timeval *now,
+	long ms);
 
 #endif
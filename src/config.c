@@ -17,6 +17,8 @@
 #include "config.h"
 #include "ccreader.h"
 #include "ccwriter.h"
+#include "capture.h"		/* for capture_channel */
+#include "trace.h"		/* for trace_channel */
 
 /* Default config file */
 #define CONF_FILE "/etc/protozoa.conf"
@@ -112,7 +114,8 @@ static struct channel *config_find_channel(struct config *cfg,
 static struct channel *config_new_channel(struct config *cfg, const char *name,
 	const char *service, enum ch_flag_t flags)
 {
-	struct channel *chn = malloc(sizeof(struct channel));
+	struct channel *chn = aligned_alloc(_Alignof(struct channel),
+		sizeof(struct channel));
 	if(chn == NULL)
 		goto fail;
 	if(channel_init(chn, name, service, flags, cfg->log) == NULL)
@@ -171,6 +174,9 @@ static enum ch_flag_t parse_name(const char *name, char *pname, const int plen){
 	} else if(starts_with(name, "tcp://")) {
 		copy_name(name + 6, pname, plen);
 		flags |= FLAG_TCP;
+	} else if(starts_with(name, "file://")) {
+		copy_name(name + 7, pname, plen);
+		flags |= FLAG_FILE;
 	} else
 		copy_name(name, pname, plen);
 	return flags;
@@ -263,9 +269,16 @@ static int config_directive(struct config *cfg, const char *protocol_in,
 	chn_in = config_get_channel(cfg, port_in, FLAG_LISTEN);
 	if(chn_in == NULL)
 		goto fail;
+	if(chn_in->capture_id == 0 && !(chn_in->flags & FLAG_FILE)) {
+		chn_in->capture_id = capture_channel(chn_in->name,
+			chn_in->service);
+	}
 	if(chn_in->reader == NULL) {
 		reader = cl_pool_alloc(&cfg->reader_pool);
 		ccreader_init(reader, chn_in->name, cfg->log, protocol_in);
+		reader->trace_id = trace_channel(chn_in->name,
+			chn_in->service);
+		reader->stats = &chn_in->stats;
 		chn_in->reader = reader;
 	} else {
 		/* FIXME: check for redefined protocol */
@@ -274,8 +287,18 @@ static int config_directive(struct config *cfg, const char *protocol_in,
 	chn_out = config_get_channel(cfg, port_out, 0);
 	if(chn_out == NULL)
 		goto fail;
+	if(chn_out->flags & FLAG_FILE) {
+		log_println(cfg->log, "config: cannot write to file %s",
+			chn_out->name);
+		goto fail;
+	}
 	writer = config_create_writer(cfg);
-	ccwriter_init(writer, chn_out, protocol_out, auth_out);
+	if(ccwriter_init(writer, chn_out, protocol_out, auth_out) == NULL) {
+		log_println(cfg->log, "config: writer %s init error",
+			chn_out->name);
+		goto fail;
+	}
+	writer->src = chn_in;
 	writer->defer = cfg->defer;
 	node = cl_pool_alloc(&cfg->node_pool);
 	ccreader_add_writer(reader, node, writer, range, shift);
@@ -284,6 +307,66 @@ fail:
 	return -1;
 }
 
+/*
+ * config_buffer	Process a buffer directive.
+ *
+ * port: port:baud pair or TCP host:port of existing channel(s)
+ * max: maximum buffer size (bytes)
+ * hwm: receive buffer high-water mark (bytes)
+ * return: 0 on success; -1 on error
+ */
+static int config_buffer(struct config *cfg, const char *port,
+	unsigned int max, unsigned int hwm)
+{
+	char pname[32];
+	char service[32];
+	struct channel *chn;
+	int n_chns = 0;
+
+	log_println(cfg->log, "config: buffer %s %u %u", port, max, hwm);
+	if(max < BUFFER_MIN || hwm < BUFFER_MIN || hwm > max) {
+		log_println(cfg->log, "config: invalid buffer size: %s",
+			cfg->line);
+		return -1;
+	}
+	parse_name(port, pname, 32);
+	parse_service(port, service, 32);
+	for(chn = cfg->chns; chn; chn = chn->next) {
+		if(strcmp(chn->name, pname) == 0 &&
+		   strcmp(chn->service, service) == 0)
+		{
+			channel_set_buffer(chn, max, hwm);
+			n_chns++;
+		}
+	}
+	if(n_chns == 0) {
+		log_println(cfg->log, "config: unknown channel: %s", port);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * config_scan_buffer	Parse a buffer directive in the configuration.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int config_scan_buffer(struct config *cfg) {
+	int i;
+	char port[32];
+	unsigned int max, hwm;
+
+	i = sscanf(cfg->line, "buffer %31s %u %u", port, &max, &hwm);
+	if(i == 2)
+		hwm = max;
+	if(i >= 2)
+		return config_buffer(cfg, port, max, hwm);
+	else {
+		log_println(cfg->log, "Invalid directive: %s", cfg->line);
+		return -1;
+	}
+}
+
 /*
  * config_skip_comments		Remove comments from the line being parsed.
  */
@@ -312,6 +395,8 @@ static int config_scan_directive(struct config *cfg) {
 
 	i = sscanf(cfg->line, "%15s %31s %7s %15s %31s %7s %31s", protocol_in,
 		port_in, range, protocol_out, port_out, shift, auth_out);
+	if(i > 0 && strcmp(protocol_in, "buffer") == 0)
+		return config_scan_buffer(cfg);
 	if(i == 5)
 		strcpy(shift, "0");
 	if(i >= 5)
@@ -325,6 +410,18 @@ static int config_scan_directive(struct config *cfg) {
 	}
 }
 
+/*
+ * config_compile_routes	Compile the route tables of all readers.
+ */
+static void config_compile_routes(struct config *cfg) {
+	struct channel *chn;
+
+	for(chn = cfg->chns; chn; chn = chn->next) {
+		if(chn->reader)
+			ccreader_compile_routes(chn->reader);
+	}
+}
+
 /*
  * config_read		Read the configuration file.
  *
@@ -341,6 +438,7 @@ int config_read(struct config *cfg, const char *filename) {
 		if(config_scan_directive(cfg))
 			goto fail;
 	}
+	config_compile_routes(cfg);
 	if(cfg->n_channels == 0) {
 		log_println(cfg->log, "Error reading configuration file: %s",
 			filename);
@@ -12,60 +12,85 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <errno.h>	/* for errno, EAGAIN */
+#include <stddef.h>	/* for offsetof */
+#include <string.h>	/* for memset */
 #include "timer.h"
 #include "timeval.h"
 #include "defer.h"
 #include "ccwriter.h"
+#include "stats.h"
 
 /*
- * compare_pkts		Compare two packets for sorting them by time.
+ * deferred_pkt_of	Get the deferred packet containing a wheel node.
  */
-static cl_compare_t compare_pkts(const void *value0, const void *value1) {
-	const struct deferred_pkt *dpkt0 = value0;
-	const struct deferred_pkt *dpkt1 = value1;
-
-	return timeval_compare(&dpkt0->tv, &dpkt1->tv);
+static inline struct deferred_pkt *deferred_pkt_of(struct wheel_node *node) {
+	return (struct deferred_pkt *)((char *)node -
+		offsetof(struct deferred_pkt, node));
 }
 
 void deferred_pkt_init(struct deferred_pkt *dpkt) {
-	dpkt->tv.tv_sec = 0;
-	dpkt->tv.tv_usec = 0;
+	int i;
+
+	wheel_node_init(&dpkt->node);
 	timeval_set_now(&dpkt->sent);
 	dpkt->packet = ccpacket_create();
 	dpkt->writer = NULL;
 	dpkt->n_cnt = 0;
+	dpkt->pending = ccpacket_create();
+	for(i = 0; i < HELD_MAX; i++)
+		dpkt->held[i] = ccpacket_create();
+	dpkt->next_pending = NULL;
+	dpkt->is_pending = false;
+	dpkt->is_gapped = false;
+	dpkt->n_held = 0;
+	dpkt->is_prio = false;
+	dpkt->deficit = 0;
+	dpkt->cost = 0;
+	histogram_coarse_clear(&dpkt->latency);
+	memset(&dpkt->stats, 0, sizeof(dpkt->stats));
 }
 
 void deferred_pkt_destroy(struct deferred_pkt *dpkt) {
+	int i;
+
 	free(dpkt->packet);
+	free(dpkt->pending);
+	for(i = 0; i < HELD_MAX; i++)
+		free(dpkt->held[i]);
 }
 
 /*
  * defer_init		Initialize the deferred packet engine.
  */
 struct defer *defer_init(struct defer *dfr) {
-	if(cl_rbtree_init(&dfr->tree, CL_DUP_ALLOW, compare_pkts))
-		return dfr;
-	else
+	struct timeval now;
+
+	if(timer_init(&dfr->timer) == NULL)
 		return NULL;
+	timeval_set_now(&now);
+	wheel_init(&dfr->wheel, &now);
+	dfr->draining = false;
+	return dfr;
 }
 
 /*
  * defer_destroy	Destroy the deferred packet engine.
  */
 void defer_destroy(struct defer *dfr) {
-	cl_rbtree_clear(&dfr->tree, NULL, NULL);
+	timer_destroy(&dfr->timer);
+	memset(dfr, 0, sizeof(struct defer));
 }
 
 /*
  * defer_rearm		Rearm the timer for the next deferred packet.
  */
 static int defer_rearm(struct defer *dfr) {
-	struct deferred_pkt *dpkt = cl_rbtree_peek(&dfr->tree);
-	if(dpkt)
-		return timer_arm(time_from_now(&dpkt->tv));
+	struct wheel_node *node = wheel_peek(&dfr->wheel);
+	if(node)
+		return timer_arm(&dfr->timer, &node->tv);
 	else
-		return timer_disarm();
+		return timer_disarm(&dfr->timer);
 }
 
 /*
@@ -74,39 +99,44 @@ static int defer_rearm(struct defer *dfr) {
 int defer_packet(struct defer *dfr, struct deferred_pkt *dpkt,
 	struct ccpacket *pkt, unsigned int ms)
 {
-	cl_rbtree_remove(&dfr->tree, dpkt);
+	wheel_remove(&dfr->wheel, &dpkt->node);
 	if(pkt) {
-		timeval_set_now(&dpkt->tv);
-		timeval_adjust(&dpkt->tv, ms);
+		struct timeval *tv = &dpkt->node.tv;
+		timeval_set_now(tv);
+		wheel_catch_up(&dfr->wheel, tv);
+		timeval_adjust(tv, ms);
 		ccpacket_copy(dpkt->packet, pkt);
-		if(cl_rbtree_add(&dfr->tree, dpkt) == NULL)
-			return -1;
+		wheel_add(&dfr->wheel, &dpkt->node);
 	}
+	/* The timer will be rearmed once all expired packets are sent */
+	if(dfr->draining)
+		return 0;
 	return defer_rearm(dfr);
 }
 
 /*
- * defer_packet_now		Send a deferred packet right now.
- */
-static void defer_packet_now(struct defer *dfr, struct deferred_pkt *dpkt) {
-	cl_rbtree_remove(&dfr->tree, dpkt);
-	timeval_set_now(&dpkt->tv);
-	timeval_adjust(&dpkt->tv, dpkt->writer->timeout);
-	ccwriter_do_write(dpkt->writer, dpkt->packet);
-}
-
-/*
- * defer_next		Process the next deferred packet
+ * defer_next		Process all deferred packets which have expired.
  */
 int defer_next(struct defer *dfr) {
-	struct deferred_pkt *dpkt;
+	struct wheel_node *node;
+	struct timeval now;
+	unsigned int n_pkts = 0;
 
-	if(timer_read() < 0)
+	/* The timer may have been rearmed since it was polled */
+	if(timer_read(&dfr->timer) < 0 && errno != EAGAIN)
 		return -1;
 
-	dpkt = cl_rbtree_peek(&dfr->tree);
-	if(dpkt)
-		defer_packet_now(dfr, dpkt);
+	/* Packets can be deferred again while draining, but a stop packet
+	 * is only repeated once, so this loop always terminates. */
+	timeval_set_now(&now);
+	dfr->draining = true;
+	while((node = wheel_expire(&dfr->wheel, &now))) {
+		struct deferred_pkt *dpkt = deferred_pkt_of(node);
+		ccwriter_do_write(dpkt->writer, dpkt->packet);
+		n_pkts++;
+	}
+	dfr->draining = false;
+	ptz_stats_defer(n_pkts);
 	return defer_rearm(dfr);
 }
 
@@ -114,5 +144,5 @@ int defer_next(struct defer *dfr) {
  * defer_get_fd		Get the file descriptor for deferred events.
  */
 int defer_get_fd(struct defer *dfr) {
-	return timer_get_fd();
+	return timer_get_fd(&dfr->timer);
 }
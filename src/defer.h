@@ -1,25 +1,45 @@
 #ifndef DEFER_H
 #define DEFER_H
 
+#include <stdbool.h>	/* for bool */
 #include <sys/time.h>	/* for struct timeval */
 #include "ccpacket.h"	/* for struct ccpacket */
-#include "clump.h"	/* for struct cl_rbtree */
+#include "histogram.h"	/* for struct histogram_coarse */
+#include "stats.h"	/* for struct rcv_stats */
+#include "timer.h"	/* for struct timer */
+#include "wheel.h"	/* for struct wheel, struct wheel_node */
 
 struct ccwriter;	/* avoid circular dependency */
 
+#define HELD_MAX (4)	/* maximum commands held behind a pending one */
+
 struct deferred_pkt {
 	struct ccwriter		*writer;	/* writer to send packet */
-	struct timeval		tv;		/* time to send packet */
+	struct wheel_node	node;		/* time to send packet */
 	struct timeval		sent;		/* last sent time */
 	struct ccpacket		*packet;	/* packet to be deferred */
 	unsigned int		n_cnt;		/* number of times deferred */
+	struct ccpacket		*pending;	/* command waiting for line */
+	struct ccpacket		*held[HELD_MAX]; /* commands behind pending one */
+	struct deferred_pkt	*next_pending;	/* next pending receiver */
+	bool			is_pending;	/* command is pending */
+	bool			is_gapped;	/* must-send waits for the gap */
+	unsigned int		n_held;		/* number of held commands */
+	bool			is_prio;	/* pending in priority class */
+	unsigned int		deficit;	/* round-robin credit (bytes) */
+	unsigned int		cost;		/* bytes of previous command */
+	struct timeval		pended;		/* time receiver started waiting */
+	struct histogram_coarse	latency;	/* pending latency histogram */
+	struct rcv_stats	stats;		/* receiver counters */
 };
 
 void deferred_pkt_init(struct deferred_pkt *dpkt);
 void deferred_pkt_destroy(struct deferred_pkt *dpkt);
 
 struct defer {
-	struct cl_rbtree	tree;		/* tree of deferred packets */
+	struct timer		timer;		/* timer for deferred packets */
+	struct wheel		wheel;		/* wheel of deferred packets */
+	bool			draining;	/* sending expired packets */
 };
 
 struct defer *defer_init(struct defer *dfr);
@@ -0,0 +1,172 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>	/* for memset */
+#include "histogram.h"	/* for struct histogram, prototypes */
+
+/*
+ * hist_bucket		Get the bucket for a sample.  The top bits below the
+ *			leading one select the sub-bucket.
+ *
+ * ns: sample (ns)
+ * bits: log2 of sub-buckets per power of 2
+ */
+static unsigned int hist_bucket(uint64_t ns, unsigned int bits) {
+	unsigned int e;
+
+	if(ns < (1u << bits))
+		return ns;
+	if(ns >= (1ULL << HIST_MAG))
+		ns = (1ULL << HIST_MAG) - 1;
+	e = 63 - __builtin_clzll(ns);
+	return ((e - bits + 1) << bits) +
+		((ns >> (e - bits)) & ((1u << bits) - 1));
+}
+
+/*
+ * hist_high		Get the highest sample which falls in a bucket.
+ *
+ * b: bucket number
+ * bits: log2 of sub-buckets per power of 2
+ */
+static uint64_t hist_high(unsigned int b, unsigned int bits) {
+	unsigned int sub = 1u << bits;
+	unsigned int shift;
+
+	if(b < sub)
+		return b;
+	shift = b / sub - 1;
+	return ((uint64_t)(sub + b % sub + 1) << shift) - 1;
+}
+
+/*
+ * hist_add		Add one sample to a histogram.
+ *
+ * bucket: sample counts
+ * bits: log2 of sub-buckets per power of 2
+ * ns: sample (ns)
+ */
+static void hist_add(struct hist_head *head, uint64_t *bucket,
+	unsigned int bits, int64_t ns)
+{
+	if(ns < 0)
+		ns = 0;
+	bucket[hist_bucket(ns, bits)]++;
+	head->n_samples++;
+	head->total += ns;
+	if(ns > head->max)
+		head->max = ns;
+}
+
+/*
+ * hist_percentile	Get an upper bound for a percentile.
+ *
+ * bucket: sample counts
+ * bits: log2 of sub-buckets per power of 2
+ * pm: percentile, in tenths (0-1000)
+ * return: highest sample in the bucket holding the percentile (ns), but
+ *         no more than the largest sample
+ */
+static uint64_t hist_percentile(const struct hist_head *head,
+	const uint64_t *bucket, unsigned int bits, unsigned int pm)
+{
+	uint64_t rank = (head->n_samples * pm + 999) / 1000;
+	uint64_t n = 0;
+	unsigned int b;
+
+	for(b = 0; b < HIST_N_BUCKETS(bits); b++) {
+		n += bucket[b];
+		if(n >= rank && n > 0) {
+			uint64_t high = hist_high(b, bits);
+			return (high < head->max) ? high : head->max;
+		}
+	}
+	return head->max;
+}
+
+/*
+ * hist_log		Log a summary of a histogram.
+ *
+ * bucket: sample counts
+ * bits: log2 of sub-buckets per power of 2
+ * label: label to identify the histogram
+ */
+static void hist_log(const struct hist_head *head, const uint64_t *bucket,
+	unsigned int bits, struct log *log, const char *label)
+{
+	if(head->n_samples == 0)
+		return;
+	log_println(log, "%s: %llu  avg: %.1f us  p50: %.1f us  p99: %.1f us  "
+		"p99.9: %.1f us  max: %.1f us", label,
+		(unsigned long long)head->n_samples,
+		head->total / 1000.0 / head->n_samples,
+		hist_percentile(head, bucket, bits, 500) / 1000.0,
+		hist_percentile(head, bucket, bits, 990) / 1000.0,
+		hist_percentile(head, bucket, bits, 999) / 1000.0,
+		head->max / 1000.0);
+}
+
+/*
+ * histogram_clear	Clear all samples from a histogram.
+ */
+void histogram_clear(struct histogram *hist) {
+	memset(hist, 0, sizeof(struct histogram));
+}
+
+/*
+ * histogram_add	Add one sample to a histogram.
+ *
+ * ns: sample (ns)
+ */
+void histogram_add(struct histogram *hist, int64_t ns) {
+	hist_add(&hist->head, hist->bucket, HIST_SUB_BITS, ns);
+}
+
+/*
+ * histogram_log	Log a summary of a histogram.
+ *
+ * label: label to identify the histogram
+ */
+void histogram_log(const struct histogram *hist, struct log *log,
+	const char *label)
+{
+	hist_log(&hist->head, hist->bucket, HIST_SUB_BITS, log, label);
+}
+
+/*
+ * histogram_coarse_clear	Clear all samples from a coarse histogram.
+ */
+void histogram_coarse_clear(struct histogram_coarse *hist) {
+	memset(hist, 0, sizeof(struct histogram_coarse));
+}
+
+/*
+ * histogram_coarse_add		Add one sample to a coarse histogram.
+ *
+ * ns: sample (ns)
+ */
+void histogram_coarse_add(struct histogram_coarse *hist, int64_t ns) {
+	hist_add(&hist->head, hist->bucket, HIST_COARSE_BITS, ns);
+}
+
+/*
+ * histogram_coarse_log		Log a summary of a coarse histogram.
+ *
+ * label: label to identify the histogram
+ */
+void histogram_coarse_log(const struct histogram_coarse *hist,
+	struct log *log, const char *label)
+{
+	hist_log(&hist->head, hist->bucket, HIST_COARSE_BITS, log, label);
+}
@@ -0,0 +1,51 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>	/* for uint64_t */
+#include "log.h"	/* for struct log */
+
+#define HIST_MAG (36)				/* samples up to 2^36 ns */
+#define HIST_SUB_BITS (4)			/* log2 of sub-buckets */
+#define HIST_COARSE_BITS (2)			/* log2 of coarse sub-buckets */
+
+/* Number of buckets with 2^bits sub-buckets per power of 2 */
+#define HIST_N_BUCKETS(bits) ((HIST_MAG - (bits) + 1) << (bits))
+#define HIST_BUCKETS HIST_N_BUCKETS(HIST_SUB_BITS)
+#define HIST_COARSE_BUCKETS HIST_N_BUCKETS(HIST_COARSE_BITS)
+
+/*
+ * A histogram counts latency samples in log-linear (HDR-style) buckets, from
+ * 1 ns up to about a minute.  Each power of two is split into 16 equal
+ * buckets, so a bucket is never wider than 1/16 of its value.  Counts are
+ * 64 bits, since route histograms are never cleared.
+ */
+struct hist_head {
+	uint64_t	n_samples;		/* number of samples */
+	uint64_t	max;			/* largest sample (ns) */
+	uint64_t	total;			/* sum of all samples (ns) */
+};
+
+struct histogram {
+	struct hist_head head;				/* summary */
+	uint64_t	bucket[HIST_BUCKETS];		/* sample counts */
+};
+
+/*
+ * A coarse histogram splits each power of two into only 4 buckets (1/4 of
+ * the value), for histograms kept for every receiver.
+ */
+struct histogram_coarse {
+	struct hist_head head;				/* summary */
+	uint64_t	bucket[HIST_COARSE_BUCKETS];	/* sample counts */
+};
+
+void histogram_clear(struct histogram *hist);
+void histogram_add(struct histogram *hist, int64_t ns);
+void histogram_log(const struct histogram *hist, struct log *log,
+	const char *label);
+void histogram_coarse_clear(struct histogram_coarse *hist);
+void histogram_coarse_add(struct histogram_coarse *hist, int64_t ns);
+void histogram_coarse_log(const struct histogram_coarse *hist,
+	struct log *log, const char *label);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdio.h>	/* for sscanf */
+#include <stdlib.h>	/* for strtol, strtoul */
+#include <string.h>	/* for memchr, memcpy, strstr */
+#include <strings.h>	/* for strncasecmp */
+#include "http.h"	/* for struct http_resp, prototypes */
+
+#define HTTP_LINE_MAX (1024)	/* longest line allowed in a response */
+
+/*
+ * http_resp_init	Initialize an HTTP response parser.
+ */
+void http_resp_init(struct http_resp *rsp) {
+	rsp->state = HTTP_STATUS;
+	rsp->status = 0;
+	rsp->length = -1;
+	rsp->chunked = false;
+	rsp->close = false;
+	rsp->remaining = 0;
+}
+
+/*
+ * http_get_line	Get one line from the receive buffer.  The line is
+ *			consumed from the buffer and copied (truncated, without
+ *			line ending) into a string.
+ *
+ * line: string to copy line into
+ * n_line: size of line string
+ * return: 1 if a line was found; 0 if more data needed; -1 on error
+ */
+static int http_get_line(struct buffer *rxbuf, char *line, size_t n_line) {
+	size_t a = buffer_available(rxbuf);
+	char *mess = buffer_output(rxbuf);
+	char *nl = memchr(mess, '\n', a);
+	size_t len;
+
+	/* reading stops at the high-water mark, so a longer line would
+	 * never be completed */
+	if(nl == NULL)
+		return (a > HTTP_LINE_MAX || buffer_is_high(rxbuf)) ? -1 : 0;
+	len = nl - mess;
+	if(len > 0 && mess[len - 1] == '\r')
+		len--;
+	if(len >= n_line)
+		len = n_line - 1;
+	memcpy(line, mess, len);
+	line[len] = '\0';
+	buffer_consume(rxbuf, nl - mess + 1);
+	return 1;
+}
+
+/*
+ * http_header_is	Test if a header line has the given field name.
+ *
+ * return: pointer to field value, or NULL if name does not match
+ */
+static const char *http_header_is(const char *line, const char *name) {
+	size_t n = strlen(name);
+	if(strncasecmp(line, name, n) == 0 && line[n] == ':') {
+		line += n + 1;
+		while(*line == ' ' || *line == '\t')
+			line++;
+		return line;
+	} else
+		return NULL;
+}
+
+/*
+ * http_parse_status	Parse the response status line.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int http_parse_status(struct http_resp *rsp, const char *line) {
+	int major, minor;
+	if(sscanf(line, "HTTP/%d.%d %d", &major, &minor, &rsp->status) != 3)
+		return -1;
+	/* HTTP/1.0 closes the connection unless asked to keep it alive */
+	rsp->close = (major < 1 || (major == 1 && minor == 0));
+	rsp->state = HTTP_HEADER;
+	return 0;
+}
+
+/*
+ * http_parse_header	Parse one response header line.
+ */
+static void http_parse_header(struct http_resp *rsp, const char *line) {
+	const char *val;
+
+	if((val = http_header_is(line, "Content-Length")))
+		rsp->length = strtol(val, NULL, 10);
+	else if((val = http_header_is(line, "Transfer-Encoding")))
+		rsp->chunked = (strstr(val, "chunked") != NULL);
+	else if((val = http_header_is(line, "Connection"))) {
+		if(strncasecmp(val, "close", 5) == 0)
+			rsp->close = true;
+		else if(strncasecmp(val, "keep-alive", 10) == 0)
+			rsp->close = false;
+	}
+}
+
+/*
+ * http_end_headers	Handle the end of the response headers.
+ */
+static void http_end_headers(struct http_resp *rsp) {
+	if(rsp->status >= 100 && rsp->status < 200) {
+		/* informational response: the real one follows */
+		http_resp_init(rsp);
+	} else if(rsp->status == 204 || rsp->status == 304)
+		rsp->state = HTTP_DONE;
+	else if(rsp->chunked)
+		rsp->state = HTTP_CHUNK_SIZE;
+	else if(rsp->length > 0) {
+		rsp->remaining = rsp->length;
+		rsp->state = HTTP_BODY;
+	} else if(rsp->length == 0)
+		rsp->state = HTTP_DONE;
+	else {
+		/* no length: body ends when the connection closes */
+		rsp->close = true;
+		rsp->state = HTTP_BODY_EOF;
+	}
+}
+
+/*
+ * http_skip_body	Consume body data from the receive buffer.
+ *
+ * return: true if all remaining body data has been consumed
+ */
+static bool http_skip_body(struct http_resp *rsp, struct buffer *rxbuf) {
+	size_t n_bytes = buffer_available(rxbuf);
+	if(n_bytes > rsp->remaining)
+		n_bytes = rsp->remaining;
+	buffer_consume(rxbuf, n_bytes);
+	rsp->remaining -= n_bytes;
+	return rsp->remaining == 0;
+}
+
+/*
+ * http_parse_line	Parse one line of a response.
+ *
+ * return: 0 on success; -1 on error
+ */
+static int http_parse_line(struct http_resp *rsp, const char *line) {
+	switch(rsp->state) {
+	case HTTP_STATUS:
+		return http_parse_status(rsp, line);
+	case HTTP_HEADER:
+		if(line[0])
+			http_parse_header(rsp, line);
+		else
+			http_end_headers(rsp);
+		return 0;
+	case HTTP_CHUNK_SIZE:
+		rsp->remaining = strtoul(line, NULL, 16);
+		if(rsp->remaining)
+			rsp->state = HTTP_CHUNK_DATA;
+		else
+			rsp->state = HTTP_TRAILER;
+		return 0;
+	case HTTP_CHUNK_END:
+		rsp->state = HTTP_CHUNK_SIZE;
+		return 0;
+	case HTTP_TRAILER:
+		if(line[0] == '\0')
+			rsp->state = HTTP_DONE;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * http_resp_parse	Parse response data from the receive buffer.  Data
+ *			after the end of the response is left in the buffer.
+ *
+ * rxbuf: receive buffer
+ * return: 1 if the response is complete; 0 if more data is needed; -1 on
+ *         error
+ */
+int http_resp_parse(struct http_resp *rsp, struct buffer *rxbuf) {
+	char line[256];
+	int r;
+
+	while(rsp->state != HTTP_DONE) {
+		if(buffer_is_empty(rxbuf))
+			return 0;
+		switch(rsp->state) {
+		case HTTP_BODY:
+			if(http_skip_body(rsp, rxbuf))
+				rsp->state = HTTP_DONE;
+			break;
+		case HTTP_BODY_EOF:
+			buffer_clear(rxbuf);
+			return 0;
+		case HTTP_CHUNK_DATA:
+			if(http_skip_body(rsp, rxbuf))
+				rsp->state = HTTP_CHUNK_END;
+			break;
+		default:
+			r = http_get_line(rxbuf, line, sizeof(line));
+			if(r <= 0)
+				return r;
+			if(http_parse_line(rsp, line) < 0)
+				return -1;
+			break;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,35 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>	/* for bool */
+#include "buffer.h"	/* for struct buffer */
+
+enum http_state {
+	HTTP_STATUS,		/* waiting for status line */
+	HTTP_HEADER,		/* reading header lines */
+	HTTP_BODY,		/* reading body of known length */
+	HTTP_BODY_EOF,		/* reading body until connection closes */
+	HTTP_CHUNK_SIZE,	/* waiting for chunk size line */
+	HTTP_CHUNK_DATA,	/* reading chunk data */
+	HTTP_CHUNK_END,		/* waiting for CRLF after chunk data */
+	HTTP_TRAILER,		/* reading trailer lines */
+	HTTP_DONE,		/* response complete */
+};
+
+/*
+ * An HTTP response parser tracks one response as it arrives, so that a
+ * keep-alive connection can be reused when the response is complete.
+ */
+struct http_resp {
+	enum http_state	state;		/* parser state */
+	int		status;		/* response status code */
+	long		length;		/* content length (-1 if unknown) */
+	bool		chunked;	/* chunked transfer encoding */
+	bool		close;		/* connection closes after response */
+	size_t		remaining;	/* bytes remaining in body / chunk */
+};
+
+void http_resp_init(struct http_resp *rsp);
+int http_resp_parse(struct http_resp *rsp, struct buffer *rxbuf);
+
+#endif
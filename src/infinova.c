@@ -53,20 +53,24 @@ static void infinova_authenticate(struct ccwriter *wtr) {
 	}
 }
 
+/*
+ * Headers for a pelco D PTZ packet.  These never change, so they are copied
+ * with one append.
+ */
+static const uint8_t infinova_d_headers[HEADER_SZ * 2] = {
+	'I', 'N', 'F', MSG_ID_PTZ, 0, 0, 0, 0,		/* magic numbers */
+	0, 0, 0, HEADER_SZ + PELCO_D_SZ,
+	/* PTZ packets need an extra header */
+	1, 0, 0, 0, 0, 0, 0, PELCO_D_SZ,	/* don't know what 1 means */
+	0, 0, 0, 0,
+};
+
 /*
  * infinova_d_header		Write a header for a pelco D PTZ packet.
  */
 static int infinova_d_header(struct ccwriter *wtr) {
-	if(infinova_header(wtr, MSG_ID_PTZ, HEADER_SZ + PELCO_D_SZ)) {
-		/* PTZ packets need an extra header */
-		uint8_t *mess = ccwriter_append(wtr, HEADER_SZ);
-		if(mess) {
-			mess[0] = 1;	/* don't know what this means */
-			mess[7] = PELCO_D_SZ;
-			return 1;
-		}
-	}
-	return 0;
+	return ccwriter_append_bytes(wtr, infinova_d_headers,
+		sizeof(infinova_d_headers));
 }
 
 /*
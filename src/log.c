@@ -12,22 +12,51 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <errno.h>	/* for errno, EINTR */
 #include <stdarg.h>	/* for va_list, va_start, va_end */
 #include <stdint.h>	/* for uint8_t */
-#include <time.h>	/* for localtime, strftime */
-#include <sys/time.h>	/* for gettimeofday */
+#include <stdlib.h>	/* for malloc, calloc, free */
+#include <string.h>	/* for memcpy, strlen */
+#include <time.h>	/* for clock_gettime, localtime_r, strftime */
+#include <sys/eventfd.h>	/* for eventfd, eventfd_read, eventfd_write */
+#include <unistd.h>	/* for close, write */
 #include "log.h"	/* for struct log, prototypes */
 
+/* Size of the buffer for batching lines into one write */
+#define LOG_BATCH_SZ (64 * 1024)
+
+/* Line being filled by the calling thread, or NULL if writing directly */
+static __thread struct log_line *cur_line;
+static __thread struct log_ring *cur_ring;
+
+/* The calling thread is dropping its current line (ring was full) */
+static __thread bool dropping;
+
+/* Time stamp prefix of the calling thread, cached for one second */
+static __thread time_t stamp_sec;
+static __thread char stamp[22];
+
 /*
  * log_init		Initialize a new message log.
  *
  * return: pointer to struct log or NULL on failure
  */
 struct log *log_init(struct log *log) {
+	unsigned int i;
+
 	log->out = stderr;
 	log->debug = false;
 	log->packet = false;
 	log->stats = false;
+	log->running = false;
+	log->fd_wake = -1;
+	atomic_init(&log->awake, false);
+	atomic_init(&log->stop, false);
+	for(i = 0; i < LOG_RINGS; i++) {
+		atomic_init(&log->used[i], false);
+		atomic_init(&log->ring[i], NULL);
+	}
+	atomic_init(&log->n_dropped, 0);
 	return log;
 }
 
@@ -46,37 +75,305 @@ struct log *log_open_file(struct log *log, const char *filename) {
 		return NULL;
 }
 
+/*
+ * log_stamp		Get the time stamp prefix for a new line.  Formatting
+ *			the local time is slow, so it is only done when the
+ *			second changes.
+ *
+ * return: borrowed pointer to time stamp
+ */
+static const char *log_stamp(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if(ts.tv_sec != stamp_sec) {
+		struct tm now;
+		localtime_r(&ts.tv_sec, &now);
+		strftime(stamp, sizeof(stamp), "%Y %b %d %H:%M:%S ", &now);
+		stamp_sec = ts.tv_sec;
+	}
+	return stamp;
+}
+
+/*
+ * log_write_out	Write a batch of lines to the log stream.
+ *
+ * buf: lines to write
+ * n_bytes: number of bytes to write
+ */
+static void log_write_out(struct log *log, const char *buf, size_t n_bytes) {
+	int fd = fileno(log->out);
+
+	while(n_bytes) {
+		ssize_t n = write(fd, buf, n_bytes);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		n_bytes -= n;
+	}
+}
+
+/*
+ * log_drain		Write out all lines in the rings, in as few writes as
+ *			possible.
+ *
+ * batch: buffer for batching lines (LOG_BATCH_SZ)
+ * return: number of lines written
+ */
+static size_t log_drain(struct log *log, char *batch) {
+	unsigned long long n_dropped;
+	size_t n_batch = 0;
+	size_t n_lines = 0;
+	unsigned int i;
+
+	for(i = 0; i < LOG_RINGS; i++) {
+		struct log_ring *ring = atomic_load(&log->ring[i]);
+		size_t head, tail;
+
+		if(ring == NULL)
+			continue;
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		tail = atomic_load(&ring->tail);
+		while(head != tail) {
+			struct log_line *line = ring->line +
+				(head & (LOG_RING_SZ - 1));
+			if(n_batch + line->len > LOG_BATCH_SZ) {
+				log_write_out(log, batch, n_batch);
+				n_batch = 0;
+			}
+			memcpy(batch + n_batch, line->text, line->len);
+			n_batch += line->len;
+			head++;
+			n_lines++;
+			/* give the slot back to the producer */
+			atomic_store_explicit(&ring->head, head,
+				memory_order_release);
+		}
+	}
+	n_dropped = atomic_exchange(&log->n_dropped, 0);
+	if(n_dropped) {
+		if(n_batch + LOG_LINE_MAX > LOG_BATCH_SZ) {
+			log_write_out(log, batch, n_batch);
+			n_batch = 0;
+		}
+		n_batch += snprintf(batch + n_batch, LOG_LINE_MAX,
+			"%slog: %llu lines dropped\n", log_stamp(), n_dropped);
+	}
+	if(n_batch)
+		log_write_out(log, batch, n_batch);
+	return n_lines;
+}
+
+/*
+ * log_writer		Write out logged lines until the log is destroyed.
+ */
+static void *log_writer(void *arg) {
+	struct log *log = arg;
+	char *batch = malloc(LOG_BATCH_SZ);
+	eventfd_t val;
+
+	if(batch == NULL)
+		return NULL;
+	while(true) {
+		bool stop = atomic_load(&log->stop);
+		/* Clear the flag before draining, so that a line logged
+		 * during the drain always causes another wakeup */
+		atomic_store(&log->awake, false);
+		if(log_drain(log, batch) == 0) {
+			if(stop)
+				break;
+			eventfd_read(log->fd_wake, &val);
+		}
+	}
+	free(batch);
+	return NULL;
+}
+
+/*
+ * log_release		Release the ring of a thread which is exiting, so
+ *			another thread can claim it.
+ *
+ * arg: flag of claimed ring
+ */
+static void log_release(void *arg) {
+	atomic_store((atomic_bool *)arg, false);
+}
+
+/*
+ * log_start		Start writing the message log on a background thread.
+ *			Lines are then formatted into a ring for each logging
+ *			thread, so they never wait for the log stream.  If a
+ *			ring is full, lines are dropped (and counted).  This
+ *			must be called after the process is daemonized.
+ *
+ * return: 0 on success; -1 on error (log is still written directly)
+ */
+int log_start(struct log *log) {
+	log->fd_wake = eventfd(0, EFD_CLOEXEC);
+	if(log->fd_wake < 0)
+		return -1;
+	if(pthread_key_create(&log->key, log_release))
+		goto fail;
+	log->running = true;
+	if(pthread_create(&log->thread, NULL, log_writer, log)) {
+		log->running = false;
+		pthread_key_delete(log->key);
+		goto fail;
+	}
+	return 0;
+fail:
+	close(log->fd_wake);
+	log->fd_wake = -1;
+	return -1;
+}
+
+/*
+ * log_stop		Stop the writer thread, after all lines are written.
+ */
+static void log_stop(struct log *log) {
+	unsigned int i;
+
+	atomic_store(&log->stop, true);
+	eventfd_write(log->fd_wake, 1);
+	pthread_join(log->thread, NULL);
+	log->running = false;
+	pthread_key_delete(log->key);
+	close(log->fd_wake);
+	log->fd_wake = -1;
+	for(i = 0; i < LOG_RINGS; i++) {
+		free(atomic_load(&log->ring[i]));
+		atomic_store(&log->ring[i], NULL);
+		atomic_store(&log->used[i], false);
+	}
+}
+
 /*
  * log_destroy		Destroy a previously initialized message log.
  */
 void log_destroy(struct log *log) {
+	if(log->running)
+		log_stop(log);
 	if(log->out != stderr) {
 		fclose(log->out);
 		log->out = stderr;
 	}
 }
 
+/*
+ * log_ring_get		Get the ring of the calling thread, claiming one if
+ *			it does not have one yet.
+ *
+ * return: borrowed pointer to ring, or NULL if none are available
+ */
+static struct log_ring *log_ring_get(struct log *log) {
+	atomic_bool *used = pthread_getspecific(log->key);
+	struct log_ring *ring;
+	unsigned int i;
+
+	if(used == NULL) {
+		for(i = 0; i < LOG_RINGS; i++) {
+			bool f = false;
+			if(atomic_compare_exchange_strong(&log->used[i], &f,
+				true))
+			{
+				break;
+			}
+		}
+		if(i == LOG_RINGS)
+			return NULL;
+		used = log->used + i;
+		pthread_setspecific(log->key, used);
+	}
+	i = used - log->used;
+	ring = atomic_load(&log->ring[i]);
+	if(ring == NULL) {
+		ring = calloc(1, sizeof(struct log_ring));
+		if(ring == NULL)
+			return NULL;
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_store(&log->ring[i], ring);
+	}
+	return ring;
+}
+
+/*
+ * log_line_vappend	Append formatted text to the current line.  Text past
+ *			the end of the line is truncated.
+ */
+static void log_line_vappend(const char *format, va_list va) {
+	/* leave room for the newline */
+	size_t room = LOG_LINE_MAX - 1 - cur_line->len;
+	int n = vsnprintf(cur_line->text + cur_line->len, room, format, va);
+
+	if(n > 0)
+		cur_line->len += ((size_t)n < room) ? (size_t)n : room - 1;
+}
+
+/*
+ * log_line_append	Append formatted text to the current line.
+ */
+static void log_line_append(const char *format, ...) {
+	va_list va;
+	va_start(va, format);
+	log_line_vappend(format, va);
+	va_end(va);
+}
+
 /*
  * log_line_start	Start a new line in the message log.
  */
 void log_line_start(struct log *log) {
-	struct timeval tv;
-	struct timezone tz;
-	struct tm *now;
-	char buf[22];
+	const char *ts = log_stamp();
 
-	gettimeofday(&tv, &tz);
-	now = localtime(&tv.tv_sec);
-	strftime(buf, 22, "%Y %b %d %H:%M:%S ", now);
-	fprintf(log->out, buf);
+	if(log->running) {
+		struct log_ring *ring = log_ring_get(log);
+		if(ring) {
+			size_t tail = atomic_load_explicit(&ring->tail,
+				memory_order_relaxed);
+			size_t head = atomic_load_explicit(&ring->head,
+				memory_order_acquire);
+			if(tail - head >= LOG_RING_SZ) {
+				atomic_fetch_add(&log->n_dropped, 1);
+				dropping = true;
+				return;
+			}
+			cur_ring = ring;
+			cur_line = ring->line + (tail & (LOG_RING_SZ - 1));
+			cur_line->len = 0;
+			log_line_append("%s", ts);
+			return;
+		}
+	}
+	/* Hold the stream until the line is ended, so lines logged by
+	 * different threads are not mixed together */
+	flockfile(log->out);
+	fputs(ts, log->out);
 }
 
 /*
  * log_line_end		End the current line in the message log.
  */
 void log_line_end(struct log *log) {
-	fprintf(log->out, "\n");
-	fflush(log->out);
+	if(cur_line) {
+		size_t tail = atomic_load_explicit(&cur_ring->tail,
+			memory_order_relaxed);
+		cur_line->text[cur_line->len++] = '\n';
+		cur_line = NULL;
+		atomic_store(&cur_ring->tail, tail + 1);
+		/* Only the first line since the last drain needs a wakeup */
+		if(!atomic_exchange(&log->awake, true))
+			eventfd_write(log->fd_wake, 1);
+	} else if(dropping)
+		dropping = false;
+	else {
+		fputc('\n', log->out);
+		fflush(log->out);
+		funlockfile(log->out);
+	}
 }
 
 /*
@@ -88,8 +385,12 @@ void log_line_end(struct log *log) {
 void log_printf(struct log *log, const char *format, ...) {
 	va_list va;
 	va_start(va, format);
-	if(log)
-		vfprintf(log->out, format, va);
+	if(log) {
+		if(cur_line)
+			log_line_vappend(format, va);
+		else if(!dropping)
+			vfprintf(log->out, format, va);
+	}
 	va_end(va);
 }
 
@@ -104,7 +405,10 @@ void log_println(struct log *log, const char *format, ...) {
 	va_start(va, format);
 	if(log) {
 		log_line_start(log);
-		vfprintf(log->out, format, va);
+		if(cur_line)
+			log_line_vappend(format, va);
+		else if(!dropping)
+			vfprintf(log->out, format, va);
 		log_line_end(log);
 	}
 	va_end(va);
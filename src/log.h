@@ -1,18 +1,54 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <pthread.h>	/* for pthread_t, pthread_key_t */
+#include <stdatomic.h>	/* for atomic_bool, atomic_size_t */
 #include <stdbool.h>	/* for bool */
 #include <stdio.h>	/* for FILE */
 
+#define LOG_LINE_MAX (512)	/* longest line, including time stamp */
+#define LOG_RING_SZ (1024)	/* lines in a ring (power of two) */
+#define LOG_RINGS (32)		/* rings (one for each logging thread) */
+
+/*
+ * A preformatted line, ready to be written out.
+ */
+struct log_line {
+	size_t		len;		/* length of text */
+	char		text[LOG_LINE_MAX];	/* text, with newline */
+};
+
+/*
+ * A ring passes lines from one logging thread to the writer thread.  There
+ * is only one producer and one consumer, so it needs no locks.  Both
+ * positions count up without wrapping, and are masked to get lines.
+ */
+struct log_ring {
+	atomic_size_t	head;		/* next line to write out */
+	_Alignas(64) atomic_size_t tail;	/* next line to fill */
+	struct log_line	line[LOG_RING_SZ];	/* line slots */
+};
+
 struct log {
 	FILE	*out;		/* output stream */
 	bool	debug;		/* debug raw input/output data */
 	bool	packet;		/* log packet details */
 	bool	stats;		/* log packet statistics */
+
+	bool			running;	/* writer thread is running */
+	pthread_t		thread;		/* writer thread */
+	pthread_key_t		key;		/* ring of logging thread */
+	int			fd_wake;	/* eventfd to wake writer */
+	atomic_bool		awake;		/* wakeup already signalled */
+	atomic_bool		stop;		/* writer should stop */
+	atomic_bool		used[LOG_RINGS];	/* ring claimed by thread */
+	struct log_ring * _Atomic ring[LOG_RINGS];	/* rings, on demand */
+	atomic_ullong		n_dropped;	/* lines dropped (ring full) */
 };
 
 struct log *log_init(struct log *log);
 struct log *log_open_file(struct log *log, const char *filename);
+int log_start(struct log *log);
 void log_destroy(struct log *log);
 void log_line_start(struct log *log);
 void log_line_end(struct log *log);
@@ -12,14 +12,18 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <signal.h>	/* for sigset_t, SIGUSR1 */
+#include <stdlib.h>	/* for atoi */
 #include <string.h>	/* for strerror */
 #include <unistd.h>	/* for daemon, sleep */
 #include <sys/errno.h>	/* for errno */
 
-#include "timer.h"
+#include "capture.h"
 #include "config.h"
-#include "poller.h"
+#include "shard.h"
 #include "stats.h"
+#include "trace.h"
+#include "uring.h"
 
 #define VERSION "0.56"
 #define BANNER "protozoa: v" VERSION "  Copyright (C) 2006-2014  MnDOT"
@@ -42,14 +46,28 @@ static int make_daemon(struct log *log) {
 		return 0;
 }
 
+/** Block signals which are read by the poller.  This must be done before
+ * any threads are started, so that they all inherit the mask.
+ */
+static void block_signals(void) {
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
 /** Run the main protozoa loop.
  *
+ * @param n_threads	Number of poller threads
+ * @param uring		Poll with io_uring instead of epoll
  * Return: errno value on error, or 0 if config file has changed.
  */
-static int run_protozoa(struct log *log, bool dryrun) {
+static int run_protozoa(struct log *log, bool dryrun, unsigned int n_threads,
+	bool uring)
+{
 	struct config		cfg;
-	struct poller		poll;
-	int			n_channels;
+	struct shards		shards;
 	int			rc = 0;
 
 	log_println(log, BANNER);
@@ -65,21 +83,12 @@ static int run_protozoa(struct log *log, bool dryrun) {
 	}
 	if(dryrun)
 		goto out_1;
-	if(timer_init() == NULL) {
+	if(shards_init(&shards, n_threads, uring, &cfg) == NULL) {
 		rc = (errno ? errno : -1);
 		goto out_1;
 	}
-	n_channels = cfg.n_channels;
-	if(poller_init(&poll, n_channels, config_cede_channels(&cfg),
-		cfg.defer) == NULL)
-	{
-		rc = (errno ? errno : -1);
-		goto out_2;
-	}
-	rc = poller_loop(&poll);
-	poller_destroy(&poll);
-out_2:
-	timer_destroy();
+	rc = shards_run(&shards);
+	shards_destroy(&shards);
 out_1:
 	config_destroy(&cfg);
 out_0:
@@ -92,10 +101,16 @@ int main(int argc, char* argv[]) {
 	struct log log;
 	bool daemonize = false;
 	bool dryrun = false;
+	unsigned int n_threads = 1;
+	bool uring = false;
+	const char *trace = NULL;
+	const char *capture = NULL;
 
 	log_init(&log);
 	log_println(&log, "================== protozoa init ===============");
 	for(i = 0; i < argc; i++) {
+		if(strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			capture = argv[++i];
 		if(strcmp(argv[i], "--daemonize") == 0)
 			daemonize = true;
 		if(strcmp(argv[i], "--debug") == 0)
@@ -106,14 +121,35 @@ int main(int argc, char* argv[]) {
 			log.packet = true;
 		if(strcmp(argv[i], "--stats") == 0)
 			log.stats = true;
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			n_threads = atoi(argv[++i]);
+		if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace = argv[++i];
+		if(strcmp(argv[i], "--uring") == 0)
+			uring = true;
+	}
+	if(uring && !uring_is_supported()) {
+		log_println(&log, "io_uring not supported; using epoll");
+		uring = false;
 	}
+	/* open before daemon changes directory; the mapping is inherited */
+	if(trace && !dryrun && trace_open(trace) < 0)
+		log_println(&log, "trace: %s %s", strerror(errno), trace);
+	if(capture && !dryrun && capture_open(capture) < 0)
+		log_println(&log, "capture: %s %s", strerror(errno), capture);
 	if(daemonize) {
 		rc = make_daemon(&log);
 		if(rc)
 			goto out;
 	}
+	block_signals();
+	/* the writer thread would not survive daemon's fork */
+	if(!dryrun && log_start(&log) < 0)
+		log_println(&log, "log: cannot start writer thread");
+	if(capture && !dryrun && capture_start(&log) < 0)
+		log_println(&log, "capture: cannot start writer thread");
 	while(true) {
-		rc = run_protozoa(&log, dryrun);
+		rc = run_protozoa(&log, dryrun, n_threads, uring);
 		if(dryrun)
 			break;
 		if(rc > 0)
@@ -129,6 +165,8 @@ int main(int argc, char* argv[]) {
 out:
 	if(rc > 0)
 		log_println(&log, "Error: %s", strerror(rc));
+	capture_close();
+	trace_close();
 	log_destroy(&log);
 	return rc;
 }
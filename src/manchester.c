@@ -252,6 +252,7 @@ static inline enum decode_t manchester_read_message(struct ccreader *rdr,
 		log_println(rdr->log, "Manchester: unexpected byte %02X",
 			mess[0]);
 		buffer_consume(rxbuf, 1);
+		ccreader_decode_error(rdr);
 		return DECODE_MORE;
 	}
 	manchester_decode_packet(rdr, mess);
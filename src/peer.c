@@ -0,0 +1,144 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <netdb.h>	/* for getnameinfo, NI_MAXHOST, NI_MAXSERV */
+#include <stdbool.h>	/* for bool */
+#include <stdlib.h>	/* for malloc, free */
+#include <string.h>	/* for memcmp, memcpy */
+#include "peer.h"	/* for struct peer, prototypes */
+
+/*
+ * peer_matches		Test if a peer has the given socket address.
+ */
+static bool peer_matches(const struct peer *peer, const struct sockaddr *addr,
+	socklen_t addr_len)
+{
+	return peer->addr_len == addr_len &&
+	       memcmp(&peer->addr, addr, addr_len) == 0;
+}
+
+/*
+ * peer_create		Create a new peer.
+ *
+ * return: pointer to peer, or NULL on error
+ */
+static struct peer *peer_create(void) {
+	struct peer *peer = malloc(sizeof(struct peer));
+	if(peer == NULL)
+		return NULL;
+	peer->packet = ccpacket_create();
+	if(peer->packet == NULL) {
+		free(peer);
+		return NULL;
+	}
+	peer->addr_len = 0;
+	return peer;
+}
+
+/*
+ * peer_find		Find the peer for a socket address, and move it to the
+ *			head of the list.  A new peer is added if needed,
+ *			replacing the least recent one when the list is full.
+ *
+ * head: pointer to head of peer list
+ * addr: socket address of peer
+ * addr_len: length of socket address
+ * proto: initial state for the packet of a new peer
+ * return: pointer to peer, or NULL on error
+ */
+struct peer *peer_find(struct peer **head, const struct sockaddr *addr,
+	socklen_t addr_len, struct ccpacket *proto)
+{
+	struct peer **pp = head;
+	struct peer *peer;
+	unsigned int n_peers = 0;
+
+	if(addr_len > sizeof(struct sockaddr_storage))
+		addr_len = sizeof(struct sockaddr_storage);
+	for(peer = *head; peer; peer = peer->next) {
+		n_peers++;
+		if(peer_matches(peer, addr, addr_len) || (peer->next == NULL &&
+		   n_peers >= PEER_MAX))
+			break;
+		pp = &peer->next;
+	}
+	if(peer == NULL) {
+		peer = peer_create();
+		if(peer == NULL)
+			return NULL;
+	} else
+		*pp = peer->next;
+	if(!peer_matches(peer, addr, addr_len)) {
+		memcpy(&peer->addr, addr, addr_len);
+		peer->addr_len = addr_len;
+		ccpacket_copy(peer->packet, proto);
+		peer->n_dgrams = 0;
+		peer->n_packets = 0;
+	}
+	peer->next = *head;
+	*head = peer;
+	return peer;
+}
+
+/*
+ * peer_clear		Destroy all peers in a list.
+ *
+ * head: pointer to head of peer list
+ */
+void peer_clear(struct peer **head) {
+	struct peer *peer = *head;
+	while(peer) {
+		struct peer *next = peer->next;
+		ccpacket_destroy(peer->packet);
+		free(peer);
+		peer = next;
+	}
+	*head = NULL;
+}
+
+/*
+ * peer_log_rates	Log packet and datagram rates for all peers heard from
+ *			during an interval, and start a new interval.
+ *
+ * head: head of peer list
+ * log: message logger
+ * name: channel name
+ * service: channel service
+ * elapsed: length of interval (ms)
+ */
+void peer_log_rates(struct peer *head, struct log *log, const char *name,
+	const char *service, long elapsed)
+{
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	struct peer *peer;
+
+	for(peer = head; peer; peer = peer->next) {
+		if(peer->n_dgrams == 0)
+			continue;
+		if(getnameinfo((struct sockaddr *)&peer->addr, peer->addr_len,
+		   host, sizeof(host), serv, sizeof(serv),
+		   NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		{
+			strcpy(host, "?");
+			strcpy(serv, "?");
+		}
+		log_println(log, "peer: %s:%s from %s:%s  packets: %.1f/s  "
+			"datagrams: %.1f/s", name, service, host, serv,
+			peer->n_packets * 1000.0 / elapsed,
+			peer->n_dgrams * 1000.0 / elapsed);
+		peer->n_dgrams = 0;
+		peer->n_packets = 0;
+	}
+}
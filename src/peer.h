@@ -0,0 +1,31 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <sys/socket.h>		/* for struct sockaddr, socklen_t */
+#include "ccpacket.h"		/* for struct ccpacket */
+#include "log.h"		/* for struct log */
+
+#define PEER_MAX (16)		/* maximum peers tracked for one channel */
+
+/*
+ * A peer is one host sending datagrams to a UDP listen channel.  Each peer
+ * has its own packet for decoding, so commands from different senders are
+ * never mixed together.  Peers are kept in most-recently-heard order; when
+ * there are too many, the least recent one is reused.
+ */
+struct peer {
+	struct sockaddr_storage	addr;		/* peer socket address */
+	socklen_t		addr_len;	/* length of peer address */
+	struct ccpacket		*packet;	/* packet being decoded */
+	unsigned int		n_dgrams;	/* datagrams in rate interval */
+	unsigned int		n_packets;	/* packets in rate interval */
+	struct peer		*next;		/* next peer in list */
+};
+
+struct peer *peer_find(struct peer **head, const struct sockaddr *addr,
+	socklen_t addr_len, struct ccpacket *proto);
+void peer_clear(struct peer **head);
+void peer_log_rates(struct peer *head, struct log *log, const char *name,
+	const char *service, long elapsed);
+
+#endif
@@ -276,6 +276,7 @@ static void pelco_discard_garbage(struct ccreader *rdr, struct buffer *rxbuf,
 		n_bytes++;
 	}
 	buffer_consume(rxbuf, n_bytes);
+	ccreader_decode_error(rdr);
 	pelco_log_discard(rdr, mess, n_bytes, msg);
 }
 
@@ -302,6 +303,7 @@ static inline enum decode_t pelco_decode_message(struct ccreader *rdr,
 		return DECODE_MORE;
 	}
 	buffer_consume(rxbuf, PELCO_D_SZ);
+	ccreader_set_frame(rdr, mess, PELCO_D_SZ);
 	if(bit_is_set(mess, BIT_EXTENDED))
 		return pelco_decode_extended(rdr, mess);
 	else
@@ -295,6 +295,7 @@ static void pelco_discard_garbage(struct ccreader *rdr, struct buffer *rxbuf,
 		n_bytes++;
 	}
 	buffer_consume(rxbuf, n_bytes);
+	ccreader_decode_error(rdr);
 	pelco_log_discard(rdr, mess, n_bytes, msg);
 }
 
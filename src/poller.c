@@ -12,48 +12,301 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <fcntl.h>	/* for open */
+#include <poll.h>	/* for POLLIN, POLLHUP, POLLERR */
+#include <signal.h>	/* for sigset_t, SIGUSR1 */
+#include <stddef.h>	/* for offsetof */
+#include <stdint.h>	/* for uint64_t, uintptr_t */
+#include <stdlib.h>	/* for rand_r */
 #include <string.h>	/* for memset, strerror */
 #include <sys/errno.h>	/* for errno */
 #include <sys/inotify.h> /* for inotify_init, inotify_add_watch */
+#include <sys/signalfd.h> /* for signalfd, struct signalfd_siginfo */
 #include <unistd.h>	/* for close */
 #include "config.h"	/* for config_verify */
 #include "poller.h"	/* for struct poller, prototypes */
+#include "shard.h"	/* for shard_drain, shard_get_fd */
+#include "stats.h"	/* for ptz_stats_retry, ptz_stats_report */
+#include "timeval.h"	/* for timeval_set_now, timeval_refresh */
+
+/* Delay before the first backed off retry to open a channel (ms) */
+#define RETRY_MIN (500)
+
+/* Maximum delay before retrying to open a channel (ms) */
+#define RETRY_MAX (30 * 1000)
+
+/* Events for the poller's own file descriptors and timers */
+#define OWN_EVENTS (OWN_TOKENS - 1)
+
+/* Number of io_uring submission queue entries */
+#define RING_ENTRIES (256)
+
+/* Number and size of provided buffers for reads.  Like the initial receive
+ * buffer of a channel, a buffer holds the input for one pass. */
+#define RING_BUFS (256)
+#define RING_BUF_SZ (256)
+
+/*
+ * Each io_uring operation carries a pointer to its channel (or the token of
+ * one of the poller's own objects, shifted past the operation), with the
+ * operation type in the low bits.  For channel operations, the high bits hold
+ * the ring generation of the channel when it was submitted, which is bumped
+ * whenever the channel is closed.  Completions from an older generation are
+ * stale, so their data is dropped.
+ */
+enum ring_op_t {
+	OP_POLL,		/* multishot poll of poller's own fd */
+	OP_TIMEOUT,		/* timeout for a detached timer */
+	OP_READ,		/* read into a provided buffer */
+	OP_INPUT,		/* poll for channel_read */
+	OP_WRITE,		/* write or send of staged bytes */
+	OP_IGNORE,		/* completion can be ignored */
+};
+#define RING_OP_BITS (3)
+#define RING_OP_MASK ((1 << RING_OP_BITS) - 1)
+#define RING_GEN_SHIFT (48)
+#define RING_PTR_MASK ((1ULL << RING_GEN_SHIFT) - 1 - RING_OP_MASK)
+
+/* Channels are cache line aligned, leaving the low bits for the op */
+_Static_assert(_Alignof(struct channel) > RING_OP_MASK,
+	"struct channel alignment too small to tag ring operations");
+
+/* States of the ring read for a channel */
+enum ring_rd_t {
+	RING_IDLE,		/* no read posted */
+	RING_POSTED,		/* read (or poll) posted */
+	RING_CANCEL,		/* read is being cancelled */
+};
+
+/*
+ * ring_data		Make the user data for an io_uring channel operation.
+ *
+ * chn: channel of operation (or NULL)
+ * op: operation type
+ * gen: ring generation of channel (or 0)
+ */
+static inline uint64_t ring_data(struct channel *chn, enum ring_op_t op,
+	unsigned int gen)
+{
+	return (uintptr_t)chn | op | ((uint64_t)(gen & 0xffff) <<
+		RING_GEN_SHIFT);
+}
+
+/*
+ * ring_own_data	Make the user data for an io_uring operation on one of
+ *			the poller's own objects.
+ *
+ * own: token of object
+ * op: operation type
+ */
+static inline uint64_t ring_own_data(enum own_t own, enum ring_op_t op) {
+	return ((uint64_t)own << RING_OP_BITS) | op;
+}
+
+/*
+ * poller_ring_poll_fd	Post a multishot poll for input on a file descriptor.
+ *
+ * fd: file descriptor to poll
+ * own: token returned with events for the file descriptor
+ * return: 0 on success; -1 on error
+ */
+static int poller_ring_poll_fd(struct poller *plr, int fd, enum own_t own) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&plr->ring);
+
+	if(sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = ring_own_data(own, OP_POLL);
+	return 0;
+}
+
+/*
+ * poller_add_fd	Add a file descriptor to poll for input.
+ *
+ * fd: file descriptor to add
+ * own: token returned with events for the file descriptor
+ * return: 0 on success; -1 on error
+ */
+static int poller_add_fd(struct poller *plr, int fd, enum own_t own) {
+	struct epoll_event ev;
+
+	if(plr->use_ring)
+		return poller_ring_poll_fd(plr, fd, own);
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.u64 = own;
+	return epoll_ctl(plr->fd_epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * poller_add_timer	Add a timer to poll for expirations.  With io_uring,
+ *			the timer is detached from its timerfd, and a timeout
+ *			operation is used instead.
+ *
+ * tmr: timer to add
+ * own: token returned with expirations of the timer
+ * return: 0 on success; -1 on error
+ */
+static int poller_add_timer(struct poller *plr, struct timer *tmr,
+	enum own_t own)
+{
+	unsigned int i;
+
+	if(!plr->use_ring)
+		return poller_add_fd(plr, timer_get_fd(tmr), own);
+	for(i = 0; i < 2; i++) {
+		struct poller_timeout *tmo = plr->timeouts + i;
+		if(tmo->timer == NULL) {
+			tmo->timer = tmr;
+			tmo->own = own;
+			timer_detach(tmr);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * poller_init_backend	Initialize the epoll or io_uring backend.
+ *
+ * ring: true to use io_uring
+ * return: 0 on success; -1 on error
+ */
+static int poller_init_backend(struct poller *plr, bool ring) {
+	if(ring) {
+		if(uring_init(&plr->ring, RING_ENTRIES) == NULL)
+			return -1;
+		if(uring_init_bufs(&plr->ring, RING_BUFS, RING_BUF_SZ) < 0) {
+			uring_destroy(&plr->ring);
+			return -1;
+		}
+		plr->use_ring = true;
+		return 0;
+	}
+	plr->events = malloc(sizeof(struct epoll_event) *
+		(plr->n_channels + OWN_EVENTS));
+	if(plr->events == NULL)
+		return -1;
+	plr->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if(plr->fd_epoll < 0) {
+		free(plr->events);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * poller_destroy_backend	Destroy the epoll or io_uring backend.
+ */
+static void poller_destroy_backend(struct poller *plr) {
+	if(plr->use_ring)
+		uring_destroy(&plr->ring);
+	else {
+		close(plr->fd_epoll);
+		free(plr->events);
+	}
+}
+
+/*
+ * poller_signal_fd	Create a file descriptor to read SIGUSR1.  The signal
+ *			is blocked in all threads, so it is only read here.
+ *
+ * return: file descriptor; -1 on error
+ */
+static int poller_signal_fd(void) {
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
 
 /*
  * poller_init		Initialize a new I/O channel poller.
  *
  * n_channels: number of channels to poll
  * chns: linked list of channels (poller takes ownership of memory)
+ * dfr: deferred packet handler
+ * sh: shard running the poller (only shard 0 watches the config file and
+ *     reads signals)
  * return: pointer to struct poller or NULL on error
  */
 struct poller *poller_init(struct poller *plr, int n_channels,
-	struct channel *chns, struct defer *dfr)
+	struct channel *chns, struct defer *dfr, struct shard *sh)
 {
+	struct channel *chn;
+	struct timeval now;
+
 	memset(plr, 0, sizeof(struct poller));
 	plr->n_channels = n_channels;
 	plr->chns = chns;
 	plr->defer = dfr;
-	plr->pollfds = malloc(sizeof(struct pollfd) * (n_channels + 2));
-	if(plr->pollfds == NULL)
+	plr->shard = sh;
+	plr->fd_inotify = -1;
+	plr->fd_signal = -1;
+	timeval_set_now(&now);
+	wheel_init(&plr->retry, &now);
+	wheel_init(&plr->pace, &now);
+	plr->seed = now.tv_usec ^ getpid();
+	if(poller_init_backend(plr, sh->all->uring) < 0)
 		return NULL;
-	/* open an fd to poll for closed channels */
-	plr->fd_null = open("/dev/null", O_RDONLY);
-	if(plr->fd_null < 0)
-		goto out;
+	if(poller_add_timer(plr, &dfr->timer, OWN_DEFER) < 0)
+		goto out1;
+	if(timer_init(&plr->timer) == NULL)
+		goto out1;
+	if(poller_add_timer(plr, &plr->timer, OWN_TIMER) < 0)
+		goto out_t;
+	if(ptz_stats_enabled()) {
+		plr->stats_start = now;
+		plr->stats_due = now;
+		timeval_adjust(&plr->stats_due, STATS_INTERVAL);
+		timer_arm(&plr->timer, &plr->stats_due);
+	}
+	if(resolver_init(&plr->resolver) == NULL)
+		goto out_t;
+	if(poller_add_fd(plr, resolver_get_fd(&plr->resolver), OWN_RESOLVER)<0)
+		goto out_r;
+	if(poller_add_fd(plr, shard_get_fd(sh), OWN_SHARD) < 0)
+		goto out_r;
+	if(sh->id)
+		goto done;
 	/* initialize inotify fd */
 	plr->fd_inotify = inotify_init();
 	if(plr->fd_inotify < 0)
-		goto out1;
+		goto out_r;
 	plr->wd_inotify = inotify_add_watch(plr->fd_inotify, config_file(),
 		IN_CLOSE_WRITE | IN_MOVE_SELF);
-	if(plr->wd_inotify >= 0)
-		return plr;
+	if(plr->wd_inotify < 0)
+		goto out2;
+	if(poller_add_fd(plr, plr->fd_inotify, OWN_CONFIG) < 0)
+		goto out3;
+	plr->fd_signal = poller_signal_fd();
+	if(plr->fd_signal < 0)
+		goto out3;
+	if(poller_add_fd(plr, plr->fd_signal, OWN_SIGNAL) < 0)
+		goto out4;
+done:
+	/* every channel needs its events registered on the first pass */
+	for(chn = chns; chn; chn = chn->next) {
+		chn->dirty_head = &plr->dirty;
+		chn->resolver = &plr->resolver;
+		channel_touch(chn);
+	}
+	return plr;
+out4:
+	close(plr->fd_signal);
+out3:
+	inotify_rm_watch(plr->fd_inotify, plr->wd_inotify);
+out2:
 	close(plr->fd_inotify);
+out_r:
+	resolver_destroy(&plr->resolver);
+out_t:
+	timer_destroy(&plr->timer);
 out1:
-	close(plr->fd_null);
-out:
-	free(plr->pollfds);
+	poller_destroy_backend(plr);
 	return NULL;
 }
 
@@ -62,78 +315,480 @@ out:
  */
 void poller_destroy(struct poller *plr) {
 	struct channel *chn = plr->chns;
+	/* ring operations in flight may use channel buffers */
+	poller_destroy_backend(plr);
 	while(chn) {
 		struct channel *nchn = chn->next;
 		channel_destroy(chn);
 		free(chn);
 		chn = nchn;
 	}
-	inotify_rm_watch(plr->fd_inotify, plr->wd_inotify);
-	close(plr->fd_inotify);
-	close(plr->fd_null);
-	free(plr->pollfds);
+	resolver_destroy(&plr->resolver);
+	timer_destroy(&plr->timer);
+	if(plr->fd_inotify >= 0) {
+		inotify_rm_watch(plr->fd_inotify, plr->wd_inotify);
+		close(plr->fd_inotify);
+	}
+	if(plr->fd_signal >= 0)
+		close(plr->fd_signal);
 	memset(plr, 0, sizeof(struct poller));
 }
 
 /*
- * poller_register_channel	Register events to poll for one channel.
+ * poller_unregister_channel	Remove a channel from the epoll interest list.
  *
- * chn: channel to register events for
- * pfd: poll fd structure
+ * chn: channel to unregister
  */
-static inline void poller_register_channel(struct poller *plr,
-	struct channel *chn, struct pollfd *pfd)
+static void poller_unregister_channel(struct poller *plr, struct channel *chn)
 {
-	if(!channel_is_open(chn)) {
-		if(channel_is_waiting(chn))
-			channel_open(chn);
-	}
-	if(channel_is_open(chn)) {
-		pfd->fd = chn->fd;
-		pfd->events = POLLHUP | POLLERR;
-		if(channel_needs_reading(chn))
-			pfd->events |= POLLIN;
-		if(channel_needs_writing(chn))
-			pfd->events |= POLLOUT;
+	if(chn->pfd >= 0) {
+		epoll_ctl(plr->fd_epoll, EPOLL_CTL_DEL, chn->pfd, NULL);
+		chn->pfd = -1;
+		chn->events = 0;
+	}
+}
+
+/*
+ * channel_of_retry	Get the channel containing a retry wheel node.
+ */
+static inline struct channel *channel_of_retry(struct wheel_node *node) {
+	return (struct channel *)((char *)node -
+		offsetof(struct channel, retry));
+}
+
+/*
+ * channel_of_pace	Get the channel containing a pace wheel node.
+ */
+static inline struct channel *channel_of_pace(struct wheel_node *node) {
+	return (struct channel *)((char *)node -
+		offsetof(struct channel, pace));
+}
+
+/*
+ * poller_rearm		Rearm the timer for the next channel retry or pace, or
+ *			stats report.
+ */
+static int poller_rearm(struct poller *plr) {
+	struct wheel_node *node = wheel_peek(&plr->retry);
+	struct wheel_node *pnode = wheel_peek(&plr->pace);
+	const struct timeval *tv = NULL;
+	if(pnode && (node == NULL || time_elapsed_us(&pnode->tv, &node->tv)>0))
+		node = pnode;
+	if(node)
+		tv = &node->tv;
+	if(timerisset(&plr->stats_due) &&
+	   (tv == NULL || time_elapsed_us(&plr->stats_due, tv) > 0))
+		tv = &plr->stats_due;
+	if(tv)
+		return timer_arm(&plr->timer, tv);
+	else
+		return timer_disarm(&plr->timer);
+}
+
+/*
+ * poller_retry_delay	Get the delay before retrying to open a channel.
+ *			The first retry is immediate; after that the delay
+ *			doubles each time, with random jitter so that many
+ *			channels do not retry in lock step.
+ *
+ * chn: channel to retry
+ * return: delay (ms)
+ */
+static unsigned int poller_retry_delay(struct poller *plr,
+	const struct channel *chn)
+{
+	unsigned int ms = RETRY_MAX;
+	if(chn->n_retry == 0)
+		return 0;
+	if(chn->n_retry < 16 && (RETRY_MIN << (chn->n_retry - 1)) < RETRY_MAX)
+		ms = RETRY_MIN << (chn->n_retry - 1);
+	return ms / 2 + rand_r(&plr->seed) % (ms / 2 + 1);
+}
+
+/*
+ * poller_park_channel	Park a closed channel until its retry deadline.
+ *			Parked channels are not registered with epoll.
+ *
+ * chn: channel which failed to open (or was closed)
+ */
+static void poller_park_channel(struct poller *plr, struct channel *chn) {
+	unsigned int ms = poller_retry_delay(plr, chn);
+	struct timeval *tv = &chn->retry.tv;
+
+	chn->n_retry++;
+	ptz_stats_retry(ms);
+	if(ms == 0) {
+		/* the dirty list is polled without waiting, so the channel
+		 * is reopened on the next pass */
+		channel_touch(chn);
+		return;
+	}
+	if(chn->log->debug) {
+		log_println(chn->log, "debug: retry in %u ms %s:%s", ms,
+			chn->name, chn->service);
+	}
+	wheel_remove(&plr->retry, &chn->retry);
+	timeval_set_now(tv);
+	wheel_catch_up(&plr->retry, tv);
+	timeval_adjust(tv, ms);
+	wheel_add(&plr->retry, &chn->retry);
+	poller_rearm(plr);
+}
+
+/*
+ * poller_pace_channel	Schedule a paced channel to be written when its
+ *			transmitter is ready for more bytes.
+ *
+ * chn: channel to pace
+ */
+static void poller_pace_channel(struct poller *plr, struct channel *chn) {
+	struct timeval now;
+
+	wheel_remove(&plr->pace, &chn->pace);
+	if(buffer_is_empty(&chn->txbuf) || !channel_is_paced(chn))
+		return;
+	timeval_set_now(&now);
+	wheel_catch_up(&plr->pace, &now);
+	channel_wire_ready(chn, &chn->pace.tv);
+	wheel_add(&plr->pace, &chn->pace);
+	poller_rearm(plr);
+}
+
+/*
+ * poller_do_stats	Report the counters of all channels and writers on the
+ *			shard, and start a new interval.  The counters are
+ *			only read, and lines are logged by the log writer
+ *			thread, so forwarding is never blocked.
+ *
+ * now: current time
+ */
+static void poller_do_stats(struct poller *plr, const struct timeval *now) {
+	long ms = time_elapsed(&plr->stats_start, now);
+	struct channel *chn;
+
+	for(chn = plr->chns; chn; chn = chn->next) {
+		ptz_stats_report(&chn->stats, chn->name, chn->service, ms);
+		channel_log_stats(chn, now, ms);
+	}
+	shard_log_stats(plr->shard, ms);
+	plr->stats_start = *now;
+	plr->stats_due = *now;
+	timeval_adjust(&plr->stats_due, STATS_INTERVAL);
+}
+
+/*
+ * poller_do_timers	Wake up all parked channels whose retry deadline has
+ *			passed, and paced channels which are ready for writing.
+ *			Report stats when the interval is over.
+ */
+static void poller_do_timers(struct poller *plr) {
+	struct wheel_node *node;
+	struct timeval now;
+
+	/* The timer may have been rearmed since it was polled */
+	timer_read(&plr->timer);
+	timeval_set_now(&now);
+	while((node = wheel_expire(&plr->retry, &now)))
+		channel_touch(channel_of_retry(node));
+	while((node = wheel_expire(&plr->pace, &now)))
+		channel_touch(channel_of_pace(node));
+	if(timerisset(&plr->stats_due) &&
+	   time_elapsed_us(&plr->stats_due, &now) >= 0)
+		poller_do_stats(plr, &now);
+	poller_rearm(plr);
+}
+
+/*
+ * poller_close_channel		Close a channel which is registered with the
+ *				poller.  The fd must be unregistered before it
+ *				is closed, since the number could be reused.
+ *				A channel closed after finishing its requests
+ *				is not parked, since that is not a failure.
+ *
+ * chn: channel to close
+ */
+static void poller_close_channel(struct poller *plr, struct channel *chn) {
+	bool done = channel_is_done(chn);
+
+	if(plr->use_ring && channel_is_open(chn)) {
+		uring_cancel_fd(&plr->ring, chn->fd);
+		chn->ring_gen++;
+	}
+	poller_unregister_channel(plr, chn);
+	wheel_remove(&plr->pace, &chn->pace);
+	channel_close(chn);
+	if(channel_is_client(chn))
+		channel_touch(chn);	/* destroyed on next pass */
+	else if(done)
+		channel_touch(chn);	/* reopened for the next request */
+	else
+		poller_park_channel(plr, chn);
+}
+
+/*
+ * poller_open_channel		Open a channel which is waiting, unless it is
+ *				parked.  If the open fails, the channel is
+ *				parked until its retry deadline.  A pending host
+ *				name lookup does not count as a failure.
+ *
+ * chn: channel to open
+ */
+static void poller_open_channel(struct poller *plr, struct channel *chn) {
+	if(channel_is_parked(chn) || !channel_is_waiting(chn))
+		return;
+	if(channel_open(chn) < 0 && !chn->lookup) {
+		chn_stats_add(&chn->stats, STAT_RECONNECTS, 1);
+		poller_park_channel(plr, chn);
+	}
+}
+
+/*
+ * poller_channel_events	Get the events to poll for one channel.
+ *
+ * chn: channel to get events for
+ * return: epoll event mask
+ */
+static uint32_t poller_channel_events(const struct channel *chn) {
+	uint32_t events = EPOLLHUP | EPOLLERR;
+	if(channel_needs_reading(chn))
+		events |= EPOLLIN;
+	if(channel_needs_writing(chn))
+		events |= EPOLLOUT;
+	return events;
+}
+
+/*
+ * poller_ring_idle	Test if a channel has no ring operations in flight.
+ */
+static inline bool poller_ring_idle(const struct channel *chn) {
+	return chn->ring_rd == RING_IDLE && chn->ring_wr == 0;
+}
+
+/*
+ * poller_ring_read_op	Get the ring operation for reading a channel.
+ */
+static inline enum ring_op_t poller_ring_read_op(const struct channel *chn) {
+	return channel_reads_buffer(chn) ? OP_READ : OP_INPUT;
+}
+
+/*
+ * poller_ring_read	Post a read on a channel.  Input is read into a
+ *			provided buffer, except on channels which need
+ *			channel_read (listen and UDP peer channels), which get
+ *			a poll instead.  A read is posted again only after its
+ *			completion is processed, so (like level-triggered
+ *			epoll) input which is not yet handled stays in the
+ *			socket, instead of filling the completion queue ahead
+ *			of writes.
+ *
+ * chn: channel to read
+ */
+static void poller_ring_read(struct poller *plr, struct channel *chn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&plr->ring);
+	enum ring_op_t op = poller_ring_read_op(chn);
+
+	if(sqe == NULL) {
+		log_println(chn->log, "poller: %s %s:%s", strerror(errno),
+			chn->name, chn->service);
+		poller_close_channel(plr, chn);
+		return;
+	}
+	sqe->fd = chn->fd;
+	if(op == OP_READ) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->off = -1;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
 	} else {
-		pfd->fd = plr->fd_null;
-		pfd->events = 0;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
 	}
+	sqe->user_data = ring_data(chn, op, chn->ring_gen);
+	chn->ring_rd = RING_POSTED;
 }
 
-static struct pollfd *poller_deferred_pollfd(const struct poller *plr) {
-	return plr->pollfds + plr->n_channels;
+/*
+ * poller_ring_cancel	Cancel the read (or poll) on a channel which no
+ *			longer needs reading.
+ *
+ * chn: channel to stop reading
+ */
+static void poller_ring_cancel(struct poller *plr, struct channel *chn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&plr->ring);
+
+	if(sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ring_data(chn, poller_ring_read_op(chn), chn->ring_gen);
+	sqe->user_data = ring_data(NULL, OP_IGNORE, 0);
+	chn->ring_rd = RING_CANCEL;
 }
 
-static void poller_register_deferred(struct poller *plr) {
-	struct pollfd *pfd = poller_deferred_pollfd(plr);
+/*
+ * poller_ring_write_stage	Write the rest of the staged bytes of a
+ *				stream channel.  The whole stage goes in one
+ *				write, and the next one is not submitted until
+ *				it completes, so there is nothing to link.
+ *
+ * chn: channel to write
+ * return: 0 on success; -1 on error
+ */
+static int poller_ring_write_stage(struct poller *plr, struct channel *chn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&plr->ring);
 
-	pfd->fd = defer_get_fd(plr->defer);
-	pfd->events = POLLIN;
+	if(sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = chn->fd;
+	sqe->off = -1;
+	sqe->addr = (uintptr_t)(chn->stage + chn->stage_off);
+	sqe->len = chn->stage_len - chn->stage_off;
+	sqe->user_data = ring_data(chn, OP_WRITE, chn->ring_gen);
+	chn->ring_wr++;
+	return 0;
 }
 
-static struct pollfd *poller_inotify_pollfd(const struct poller *plr) {
-	return plr->pollfds + plr->n_channels + 1;
+/*
+ * poller_ring_send_stage	Send the staged datagrams of a UDP channel, as
+ *				a chain of linked sends, so they stay in order.
+ *
+ * chn: channel to write
+ * lens: length of each datagram
+ * n_msgs: number of datagrams
+ * return: 0 on success; -1 on error
+ */
+static int poller_ring_send_stage(struct poller *plr, struct channel *chn,
+	const size_t *lens, int n_msgs)
+{
+	size_t pos = 0;
+	int i;
+
+	if(uring_reserve(&plr->ring, n_msgs) < 0)
+		return -1;
+	for(i = 0; i < n_msgs; i++) {
+		struct io_uring_sqe *sqe = uring_get_sqe(&plr->ring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = chn->fd;
+		sqe->addr = (uintptr_t)(chn->stage + pos);
+		sqe->len = lens[i];
+		if(i < n_msgs - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = ring_data(chn, OP_WRITE, chn->ring_gen);
+		chn->ring_wr++;
+		pos += lens[i];
+	}
+	return 0;
 }
 
-static void poller_register_inotify(struct poller *plr) {
-	struct pollfd *pfd = poller_inotify_pollfd(plr);
+/*
+ * poller_ring_write	Stage buffered data on a channel, and submit writes.
+ *
+ * chn: channel to write
+ */
+static void poller_ring_write(struct poller *plr, struct channel *chn) {
+	size_t lens[BUFFER_MSG_MAX];
+	int n_msgs = channel_stage(chn, lens);
+	int r;
 
-	pfd->fd = plr->fd_inotify;
-	pfd->events = POLLIN;
+	if(n_msgs < 0)
+		r = -1;
+	else if(chn->flags & FLAG_UDP)
+		r = poller_ring_send_stage(plr, chn, lens, n_msgs);
+	else
+		r = poller_ring_write_stage(plr, chn);
+	if(r < 0) {
+		log_println(chn->log, "poller: %s %s:%s", strerror(errno),
+			chn->name, chn->service);
+		poller_close_channel(plr, chn);
+	}
+}
+
+/*
+ * poller_ring_register		Post ring operations for an open channel.
+ *				There is at most one read (or poll) and one
+ *				write (or chain of sends) in flight at a time.
+ *
+ * chn: channel to post operations for
+ */
+static void poller_ring_register(struct poller *plr, struct channel *chn) {
+	if(channel_needs_reading(chn)) {
+		if(chn->ring_rd == RING_IDLE)
+			poller_ring_read(plr, chn);
+	} else if(chn->ring_rd == RING_POSTED)
+		poller_ring_cancel(plr, chn);
+	if(channel_is_open(chn) && chn->ring_wr == 0 &&
+	   channel_needs_writing(chn))
+		poller_ring_write(plr, chn);
 }
 
 /*
- * poller_register_events	Register events for all channels to poll.
+ * poller_register_channel	Update registered events for one channel.
+ *
+ * chn: channel to register events for
+ */
+static void poller_register_channel(struct poller *plr, struct channel *chn) {
+	uint32_t events;
+	struct epoll_event ev;
+
+	if(channel_is_client(chn) && !channel_is_open(chn)) {
+		/* completions of ring operations will touch it again */
+		if(!poller_ring_idle(chn))
+			return;
+		/* client disconnected; it is not on any list but its
+		 * listen channel's, so this is the last reference */
+		channel_destroy_client(chn);
+		return;
+	}
+	if(!channel_is_open(chn))
+		poller_open_channel(plr, chn);
+	if(!channel_is_open(chn)) {
+		/* the retry timer or resolver will touch it again */
+		poller_unregister_channel(plr, chn);
+		return;
+	}
+	if(chn->byte_ns)
+		poller_pace_channel(plr, chn);
+	if(plr->use_ring) {
+		poller_ring_register(plr, chn);
+		return;
+	}
+	if(chn->pfd != chn->fd) {
+		/* channel was reopened since it was registered */
+		poller_unregister_channel(plr, chn);
+	}
+	events = poller_channel_events(chn);
+	if(chn->pfd >= 0 && events == chn->events)
+		return;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = events;
+	ev.data.ptr = chn;
+	if(epoll_ctl(plr->fd_epoll, chn->pfd >= 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		chn->fd, &ev) < 0)
+	{
+		log_println(chn->log, "poller: %s %s:%s", strerror(errno),
+			chn->name, chn->service);
+		poller_close_channel(plr, chn);
+		return;
+	}
+	chn->pfd = chn->fd;
+	chn->events = events;
+}
+
+/*
+ * poller_register_events	Register events for all channels which have
+ *				changed since the previous pass.
  */
 static void poller_register_events(struct poller *plr) {
-	int i;
-	struct channel *chn = plr->chns;
+	struct channel *chn = plr->dirty;
 
-	for(i = 0; i < plr->n_channels; i++, chn = chn->next)
-		poller_register_channel(plr, chn, plr->pollfds + i);
-	poller_register_deferred(plr);
-	poller_register_inotify(plr);
+	plr->dirty = NULL;
+	while(chn) {
+		struct channel *nchn = chn->dirty;
+		chn->dirty = NULL;
+		chn->flags &= ~FLAG_DIRTY;
+		poller_register_channel(plr, chn);
+		chn = nchn;
+	}
 }
 
 static void debug_log(struct channel *chn, const char *msg) {
@@ -143,69 +798,405 @@ static void debug_log(struct channel *chn, const char *msg) {
 /*
  * debug_poll_events		Debug the channel poll events.
  *
- * pfd: pollfd struct
+ * events: epoll event mask
  */
-static void debug_poll_events(struct channel *chn, const struct pollfd *pfd) {
-	if(pfd->revents & POLLHUP)
+static void debug_poll_events(struct channel *chn, uint32_t events) {
+	if(events & EPOLLHUP)
 		debug_log(chn, "POLLHUP");
-	if(pfd->revents & POLLERR)
+	if(events & EPOLLERR)
 		debug_log(chn, "POLLERR");
-	if(pfd->revents & POLLIN)
+	if(events & EPOLLIN)
 		debug_log(chn, "POLLIN");
-	if(pfd->revents & POLLOUT)
+	if(events & EPOLLOUT)
 		debug_log(chn, "POLLOUT");
 }
 
 /*
- * poller_channel_events	Process polled events for one channel.
+ * poller_do_channel	Process polled events for one channel.
  *
  * chn: channel to process
- * pfd: poll fd structure
+ * events: epoll event mask
  */
-static inline void poller_channel_events(struct poller *plr,
-	struct channel *chn, struct pollfd *pfd)
+static inline void poller_do_channel(struct poller *plr, struct channel *chn,
+	uint32_t events)
 {
 	if(chn->log->debug)
-		debug_poll_events(chn, pfd);
-	if(pfd->revents & (POLLHUP | POLLERR)) {
-		channel_close(chn);
+		debug_poll_events(chn, events);
+	/* any event may change what the channel is waiting for */
+	channel_touch(chn);
+	if(events & (EPOLLHUP | EPOLLERR)) {
+		poller_close_channel(plr, chn);
 		return;
 	}
-	if(pfd->revents & POLLOUT) {
+	if(events & EPOLLOUT) {
 		ssize_t n_bytes = channel_write(chn);
 		if(n_bytes < 0) {
-			channel_close(chn);
+			poller_close_channel(plr, chn);
 			return;
 		}
 	}
-	if(pfd->revents & POLLIN) {
+	if(events & EPOLLIN) {
 		ssize_t n_bytes = channel_read(chn);
 		if(n_bytes <= 0) {
-			channel_close(chn);
+			poller_close_channel(plr, chn);
 			return;
 		}
 	}
 }
 
-static void poller_defer_events(struct poller *plr) {
-	struct pollfd *pfd = poller_deferred_pollfd(plr);
+/*
+ * poller_do_lookups	Process all completed host name lookups.
+ */
+static void poller_do_lookups(struct poller *plr) {
+	struct lookup *lk;
 
-	if(pfd->revents & POLLIN)
-		defer_next(plr->defer);
+	while((lk = resolver_next(&plr->resolver))) {
+		if(lk->data)
+			channel_resolved(lk->data, lk);
+		lookup_destroy(lk);
+	}
 }
 
 static int poller_check_config(struct poller *plr) {
-	struct pollfd *pfd = poller_inotify_pollfd(plr);
 	struct inotify_event evt;
 	int n_bytes;
 
-	if(pfd->revents & POLLIN) {
-		n_bytes = read(plr->fd_inotify, &evt,
-			sizeof(struct inotify_event));
-		if(n_bytes <= 0)
-			return errno;
-		if(config_verify(config_file()) == 0)
-			return -1;
+	n_bytes = read(plr->fd_inotify, &evt, sizeof(struct inotify_event));
+	if(n_bytes <= 0)
+		return errno;
+	if(config_verify(config_file()) == 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * poller_do_signal	Handle signals read from the signal fd.  SIGUSR1 makes
+ *			all shards log their route latency.
+ */
+static void poller_do_signal(struct poller *plr) {
+	struct signalfd_siginfo si;
+
+	while(read(plr->fd_signal, &si, sizeof(si)) == sizeof(si)) {
+		if(si.ssi_signo == SIGUSR1)
+			shards_report(plr->shard->all);
+	}
+}
+
+/*
+ * poller_do_own	Process an event for one of the poller's own file
+ *			descriptors or timers.
+ *
+ * own: token registered for the event
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ */
+static void poller_do_own(struct poller *plr, enum own_t own, bool *stop,
+	bool *config)
+{
+	switch(own) {
+	case OWN_DEFER:
+		defer_next(plr->defer);
+		break;
+	case OWN_TIMER:
+		poller_do_timers(plr);
+		break;
+	case OWN_RESOLVER:
+		poller_do_lookups(plr);
+		break;
+	case OWN_SHARD:
+		*stop |= (shard_drain(plr->shard) < 0);
+		break;
+	case OWN_CONFIG:
+		*config = true;
+		break;
+	case OWN_SIGNAL:
+		poller_do_signal(plr);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * poller_epoll_wait	Wait for epoll events, and process them.
+ *
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ * return: 0 on success, errno value on error
+ */
+static int poller_epoll_wait(struct poller *plr, bool *stop, bool *config) {
+	/* channels touched while registering must not wait for a wakeup */
+	int timeout = plr->dirty ? 0 : -1;
+	int i, n;
+
+	do {
+		n = epoll_wait(plr->fd_epoll, plr->events,
+			plr->n_channels + OWN_EVENTS, timeout);
+	} while(n < 0 && errno == EINTR);
+	if(n < 0)
+		return errno;
+	timeval_refresh();
+	for(i = 0; i < n; i++) {
+		struct epoll_event *ev = plr->events + i;
+		if(ev->data.u64 < OWN_TOKENS)
+			poller_do_own(plr, ev->data.u64, stop, config);
+		else
+			poller_do_channel(plr, ev->data.ptr, ev->events);
+	}
+	return 0;
+}
+
+/*
+ * poller_ring_timeouts		Submit timeouts for timers which have changed.
+ *				A timeout in flight is updated in place; if it
+ *				has already expired, the update fails, but the
+ *				expiration rearms the timer anyway.  Disarmed
+ *				timers are left to expire early, which is
+ *				harmless.
+ */
+static void poller_ring_timeouts(struct poller *plr) {
+	unsigned int i;
+
+	for(i = 0; i < 2; i++) {
+		struct poller_timeout *tmo = plr->timeouts + i;
+		const struct timespec *ts = timer_get_change(tmo->timer);
+		struct io_uring_sqe *sqe;
+
+		if(ts == NULL || (ts->tv_sec == 0 && ts->tv_nsec == 0))
+			continue;
+		sqe = uring_get_sqe(&plr->ring);
+		if(sqe == NULL) {
+			/* try again on the next pass */
+			tmo->timer->changed = true;
+			continue;
+		}
+		tmo->ts.tv_sec = ts->tv_sec;
+		tmo->ts.tv_nsec = ts->tv_nsec;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		if(tmo->pending) {
+			sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+			sqe->addr = ring_own_data(tmo->own, OP_TIMEOUT);
+			sqe->addr2 = (uintptr_t)&tmo->ts;
+			sqe->timeout_flags |= IORING_TIMEOUT_UPDATE;
+			sqe->user_data = ring_data(NULL, OP_IGNORE, 0);
+		} else {
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = (uintptr_t)&tmo->ts;
+			sqe->len = 1;
+			sqe->user_data = ring_own_data(tmo->own, OP_TIMEOUT);
+			tmo->pending = true;
+		}
+	}
+}
+
+/*
+ * poller_ring_expired		Process an expired (or cancelled) timeout.
+ *
+ * own: token of timer
+ * res: result of timeout operation
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ */
+static void poller_ring_expired(struct poller *plr, enum own_t own, int res,
+	bool *stop, bool *config)
+{
+	unsigned int i;
+
+	for(i = 0; i < 2; i++) {
+		if(plr->timeouts[i].own == own)
+			plr->timeouts[i].pending = false;
+	}
+	if(res == -ETIME)
+		poller_do_own(plr, own, stop, config);
+}
+
+/*
+ * poller_own_fd	Get the file descriptor polled for one of the poller's
+ *			own tokens.
+ *
+ * own: token registered for the file descriptor
+ * return: file descriptor, or -1 if unknown
+ */
+static int poller_own_fd(struct poller *plr, enum own_t own) {
+	switch(own) {
+	case OWN_RESOLVER:
+		return resolver_get_fd(&plr->resolver);
+	case OWN_SHARD:
+		return shard_get_fd(plr->shard);
+	case OWN_CONFIG:
+		return plr->fd_inotify;
+	case OWN_SIGNAL:
+		return plr->fd_signal;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * poller_ring_polled	Process a completion of a multishot poll for one of
+ *			the poller's own file descriptors.
+ *
+ * own: token registered for the file descriptor
+ * cqe: completion queue entry
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ */
+static void poller_ring_polled(struct poller *plr, enum own_t own,
+	const struct io_uring_cqe *cqe, bool *stop, bool *config)
+{
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+		poller_ring_poll_fd(plr, poller_own_fd(plr, own), own);
+	if(cqe->res > 0)
+		poller_do_own(plr, own, stop, config);
+}
+
+/*
+ * poller_ring_is_current	Test if a channel operation is from the current
+ *				ring generation of the channel.
+ *
+ * gen: ring generation of operation
+ */
+static inline bool poller_ring_is_current(const struct channel *chn,
+	unsigned int gen)
+{
+	return gen == (chn->ring_gen & 0xffff) && channel_is_open(chn);
+}
+
+/*
+ * poller_ring_input	Process a completion of a read (or poll).
+ *
+ * chn: channel which was read
+ * op: operation (OP_READ or OP_INPUT)
+ * gen: ring generation of operation
+ * cqe: completion queue entry
+ */
+static void poller_ring_input(struct poller *plr, struct channel *chn,
+	enum ring_op_t op, unsigned int gen, const struct io_uring_cqe *cqe)
+{
+	int res = cqe->res;
+	ssize_t n_bytes = 1;
+
+	/* post another read on the next pass; any input may also change
+	 * what the channel is waiting for */
+	chn->ring_rd = RING_IDLE;
+	channel_touch(chn);
+	if(poller_ring_is_current(chn, gen)) {
+		if(res == -ECANCELED || res == -ENOBUFS)
+			n_bytes = 1;
+		else if(res < 0) {
+			log_println(chn->log, "poller: %s %s:%s",
+				strerror(-res), chn->name, chn->service);
+			n_bytes = -1;
+		} else if(op == OP_READ) {
+			n_bytes = res ? channel_input(chn, uring_buf(&plr->ring,
+				cqe->flags >> IORING_CQE_BUFFER_SHIFT), res) : 0;
+		} else if(res & (POLLHUP | POLLERR))
+			n_bytes = -1;
+		else
+			n_bytes = channel_read(chn);
+	}
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		uring_recycle(&plr->ring,
+			cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+	if(n_bytes <= 0)
+		poller_close_channel(plr, chn);
+}
+
+/*
+ * poller_ring_output	Process a completion of a write (or send).  A short
+ *			write on a stream channel is continued.  The channel
+ *			is only updated as bytes are actually written.
+ *
+ * chn: channel which was written
+ * gen: ring generation of operation
+ * res: result of write
+ */
+static void poller_ring_output(struct poller *plr, struct channel *chn,
+	unsigned int gen, int res)
+{
+	chn->ring_wr--;
+	if(poller_ring_is_current(chn, gen)) {
+		if(res < 0) {
+			log_println(chn->log, "poller: %s %s:%s",
+				strerror(-res), chn->name, chn->service);
+			poller_close_channel(plr, chn);
+			return;
+		}
+		chn->stage_off += res;
+		if(!(chn->flags & FLAG_UDP) && res > 0 &&
+		   chn->stage_off < chn->stage_len &&
+		   poller_ring_write_stage(plr, chn) == 0)
+		{
+			channel_ring_wrote(chn, res, false);
+			return;
+		}
+		channel_ring_wrote(chn, res, chn->ring_wr == 0);
+	}
+	if(chn->ring_wr == 0)
+		channel_touch(chn);
+}
+
+/*
+ * poller_ring_complete		Process one io_uring completion.
+ *
+ * cqe: completion queue entry
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ */
+static void poller_ring_complete(struct poller *plr,
+	const struct io_uring_cqe *cqe, bool *stop, bool *config)
+{
+	uint64_t obj = cqe->user_data & RING_PTR_MASK;
+	void *ptr = (void *)(uintptr_t)obj;
+	enum own_t own = obj >> RING_OP_BITS;
+	unsigned int gen = cqe->user_data >> RING_GEN_SHIFT;
+	enum ring_op_t op = cqe->user_data & RING_OP_MASK;
+
+	switch(op) {
+	case OP_POLL:
+		poller_ring_polled(plr, own, cqe, stop, config);
+		break;
+	case OP_TIMEOUT:
+		poller_ring_expired(plr, own, cqe->res, stop, config);
+		break;
+	case OP_READ:
+	case OP_INPUT:
+		poller_ring_input(plr, ptr, op, gen, cqe);
+		break;
+	case OP_WRITE:
+		poller_ring_output(plr, ptr, gen, cqe->res);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * poller_ring_wait	Submit pending ring operations, then wait for
+ *			completions and process them, with one system call.
+ *
+ * stop: set to true if the shard should stop
+ * config: set to true if the configuration file changed
+ * return: 0 on success, errno value on error
+ */
+static int poller_ring_wait(struct poller *plr, bool *stop, bool *config) {
+	struct io_uring_cqe *cqe;
+	int n = 0;
+
+	poller_ring_timeouts(plr);
+	/* don't wait if channels were touched while registering */
+	if(uring_enter(&plr->ring, plr->dirty == NULL) < 0)
+		return errno;
+	timeval_refresh();
+	/* Like epoll_wait, handle a bounded batch each pass, so that a
+	 * flood of input does not hold back writes */
+	while(n++ < plr->n_channels + OWN_EVENTS &&
+	      (cqe = uring_peek(&plr->ring)))
+	{
+		struct io_uring_cqe c = *cqe;
+		uring_seen(&plr->ring);
+		poller_ring_complete(plr, &c, stop, config);
 	}
 	return 0;
 }
@@ -216,18 +1207,22 @@ static int poller_check_config(struct poller *plr) {
  * return: 0 on success, errno value on error
  */
 static int poller_do_poll(struct poller *plr) {
-	int i, r;
-	struct channel *chn = plr->chns;
+	bool config = false;
+	bool stop = false;
+	int r;
 
-	do {
-		r = poll(plr->pollfds, plr->n_channels + 2, -1);
-	} while(r < 0 && errno == EINTR);
-	if(r < 0)
-		return errno;
-	for(i = 0; i < plr->n_channels; i++, chn = chn->next)
-		poller_channel_events(plr, chn, plr->pollfds + i);
-	poller_defer_events(plr);
-	return poller_check_config(plr);
+	if(plr->use_ring)
+		r = poller_ring_wait(plr, &stop, &config);
+	else
+		r = poller_epoll_wait(plr, &stop, &config);
+	if(r)
+		return r;
+	if(stop)
+		return -1;
+	if(config)
+		return poller_check_config(plr);
+	else
+		return 0;
 }
 
 /*
@@ -241,6 +1236,7 @@ int poller_loop(struct poller *plr) {
 		poller_register_events(plr);
 		r = poller_do_poll(plr);
 	} while(r == 0);
+	timeval_uncache();
 	if(r > 0)
 		return r;
 	else
@@ -1,22 +1,66 @@
 #ifndef POLLER_H
 #define POLLER_H
 
-#include <sys/poll.h>		/* for struct pollfd */
+#include <sys/epoll.h>		/* for struct epoll_event */
 #include "channel.h"		/* for struct channel */
 #include "defer.h"
+#include "resolver.h"		/* for struct resolver */
+#include "timer.h"		/* for struct timer */
+#include "uring.h"		/* for struct uring */
+#include "wheel.h"		/* for struct wheel */
+
+struct shard;
+
+/*
+ * The poller's own file descriptors and timers are registered with a small
+ * token instead of a pointer.  Tokens are never valid channel pointers.
+ */
+enum own_t {
+	OWN_DEFER = 1,		/* deferred packet timer */
+	OWN_TIMER,		/* retry / pace / stats timer */
+	OWN_RESOLVER,		/* host name resolver */
+	OWN_SHARD,		/* shard message queue */
+	OWN_CONFIG,		/* inotify for configuration file */
+	OWN_SIGNAL,		/* signal fd */
+	OWN_TOKENS,		/* tokens are less than this */
+};
+
+/*
+ * With io_uring, each timer is waited for by an absolute timeout operation,
+ * which is updated in place whenever the timer is rearmed.
+ */
+struct poller_timeout {
+	struct timer		*timer;		/* detached timer */
+	enum own_t		own;		/* token passed with expiration */
+	struct __kernel_timespec ts;		/* expiration submitted to ring */
+	bool			pending;	/* timeout is in flight */
+};
 
 struct poller {
-	int		n_channels;
-	struct channel	*chns;
-	struct pollfd	*pollfds;
-	struct defer	*defer;
-	int		fd_null;
-	int		fd_inotify;
-	int		wd_inotify;
+	int			n_channels;
+	struct channel		*chns;
+	struct epoll_event	*events;
+	struct defer		*defer;
+	struct shard		*shard;
+	struct channel		*dirty;
+	struct resolver		resolver;
+	struct timer		timer;
+	struct wheel		retry;
+	struct wheel		pace;
+	struct timeval		stats_start;
+	struct timeval		stats_due;
+	unsigned int		seed;
+	int			fd_epoll;
+	int			fd_inotify;
+	int			wd_inotify;
+	int			fd_signal;
+	bool			use_ring;
+	struct uring		ring;
+	struct poller_timeout	timeouts[2];
 };
 
 struct poller *poller_init(struct poller *plr, int n_channels,
-	struct channel *chns, struct defer *dfr);
+	struct channel *chns, struct defer *dfr, struct shard *sh);
 void poller_destroy(struct poller *plr);
 int poller_loop(struct poller *plr);
 
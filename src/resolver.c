@@ -0,0 +1,256 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>		/* for uint64_t */
+#include <stdlib.h>		/* for malloc, free */
+#include <string.h>		/* for memset, strncpy */
+#include <unistd.h>		/* for read, write, close */
+#include <sys/eventfd.h>	/* for eventfd */
+#include "resolver.h"		/* for struct resolver, prototypes */
+
+/*
+ * lookup_destroy	Destroy a lookup (and free its memory).
+ */
+void lookup_destroy(struct lookup *lk) {
+	if(lk->result)
+		freeaddrinfo(lk->result);
+	free(lk);
+}
+
+/*
+ * lookup_free_list	Destroy a list of lookups.
+ */
+static void lookup_free_list(struct lookup *lk) {
+	while(lk) {
+		struct lookup *nlk = lk->next;
+		lookup_destroy(lk);
+		lk = nlk;
+	}
+}
+
+/*
+ * resolver_queue_destroy	Destroy the queues of a resolver (and free their
+ *				memory), with any lookups left on them.
+ */
+static void resolver_queue_destroy(struct resolver_queue *rq) {
+	lookup_free_list(rq->pending);
+	lookup_free_list(rq->done);
+	pthread_cond_destroy(&rq->cond);
+	pthread_mutex_destroy(&rq->mutex);
+	close(rq->fd);
+	free(rq);
+}
+
+/*
+ * resolver_pop_pending	Remove the first pending lookup.  The mutex must be
+ *			held by the caller.
+ *
+ * return: first pending lookup, or NULL if none
+ */
+static struct lookup *resolver_pop_pending(struct resolver_queue *rq) {
+	struct lookup *lk = rq->pending;
+	if(lk) {
+		rq->pending = lk->next;
+		if(rq->pending == NULL)
+			rq->pending_tail = &rq->pending;
+		lk->next = NULL;
+	}
+	return lk;
+}
+
+/*
+ * resolver_push_done	Add a lookup to the completed list and signal the
+ *			eventfd.  The mutex must be held by the caller.
+ */
+static void resolver_push_done(struct resolver_queue *rq, struct lookup *lk) {
+	uint64_t one = 1;
+	lk->next = NULL;
+	*rq->done_tail = lk;
+	rq->done_tail = &lk->next;
+	if(write(rq->fd, &one, sizeof(one)) < 0) {
+		/* counter can't overflow; eventfd is already readable */
+	}
+}
+
+/*
+ * resolver_thread	Worker thread which resolves pending lookups.  Once the
+ *			resolver is stopped, the thread is detached, and it
+ *			destroys the queues after its current lookup.
+ */
+static void *resolver_thread(void *arg) {
+	struct resolver_queue *rq = arg;
+
+	pthread_mutex_lock(&rq->mutex);
+	while(!rq->stop) {
+		struct lookup *lk = resolver_pop_pending(rq);
+		if(lk == NULL) {
+			pthread_cond_wait(&rq->cond, &rq->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&rq->mutex);
+		lk->rc = getaddrinfo(lk->name, lk->service, &lk->hints,
+			&lk->result);
+		if(lk->rc)
+			lk->result = NULL;
+		pthread_mutex_lock(&rq->mutex);
+		resolver_push_done(rq, lk);
+	}
+	pthread_mutex_unlock(&rq->mutex);
+	resolver_queue_destroy(rq);
+	return NULL;
+}
+
+/*
+ * resolver_init	Initialize a new resolver and start its worker thread.
+ *
+ * return: pointer to struct resolver or NULL on error
+ */
+struct resolver *resolver_init(struct resolver *rsv) {
+	struct resolver_queue *rq;
+
+	memset(rsv, 0, sizeof(struct resolver));
+	rq = malloc(sizeof(struct resolver_queue));
+	if(rq == NULL)
+		return NULL;
+	memset(rq, 0, sizeof(struct resolver_queue));
+	rq->pending_tail = &rq->pending;
+	rq->done_tail = &rq->done;
+	rq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(rq->fd < 0)
+		goto out;
+	if(pthread_mutex_init(&rq->mutex, NULL))
+		goto out1;
+	if(pthread_cond_init(&rq->cond, NULL))
+		goto out2;
+	if(pthread_create(&rsv->thread, NULL, resolver_thread, rq))
+		goto out3;
+	rsv->queue = rq;
+	return rsv;
+out3:
+	pthread_cond_destroy(&rq->cond);
+out2:
+	pthread_mutex_destroy(&rq->mutex);
+out1:
+	close(rq->fd);
+out:
+	free(rq);
+	return NULL;
+}
+
+/*
+ * resolver_destroy	Stop the worker thread and destroy the resolver.  This
+ *			does not wait for a lookup in progress; the detached
+ *			worker destroys the queues when it finishes.
+ */
+void resolver_destroy(struct resolver *rsv) {
+	struct resolver_queue *rq = rsv->queue;
+
+	if(rq) {
+		pthread_mutex_lock(&rq->mutex);
+		rq->stop = true;
+		pthread_cond_signal(&rq->cond);
+		pthread_mutex_unlock(&rq->mutex);
+		pthread_detach(rsv->thread);
+	}
+	memset(rsv, 0, sizeof(struct resolver));
+}
+
+/*
+ * resolver_get_fd	Get the file descriptor to poll for completed lookups.
+ */
+int resolver_get_fd(const struct resolver *rsv) {
+	return rsv->queue->fd;
+}
+
+/*
+ * resolver_lookup	Start resolving a host name and service.
+ *
+ * name: host name
+ * service: service (port)
+ * hints: getaddrinfo hints
+ * data: requester data (returned with the completed lookup)
+ * return: pointer to lookup, or NULL on error
+ */
+struct lookup *resolver_lookup(struct resolver *rsv, const char *name,
+	const char *service, const struct addrinfo *hints, void *data)
+{
+	struct resolver_queue *rq = rsv->queue;
+	struct lookup *lk = malloc(sizeof(struct lookup));
+	if(lk == NULL)
+		return NULL;
+	memset(lk, 0, sizeof(struct lookup));
+	strncpy(lk->name, name, sizeof(lk->name));
+	lk->name[sizeof(lk->name) - 1] = '\0';
+	strncpy(lk->service, service, sizeof(lk->service));
+	lk->service[sizeof(lk->service) - 1] = '\0';
+	lk->hints = *hints;
+	lk->data = data;
+	pthread_mutex_lock(&rq->mutex);
+	*rq->pending_tail = lk;
+	rq->pending_tail = &lk->next;
+	pthread_cond_signal(&rq->cond);
+	pthread_mutex_unlock(&rq->mutex);
+	return lk;
+}
+
+/*
+ * resolver_cancel	Cancel a lookup.  If it has not been started, it is
+ *			destroyed now; otherwise its data is cleared, and it
+ *			is destroyed after it completes.
+ */
+void resolver_cancel(struct resolver *rsv, struct lookup *lk) {
+	struct resolver_queue *rq = rsv->queue;
+	struct lookup **plk;
+
+	pthread_mutex_lock(&rq->mutex);
+	lk->data = NULL;
+	for(plk = &rq->pending; *plk; plk = &(*plk)->next) {
+		if(*plk == lk) {
+			*plk = lk->next;
+			if(rq->pending_tail == &lk->next)
+				rq->pending_tail = plk;
+			lookup_destroy(lk);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rq->mutex);
+}
+
+/*
+ * resolver_next	Get the next completed lookup.  The caller must destroy
+ *			the lookup when finished with it.
+ *
+ * return: completed lookup, or NULL if there are no more
+ */
+struct lookup *resolver_next(struct resolver *rsv) {
+	struct resolver_queue *rq = rsv->queue;
+	struct lookup *lk;
+
+	pthread_mutex_lock(&rq->mutex);
+	lk = rq->done;
+	if(lk) {
+		rq->done = lk->next;
+		if(rq->done == NULL)
+			rq->done_tail = &rq->done;
+		lk->next = NULL;
+	} else {
+		/* all done -- clear the eventfd counter */
+		uint64_t n;
+		if(read(rq->fd, &n, sizeof(n)) < 0) {
+			/* EAGAIN: counter was already clear */
+		}
+	}
+	pthread_mutex_unlock(&rq->mutex);
+	return lk;
+}
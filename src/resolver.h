@@ -0,0 +1,57 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>	/* for bool */
+#include <netdb.h>	/* for struct addrinfo */
+#include <pthread.h>	/* for pthread_t, pthread_mutex_t, pthread_cond_t */
+
+/*
+ * A lookup is one request to resolve a host name and service.  The "data"
+ * pointer belongs to the requester; it is cleared if the lookup is cancelled.
+ */
+struct lookup {
+	char			name[32];	/* host name */
+	char			service[32];	/* service (port) */
+	struct addrinfo		hints;		/* getaddrinfo hints */
+	struct addrinfo		*result;	/* getaddrinfo result */
+	int			rc;		/* getaddrinfo return code */
+	void			*data;		/* requester data */
+	struct lookup		*next;		/* next lookup in queue */
+};
+
+void lookup_destroy(struct lookup *lk);
+
+/*
+ * The queues of a resolver are shared with its worker thread.  When the
+ * resolver is destroyed, the worker owns them, and frees them once any lookup
+ * in progress is finished.
+ */
+struct resolver_queue {
+	pthread_mutex_t		mutex;		/* mutex for queues */
+	pthread_cond_t		cond;		/* condition for pending */
+	struct lookup		*pending;	/* pending lookups */
+	struct lookup		**pending_tail;	/* tail of pending lookups */
+	struct lookup		*done;		/* completed lookups */
+	struct lookup		**done_tail;	/* tail of completed lookups */
+	bool			stop;		/* flag to stop worker */
+	int			fd;		/* eventfd for completion */
+};
+
+/*
+ * A resolver calls getaddrinfo on a worker thread, so that name lookups never
+ * block the poll loop.  Completed lookups are signalled on an eventfd.
+ */
+struct resolver {
+	pthread_t		thread;		/* worker thread */
+	struct resolver_queue	*queue;		/* queues shared with worker */
+};
+
+struct resolver *resolver_init(struct resolver *rsv);
+void resolver_destroy(struct resolver *rsv);
+int resolver_get_fd(const struct resolver *rsv);
+struct lookup *resolver_lookup(struct resolver *rsv, const char *name,
+	const char *service, const struct addrinfo *hints, void *data);
+void resolver_cancel(struct resolver *rsv, struct lookup *lk);
+struct lookup *resolver_next(struct resolver *rsv);
+
+#endif
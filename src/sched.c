@@ -0,0 +1,140 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stddef.h>	/* for NULL */
+#include "defer.h"	/* for struct deferred_pkt */
+#include "sched.h"	/* for struct sched, prototypes */
+
+/*
+ * sched_init		Initialize a scheduler.
+ */
+void sched_init(struct sched *sch) {
+	sch->prio = NULL;
+	sch->prio_tail = &sch->prio;
+	sch->active = NULL;
+	sch->active_tail = &sch->active;
+}
+
+/*
+ * sched_is_empty	Test if a scheduler has no pending commands.
+ */
+bool sched_is_empty(const struct sched *sch) {
+	return sch->prio == NULL && sch->active == NULL;
+}
+
+/*
+ * sched_push		Push a receiver onto the tail of a class.
+ */
+static void sched_push(struct deferred_pkt ***tail, struct deferred_pkt *dpkt)
+{
+	dpkt->next_pending = NULL;
+	**tail = dpkt;
+	*tail = &dpkt->next_pending;
+}
+
+/*
+ * sched_pop		Pop a receiver from the head of a class.
+ */
+static struct deferred_pkt *sched_pop(struct deferred_pkt **head,
+	struct deferred_pkt ***tail)
+{
+	struct deferred_pkt *dpkt = *head;
+	*head = dpkt->next_pending;
+	if(*head == NULL)
+		*tail = head;
+	return dpkt;
+}
+
+/*
+ * sched_unlink		Unlink a receiver from the round-robin class.
+ */
+static void sched_unlink(struct sched *sch, struct deferred_pkt *dpkt) {
+	struct deferred_pkt **pp = &sch->active;
+	while(*pp != dpkt)
+		pp = &(*pp)->next_pending;
+	*pp = dpkt->next_pending;
+	if(*pp == NULL)
+		sch->active_tail = pp;
+}
+
+/*
+ * sched_add		Add a receiver with a pending command.  A receiver
+ *			which is already scheduled keeps its place, unless
+ *			its new command is in the priority class.
+ *
+ * prio: true if the command is in the priority class
+ */
+void sched_add(struct sched *sch, struct deferred_pkt *dpkt, bool prio) {
+	if(dpkt->is_pending) {
+		if(!prio || dpkt->is_prio)
+			return;
+		sched_unlink(sch, dpkt);
+	}
+	dpkt->is_pending = true;
+	dpkt->is_prio = prio;
+	if(prio)
+		sched_push(&sch->prio_tail, dpkt);
+	else
+		sched_push(&sch->active_tail, dpkt);
+}
+
+/*
+ * sched_next		Remove the receiver whose command should be sent next.
+ *			Each round-robin turn credits a receiver with one
+ *			quantum; it is sent once its credit covers the bytes
+ *			its previous command took on the line.
+ *
+ * return: receiver to send, or NULL if none are pending
+ */
+struct deferred_pkt *sched_next(struct sched *sch) {
+	struct deferred_pkt *dpkt;
+
+	if(sch->prio)
+		dpkt = sched_pop(&sch->prio, &sch->prio_tail);
+	else {
+		while(sch->active) {
+			dpkt = sch->active;
+			if(dpkt->deficit >= dpkt->cost)
+				break;
+			dpkt->deficit += SCHED_QUANTUM;
+			if(dpkt->deficit >= dpkt->cost)
+				break;
+			sched_pop(&sch->active, &sch->active_tail);
+			sched_push(&sch->active_tail, dpkt);
+		}
+		if(sch->active == NULL)
+			return NULL;
+		dpkt = sched_pop(&sch->active, &sch->active_tail);
+	}
+	/* A receiver has no credit left once its queue is empty */
+	dpkt->deficit = 0;
+	dpkt->is_pending = false;
+	return dpkt;
+}
+
+/*
+ * sched_clear		Remove all receivers from a scheduler.
+ */
+void sched_clear(struct sched *sch) {
+	struct deferred_pkt *dpkt;
+	for(dpkt = sch->prio; dpkt; dpkt = dpkt->next_pending) {
+		dpkt->is_pending = false;
+		dpkt->n_held = 0;
+	}
+	for(dpkt = sch->active; dpkt; dpkt = dpkt->next_pending) {
+		dpkt->is_pending = false;
+		dpkt->n_held = 0;
+	}
+	sched_init(sch);
+}
@@ -0,0 +1,30 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>	/* for bool */
+
+struct deferred_pkt;	/* avoid circular dependency */
+
+#define SCHED_QUANTUM (16)	/* bytes credited each round-robin turn */
+
+/*
+ * A scheduler decides which receiver's pending command is encoded next when
+ * an output channel can take more bytes.  Commands in the priority class are
+ * always sent first, in the order they were queued.  All other receivers share
+ * the line by deficit round-robin, so that one busy receiver cannot starve
+ * the others on the same line.
+ */
+struct sched {
+	struct deferred_pkt	*prio;		/* priority class */
+	struct deferred_pkt	**prio_tail;	/* tail of priority class */
+	struct deferred_pkt	*active;	/* round-robin class */
+	struct deferred_pkt	**active_tail;	/* tail of round-robin class */
+};
+
+void sched_init(struct sched *sch);
+bool sched_is_empty(const struct sched *sch);
+void sched_add(struct sched *sch, struct deferred_pkt *dpkt, bool prio);
+struct deferred_pkt *sched_next(struct sched *sch);
+void sched_clear(struct sched *sch);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdlib.h>		/* for malloc, calloc, free */
+#include <string.h>		/* for memset */
+#include <sys/eventfd.h>	/* for eventfd, eventfd_read, eventfd_write */
+#include <unistd.h>		/* for close */
+#include "ccwriter.h"		/* for ccwriter_do_write_shared */
+#include "shard.h"		/* for struct shard, prototypes */
+#include "stats.h"		/* for ptz_stats_cross, ptz_stats_report_totals */
+
+/*
+ * shard_queue_destroy	Destroy a queue between two shards.
+ */
+static void shard_queue_destroy(struct shard_queue *q) {
+	unsigned int i;
+	for(i = 0; i < SHARD_QUEUE_SZ; i++)
+		ccpacket_destroy(q->slot[i].packet);
+	free(q);
+}
+
+/*
+ * shard_queue_create	Create a queue between two shards.
+ *
+ * return: pointer to queue, or NULL on error
+ */
+static struct shard_queue *shard_queue_create(void) {
+	struct shard_queue *q = calloc(1, sizeof(struct shard_queue));
+	unsigned int i;
+
+	if(q == NULL)
+		return NULL;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	for(i = 0; i < SHARD_QUEUE_SZ; i++) {
+		q->slot[i].packet = ccpacket_create();
+		if(q->slot[i].packet == NULL) {
+			shard_queue_destroy(q);
+			return NULL;
+		}
+	}
+	return q;
+}
+
+/*
+ * shard_queue_drain	Send all packets in a queue to their writers.
+ */
+static void shard_queue_drain(struct shard_queue *q) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load(&q->tail);
+
+	while(head != tail) {
+		struct shard_msg *msg = q->slot + (head & (SHARD_QUEUE_SZ - 1));
+		ccwriter_do_write_shared(msg->writer, msg->packet, &msg->enc);
+		head++;
+		/* give the slot back to the producer */
+		atomic_store_explicit(&q->head, head, memory_order_release);
+	}
+}
+
+/*
+ * shard_init		Initialize one shard.
+ *
+ * id: shard number
+ * dfr: deferred packet handler, or NULL to create one
+ * return: pointer to shard, or NULL on error
+ */
+static struct shard *shard_init(struct shards *shs, unsigned int id,
+	struct defer *dfr)
+{
+	struct shard *sh = shs->shard + id;
+	unsigned int i;
+
+	sh->id = id;
+	sh->all = shs;
+	atomic_init(&sh->awake, false);
+	atomic_init(&sh->report, false);
+	sh->fd_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(sh->fd_wake < 0)
+		return NULL;
+	if(dfr == NULL) {
+		dfr = malloc(sizeof(struct defer));
+		if(dfr == NULL)
+			return NULL;
+		if(defer_init(dfr) == NULL) {
+			free(dfr);
+			return NULL;
+		}
+	}
+	sh->defer = dfr;
+	for(i = 0; i < shs->n_shards; i++) {
+		if(i != id) {
+			sh->queue[i] = shard_queue_create();
+			if(sh->queue[i] == NULL)
+				return NULL;
+		}
+	}
+	return sh;
+}
+
+/*
+ * shard_destroy	Destroy one shard.  Shard 0 uses the deferred packet
+ *			handler of the configuration, which is not destroyed.
+ */
+static void shard_destroy(struct shard *sh) {
+	unsigned int i;
+
+	for(i = 0; i < SHARD_MAX; i++) {
+		if(sh->queue[i])
+			shard_queue_destroy(sh->queue[i]);
+	}
+	if(sh->id && sh->defer) {
+		defer_destroy(sh->defer);
+		free(sh->defer);
+	}
+	if(sh->fd_wake > 0)
+		close(sh->fd_wake);
+	memset(sh, 0, sizeof(struct shard));
+}
+
+/*
+ * shards_deal		Deal channels out to the shards.  Input and output
+ *			channels are dealt separately, so each shard gets a
+ *			share of both.  Writers and readers are assigned to the
+ *			shard of their channel.
+ *
+ * cfg: configuration (channels are taken from it)
+ */
+static void shards_deal(struct shards *shs, struct config *cfg) {
+	struct channel **tail[SHARD_MAX];
+	struct channel *chn, *nchn;
+	struct ccwriter *wtr;
+	unsigned int i, n_in = 0, n_out = 0;
+
+	for(i = 0; i < shs->n_shards; i++)
+		tail[i] = &shs->shard[i].chns;
+	for(chn = config_cede_channels(cfg); chn; chn = nchn) {
+		nchn = chn->next;
+		if(chn->reader)
+			i = n_in++ % shs->n_shards;
+		else
+			i = n_out++ % shs->n_shards;
+		chn->shard = shs->shard + i;
+		if(chn->reader)
+			chn->reader->shard = chn->shard;
+		chn->next = NULL;
+		*tail[i] = chn;
+		tail[i] = &chn->next;
+		shs->shard[i].n_channels++;
+	}
+	for(wtr = cfg->writer_head; wtr; wtr = wtr->next) {
+		wtr->shard = wtr->chn->shard;
+		wtr->defer = wtr->shard->defer;
+	}
+	shs->writers = cfg->writer_head;
+}
+
+/*
+ * shards_init		Initialize a set of shards, and take all channels from
+ *			a configuration.
+ *
+ * n_shards: number of shards (threads)
+ * uring: true to poll with io_uring instead of epoll
+ * cfg: configuration
+ * return: pointer to struct shards, or NULL on error
+ */
+struct shards *shards_init(struct shards *shs, unsigned int n_shards,
+	bool uring, struct config *cfg)
+{
+	unsigned int i;
+
+	memset(shs, 0, sizeof(struct shards));
+	if(n_shards < 1)
+		n_shards = 1;
+	if(n_shards > SHARD_MAX)
+		n_shards = SHARD_MAX;
+	shs->n_shards = n_shards;
+	shs->uring = uring;
+	atomic_init(&shs->stop, false);
+	for(i = 0; i < n_shards; i++) {
+		if(shard_init(shs, i, i ? NULL : cfg->defer) == NULL)
+			goto fail;
+	}
+	shards_deal(shs, cfg);
+	for(i = 0; i < n_shards; i++) {
+		struct shard *sh = shs->shard + i;
+		if(poller_init(&sh->poller, sh->n_channels, sh->chns,
+			sh->defer, sh) == NULL)
+		{
+			goto fail;
+		}
+		/* the poller owns the channels now */
+		sh->chns = NULL;
+		sh->polling = true;
+	}
+	return shs;
+fail:
+	shards_destroy(shs);
+	return NULL;
+}
+
+/*
+ * shards_destroy	Destroy a set of shards, and all of their channels.
+ */
+void shards_destroy(struct shards *shs) {
+	unsigned int i;
+
+	for(i = 0; i < shs->n_shards; i++) {
+		struct shard *sh = shs->shard + i;
+		struct channel *chn = sh->chns;
+		while(chn) {
+			struct channel *nchn = chn->next;
+			channel_destroy(chn);
+			free(chn);
+			chn = nchn;
+		}
+		if(sh->polling)
+			poller_destroy(&sh->poller);
+		shard_destroy(sh);
+	}
+	memset(shs, 0, sizeof(struct shards));
+}
+
+/*
+ * shard_wake		Wake up the poller of a shard.
+ */
+static void shard_wake(struct shard *sh) {
+	eventfd_write(sh->fd_wake, 1);
+}
+
+/*
+ * shards_stop		Tell all shards to stop.
+ */
+static void shards_stop(struct shards *shs) {
+	unsigned int i;
+
+	atomic_store(&shs->stop, true);
+	for(i = 0; i < shs->n_shards; i++)
+		shard_wake(shs->shard + i);
+}
+
+/*
+ * shards_report	Tell all shards to log the route latency of their
+ *			writers.  Each shard logs its own, since only that
+ *			shard updates them.
+ */
+void shards_report(struct shards *shs) {
+	unsigned int i;
+
+	for(i = 0; i < shs->n_shards; i++) {
+		atomic_store(&shs->shard[i].report, true);
+		shard_wake(shs->shard + i);
+	}
+}
+
+/*
+ * shard_report		Log the route latency of all writers on a shard.
+ */
+static void shard_report(struct shard *sh) {
+	struct ccwriter *wtr;
+
+	for(wtr = sh->all->writers; wtr; wtr = wtr->next) {
+		if(wtr->shard == sh)
+			ccwriter_log_route(wtr);
+	}
+}
+
+/*
+ * shard_log_stats	Log the receiver counters of all writers on a shard.
+ *			Shard 0 also logs the totals which are shared by all
+ *			shards.
+ *
+ * ms: length of interval (ms)
+ */
+void shard_log_stats(struct shard *sh, unsigned int ms) {
+	struct ccwriter *wtr;
+
+	for(wtr = sh->all->writers; wtr; wtr = wtr->next) {
+		if(wtr->shard == sh)
+			ccwriter_log_stats(wtr, ms);
+	}
+	if(sh->id == 0)
+		ptz_stats_report_totals();
+}
+
+/*
+ * shard_thread		Run the poller loop for one shard.  When it returns,
+ *			all other shards are stopped too.
+ */
+static void *shard_thread(void *arg) {
+	struct shard *sh = arg;
+
+	sh->rc = poller_loop(&sh->poller);
+	shards_stop(sh->all);
+	return NULL;
+}
+
+/*
+ * shards_run		Run all shards until one of them stops.  Shard 0 runs
+ *			on the calling thread; it is the only one watching the
+ *			configuration file.
+ *
+ * return: errno value on error, 0 to restart daemon
+ */
+int shards_run(struct shards *shs) {
+	unsigned int i, n_started;
+	int rc = 0;
+
+	for(n_started = 1; n_started < shs->n_shards; n_started++) {
+		struct shard *sh = shs->shard + n_started;
+		int r = pthread_create(&sh->thread, NULL, shard_thread, sh);
+		if(r) {
+			shs->shard[0].rc = r;
+			break;
+		}
+	}
+	if(n_started == shs->n_shards)
+		shs->shard[0].rc = poller_loop(&shs->shard[0].poller);
+	shards_stop(shs);
+	for(i = 1; i < n_started; i++)
+		pthread_join(shs->shard[i].thread, NULL);
+	for(i = 0; i < shs->n_shards && rc == 0; i++)
+		rc = shs->shard[i].rc;
+	return rc;
+}
+
+/*
+ * shard_send		Send a copy of a packet to a writer on another shard.
+ *			If the queue is full, the packet is dropped.
+ *
+ * src: shard sending the packet
+ * wtr: writer on destination shard
+ * pkt: packet to send
+ * enc: encode cache for the packet
+ * return: true if packet was queued; otherwise false
+ */
+bool shard_send(struct shard *src, struct ccwriter *wtr, struct ccpacket *pkt,
+	const struct ccencode *enc)
+{
+	struct shard *dst = wtr->shard;
+	struct shard_queue *q = dst->queue[src->id];
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	struct shard_msg *msg;
+
+	if(tail - head >= SHARD_QUEUE_SZ) {
+		ptz_stats_cross(true);
+		return false;
+	}
+	msg = q->slot + (tail & (SHARD_QUEUE_SZ - 1));
+	msg->writer = wtr;
+	ccpacket_copy(msg->packet, pkt);
+	msg->enc = *enc;
+	atomic_store(&q->tail, tail + 1);
+	ptz_stats_cross(false);
+	/* Only the first packet since the last drain needs a wakeup */
+	if(!atomic_exchange(&dst->awake, true))
+		shard_wake(dst);
+	return true;
+}
+
+/*
+ * shard_drain		Send all packets queued for a shard by other shards.
+ *			This is called when the shard is woken up.
+ *
+ * return: 0 on success; -1 if the shard should stop
+ */
+int shard_drain(struct shard *sh) {
+	eventfd_t val;
+	unsigned int i;
+
+	eventfd_read(sh->fd_wake, &val);
+	/* Clear the flag before draining, so that a packet queued during the
+	 * drain always causes another wakeup */
+	atomic_store(&sh->awake, false);
+	for(i = 0; i < sh->all->n_shards; i++) {
+		if(sh->queue[i])
+			shard_queue_drain(sh->queue[i]);
+	}
+	if(atomic_exchange(&sh->report, false))
+		shard_report(sh);
+	return atomic_load(&sh->all->stop) ? -1 : 0;
+}
+
+/*
+ * shard_get_fd		Get the file descriptor for shard wakeup events.
+ */
+int shard_get_fd(const struct shard *sh) {
+	return sh->fd_wake;
+}
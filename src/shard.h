@@ -0,0 +1,81 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>		/* for pthread_t */
+#include <stdatomic.h>		/* for atomic_bool, atomic_size_t */
+#include <stdbool.h>		/* for bool */
+#include "ccpacket.h"		/* for struct ccpacket */
+#include "ccwriter.h"		/* for struct ccencode */
+#include "config.h"		/* for struct config */
+#include "defer.h"		/* for struct defer */
+#include "poller.h"		/* for struct poller */
+
+#define SHARD_MAX (16)		/* maximum number of shards */
+#define SHARD_QUEUE_SZ (256)	/* slots in a queue (power of two) */
+
+/*
+ * A message carries a copy of one packet to a writer on another shard.  The
+ * encode cache goes with it, so encodings are still shared and raw frames are
+ * still passed through.
+ */
+struct shard_msg {
+	struct ccwriter		*writer;	/* writer to send packet */
+	struct ccpacket		*packet;	/* copy of packet */
+	struct ccencode		enc;		/* copy of encode cache */
+};
+
+/*
+ * A queue passes messages from one shard to another.  There is only one
+ * producer and one consumer, so it needs no locks.  Both positions count up
+ * without wrapping, and are masked to get slots.
+ */
+struct shard_queue {
+	atomic_size_t		head;		/* next slot to consume */
+	_Alignas(64) atomic_size_t tail;	/* next slot to produce */
+	struct shard_msg	slot[SHARD_QUEUE_SZ];	/* message slots */
+};
+
+struct shards;
+
+/*
+ * A shard is one thread with its own poller and deferred packet handler.
+ * Each channel is polled by one shard, and each writer runs on the shard of
+ * its output channel, so transmit buffers are never shared.  Packets for a
+ * writer on another shard are passed through a queue.
+ */
+struct shard {
+	unsigned int		id;		/* shard number */
+	struct shards		*all;		/* set of all shards */
+	struct poller		poller;		/* channel poller */
+	bool			polling;	/* poller is initialized */
+	struct defer		*defer;		/* deferred packet handler */
+	struct channel		*chns;		/* channels polled by shard */
+	int			n_channels;	/* number of channels */
+	int			fd_wake;	/* eventfd to wake the shard */
+	atomic_bool		awake;		/* wakeup already signalled */
+	atomic_bool		report;		/* route latency requested */
+	struct shard_queue	*queue[SHARD_MAX];	/* queues by sender */
+	pthread_t		thread;		/* thread running the shard */
+	int			rc;		/* result of poller loop */
+};
+
+struct shards {
+	struct shard		shard[SHARD_MAX];	/* all shards */
+	unsigned int		n_shards;	/* number of shards */
+	struct ccwriter		*writers;	/* all writers */
+	bool			uring;		/* poll with io_uring */
+	atomic_bool		stop;		/* all shards should stop */
+};
+
+struct shards *shards_init(struct shards *shs, unsigned int n_shards,
+	bool uring, struct config *cfg);
+void shards_destroy(struct shards *shs);
+int shards_run(struct shards *shs);
+void shards_report(struct shards *shs);
+void shard_log_stats(struct shard *sh, unsigned int ms);
+bool shard_send(struct shard *src, struct ccwriter *wtr, struct ccpacket *pkt,
+	const struct ccencode *enc);
+int shard_drain(struct shard *sh);
+int shard_get_fd(const struct shard *sh);
+
+#endif
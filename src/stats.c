@@ -12,98 +12,289 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
-#include <string.h>	/* for memset */
-#include <stdint.h>
+#include <stdatomic.h>	/* for atomic_uint_least64_t */
 #include "stats.h"
 
-/** Packet classifications */
-enum pkt_class {
-	PC_PAN,
-	PC_TILT,
-	PC_ZOOM,
-	PC_FOCUS,
-	PC_IRIS,
-	PC_WIPER,
-	PC_PRESET,
-	PC_TOTAL,
-};
-
-/** Names of packet classes */
-static const char *pc_name[] = {
-	"pan",
-	"tilt",
-	"zoom",
-	"focus",
-	"iris",
-	"wiper",
-	"preset",
-	"total",
-};
-
 /** Message logger */
 static struct log *log;
 
-/** Count of packets */
-static uint64_t n_pkts[PC_TOTAL + 1][CC_DOM_OUT + 1];
+/*
+ * Totals which are not kept for each channel are updated by every shard.
+ * They are relaxed atomics, so counting never waits for a lock.
+ */
+
+/** Count of deferred timer wakeups */
+static atomic_uint_least64_t n_defer_wakeups;
+
+/** Count of deferred packets sent on timer wakeups */
+static atomic_uint_least64_t n_defer_pkts;
+
+/** Largest number of deferred packets sent on one wakeup */
+static atomic_uint_least64_t n_defer_max;
+
+/** Count of packet encodes saved by reusing encoded bytes */
+static atomic_uint_least64_t n_encodes_saved;
+
+/** Count of write system calls */
+static atomic_uint_least64_t n_writes;
+
+/** Count of datagrams sent with sendmmsg */
+static atomic_uint_least64_t n_datagrams;
+
+/** Count of channel open retries */
+static atomic_uint_least64_t n_retries;
+
+/** Count of channel open retries which were delayed (backed off) */
+static atomic_uint_least64_t n_retries_delayed;
+
+/** Count of responses received, by HTTP keep-alive mode */
+static atomic_uint_least64_t n_responses[2];
+
+/** Total response latency (ms), by HTTP keep-alive mode */
+static atomic_uint_least64_t response_total[2];
+
+/** Largest response latency (ms), by HTTP keep-alive mode */
+static atomic_uint_least64_t response_max[2];
+
+/** Count of packets sent to writers on other shards */
+static atomic_uint_least64_t n_crossed;
+
+/** Count of packets dropped because a shard queue was full */
+static atomic_uint_least64_t n_cross_dropped;
+
+/** Add to a total.
+ *
+ * @param total		Total to update
+ * @param n		Amount to add
+ */
+static inline void stats_add(atomic_uint_least64_t *total, uint64_t n) {
+	atomic_fetch_add_explicit(total, n, memory_order_relaxed);
+}
+
+/** Raise a largest value.
+ *
+ * @param max		Largest value to update
+ * @param n		New value
+ */
+static void stats_max(atomic_uint_least64_t *max, uint64_t n) {
+	uint64_t m = atomic_load_explicit(max, memory_order_relaxed);
+	while (n > m && !atomic_compare_exchange_weak_explicit(max, &m, n,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+/** Get a total.
+ *
+ * @param total		Total to read
+ */
+static inline unsigned long long stats_get(atomic_uint_least64_t *total) {
+	return atomic_load_explicit(total, memory_order_relaxed);
+}
 
-/** Initialize packet stats.
+/** Initialize packet stats.  This is called before any shards are running.
  *
- * @param log		Message logger
+ * @param log		Message logger, or NULL to disable reports
  */
 void ptz_stats_init(struct log *lg) {
-	memset(&n_pkts, 0, sizeof(n_pkts));
+	int i;
+
+	atomic_init(&n_defer_wakeups, 0);
+	atomic_init(&n_defer_pkts, 0);
+	atomic_init(&n_defer_max, 0);
+	atomic_init(&n_encodes_saved, 0);
+	atomic_init(&n_writes, 0);
+	atomic_init(&n_datagrams, 0);
+	atomic_init(&n_retries, 0);
+	atomic_init(&n_retries_delayed, 0);
+	for (i = 0; i < 2; i++) {
+		atomic_init(&n_responses[i], 0);
+		atomic_init(&response_total[i], 0);
+		atomic_init(&response_max[i], 0);
+	}
+	atomic_init(&n_crossed, 0);
+	atomic_init(&n_cross_dropped, 0);
 	log = lg;
 }
 
-/** Print packet statistics.
+/** Test if stats reports are enabled.
+ */
+bool ptz_stats_enabled(void) {
+	return log != NULL;
+}
+
+/** Log the rates of channel counters over an interval, and start a new
+ * interval.  Nothing is logged for a channel which was idle.  Only the shard
+ * polling the channel may call this.
  *
- * @param pc		Packet class
- */
-static void ptz_stats_print(int pc) {
-	if (n_pkts[pc][CC_DOM_IN] || n_pkts[pc][CC_DOM_OUT]) {
-		uint64_t n_in = n_pkts[pc][CC_DOM_IN];
-		uint64_t n_out = n_pkts[pc][CC_DOM_OUT];
-		float prc_in = 100.0f * n_in / n_pkts[PC_TOTAL][CC_DOM_IN];
-		float prc_out = 100.0f * n_out / n_pkts[PC_TOTAL][CC_DOM_OUT];
-		log_println(log, "%8s: %10lld  %6.2f%% %10lld  %6.2f%%",
-			pc_name[pc], n_in, prc_in, n_out, prc_out);
+ * @param st		Channel counters
+ * @param name		Channel name
+ * @param service	Channel service
+ * @param ms		Length of interval (ms)
+ */
+void ptz_stats_report(struct chn_stats *st, const char *name,
+	const char *service, unsigned int ms)
+{
+	double rate[STAT_COUNTERS];
+	bool active = false;
+	int i;
+
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		uint64_t n = st->n[i] - st->last[i];
+		st->last[i] = st->n[i];
+		rate[i] = n * 1000.0 / (ms ? ms : 1);
+		if (n)
+			active = true;
+	}
+	if (active) {
+		log_println(log, "stats: %s:%s  in: %.1f/s %.0f B/s  "
+			"out: %.1f/s %.0f B/s  errors: %.1f/s  discards: %.1f/s  "
+			"deferred: %.1f/s  dropped: %.1f/s  overflows: %.1f/s  "
+			"reconnects: %.1f/s",
+			name, service, rate[STAT_PKTS_IN], rate[STAT_BYTES_IN],
+			rate[STAT_PKTS_OUT], rate[STAT_BYTES_OUT],
+			rate[STAT_ERRORS], rate[STAT_DISCARDS],
+			rate[STAT_DEFERRED], rate[STAT_DROPPED],
+			rate[STAT_OVERFLOWS], rate[STAT_RECONNECTS]);
 	}
 }
 
-/**
- * Display all packet statistics.
+/** Log the rates of receiver counters over an interval, and start a new
+ * interval.  Nothing is logged for a receiver which was idle.
+ *
+ * @param st		Receiver counters
+ * @param name		Output channel name
+ * @param service	Output channel service
+ * @param receiver	Receiver address
+ * @param ms		Length of interval (ms)
  */
-static void ptz_stats_display(void) {
+void ptz_stats_report_rcv(struct rcv_stats *st, const char *name,
+	const char *service, int receiver, unsigned int ms)
+{
+	double rate[RCV_COUNTERS];
+	bool active = false;
 	int i;
-	log_println(log, "%8s  %10s %8s %10s %8s", "Class", "Count IN",
-		"IN \%", "Count OUT", "OUT \%");
-	for (i = 0; i <= PC_TOTAL; i++)
-		ptz_stats_print(i);
+
+	for (i = 0; i < RCV_COUNTERS; i++) {
+		uint64_t n = st->n[i] - st->last[i];
+		st->last[i] = st->n[i];
+		rate[i] = n * 1000.0 / (ms ? ms : 1);
+		if (n)
+			active = true;
+	}
+	if (active) {
+		log_println(log, "stats: %s:%s rcv %d  out: %.1f/s  "
+			"deferred: %.1f/s  dropped: %.1f/s", name, service,
+			receiver, rate[RCV_PKTS], rate[RCV_DEFERRED],
+			rate[RCV_DROPPED]);
+	}
+}
+
+/** Log the totals which are not kept for each channel.
+ */
+void ptz_stats_report_totals(void) {
+	unsigned long long n;
+	int i;
+
+	n = stats_get(&n_defer_wakeups);
+	if (n) {
+		log_println(log, "%8s: %10llu  wakeups: %llu  avg: %.2f  "
+			"max: %llu", "deferred", stats_get(&n_defer_pkts), n,
+			(double)stats_get(&n_defer_pkts) / n,
+			stats_get(&n_defer_max));
+	}
+	n = stats_get(&n_encodes_saved);
+	if (n)
+		log_println(log, "%8s: %10llu  encodes saved", "shared", n);
+	n = stats_get(&n_writes);
+	if (n) {
+		log_println(log, "%8s: %10llu  datagrams: %llu", "writes", n,
+			stats_get(&n_datagrams));
+	}
+	n = stats_get(&n_retries);
+	if (n) {
+		log_println(log, "%8s: %10llu  delayed: %llu", "retries", n,
+			stats_get(&n_retries_delayed));
+	}
+	n = stats_get(&n_crossed);
+	if (n || stats_get(&n_cross_dropped)) {
+		log_println(log, "%8s: %10llu  dropped: %llu", "shards", n,
+			stats_get(&n_cross_dropped));
+	}
+	for (i = 0; i < 2; i++) {
+		n = stats_get(&n_responses[i]);
+		if (n) {
+			log_println(log, "%8s: %10llu  avg: %.1f ms  "
+				"max: %llu ms", i ? "http/1.1" : "http/1.0", n,
+				(double)stats_get(&response_total[i]) / n,
+				stats_get(&response_max[i]));
+		}
+	}
+}
+
+/** Count deferred packets sent on one timer wakeup.
+ *
+ * @param n		Number of deferred packets sent in the batch
+ */
+void ptz_stats_defer(unsigned int n) {
+	if (log) {
+		stats_add(&n_defer_wakeups, 1);
+		stats_add(&n_defer_pkts, n);
+		stats_max(&n_defer_max, n);
+	}
+}
+
+/** Count one packet encode saved by reusing encoded bytes.
+ */
+void ptz_stats_encode_saved(void) {
+	if (log)
+		stats_add(&n_encodes_saved, 1);
+}
+
+/** Count one write system call.
+ *
+ * @param n_msgs	Number of datagrams sent (0 for a stream write)
+ */
+void ptz_stats_write(unsigned int n_msgs) {
+	if (log) {
+		stats_add(&n_writes, 1);
+		stats_add(&n_datagrams, n_msgs);
+	}
+}
+
+/** Count one channel open retry.
+ *
+ * @param delay		Delay before retrying (ms)
+ */
+void ptz_stats_retry(unsigned int delay) {
+	if (log) {
+		stats_add(&n_retries, 1);
+		if (delay)
+			stats_add(&n_retries_delayed, 1);
+	}
+}
+
+/** Count one response to a request.
+ *
+ * @param keepalive	Response was on a keep-alive (HTTP/1.1) connection
+ * @param ms		Latency from request queued to response (ms)
+ */
+void ptz_stats_response(bool keepalive, long ms) {
+	if (log) {
+		int i = keepalive ? 1 : 0;
+		stats_add(&n_responses[i], 1);
+		stats_add(&response_total[i], ms);
+		stats_max(&response_max[i], ms);
+	}
 }
 
-/** Count one packet in the packet stats.
+/** Count one packet sent to a writer on another shard.
  *
- * @param pkt		Packet to count
- * @param d		Packet domain: CC_DOM_IN or CC_DOM_OUT
+ * @param dropped	Packet was dropped because the queue was full
  */
-void ptz_stats_count(const struct ccpacket *pkt, enum domain d) {
+void ptz_stats_cross(bool dropped) {
 	if (log) {
-		if (ccpacket_has_pan(pkt))
-			n_pkts[PC_PAN][d]++;
-		if (ccpacket_has_tilt(pkt))
-			n_pkts[PC_TILT][d]++;
-		if (ccpacket_get_zoom(pkt))
-			n_pkts[PC_ZOOM][d]++;
-		if (ccpacket_get_focus(pkt))
-			n_pkts[PC_FOCUS][d]++;
-		if (ccpacket_get_iris(pkt))
-			n_pkts[PC_IRIS][d]++;
-		if (ccpacket_get_wiper(pkt))
-			n_pkts[PC_WIPER][d]++;
-		if (ccpacket_get_preset_mode(pkt))
-			n_pkts[PC_PRESET][d]++;
-		n_pkts[PC_TOTAL][d]++;
-		if ((n_pkts[PC_TOTAL][d] % 100) == 0)
-			ptz_stats_display();
+		if (dropped)
+			stats_add(&n_cross_dropped, 1);
+		else
+			stats_add(&n_crossed, 1);
 	}
 }
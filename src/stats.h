@@ -1,10 +1,77 @@
 #ifndef STATS_H
 #define STATS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "log.h"
 #include "ccpacket.h"
 
+#define STATS_INTERVAL (10000)	/* interval between stats reports (ms) */
+
+/* Counters kept for each channel */
+enum stat_counter {
+	STAT_PKTS_IN,		/* packets decoded */
+	STAT_PKTS_OUT,		/* packets encoded */
+	STAT_BYTES_IN,		/* bytes read */
+	STAT_BYTES_OUT,		/* bytes written */
+	STAT_ERRORS,		/* decode errors */
+	STAT_DISCARDS,		/* undecoded input discarded */
+	STAT_DEFERRED,		/* packets deferred or held pending */
+	STAT_DROPPED,		/* pending packets replaced by newer ones */
+	STAT_OVERFLOWS,		/* commands lost on full transmit buffer */
+	STAT_RECONNECTS,	/* failed channel opens */
+	STAT_COUNTERS,		/* number of counters */
+};
+
+/*
+ * Channel counters are only updated by the shard polling the channel, so
+ * they need no locks.  They start on their own cache line, so updating them
+ * never contends with channel fields read by other shards.  The totals at the
+ * last report are kept, so each report is a snapshot of rates.
+ */
+struct chn_stats {
+	_Alignas(64) uint64_t	n[STAT_COUNTERS];	/* running totals */
+	uint64_t		last[STAT_COUNTERS];	/* totals at last report */
+};
+
+/* Counters kept for each receiver of a writer */
+enum rcv_counter {
+	RCV_PKTS,		/* packets encoded */
+	RCV_DEFERRED,		/* packets deferred or held pending */
+	RCV_DROPPED,		/* pending packets replaced by newer ones */
+	RCV_COUNTERS,		/* number of counters */
+};
+
+/*
+ * Receiver counters start on their own cache line, like channel counters, so
+ * updates on one shard never share a line with hot deferred packet fields.
+ */
+struct rcv_stats {
+	_Alignas(64) uint64_t	n[RCV_COUNTERS];	/* running totals */
+	uint64_t		last[RCV_COUNTERS];	/* totals at last report */
+};
+
+/*
+ * chn_stats_add	Add to one channel counter.
+ */
+static inline void chn_stats_add(struct chn_stats *st, enum stat_counter c,
+	uint64_t n)
+{
+	st->n[c] += n;
+}
+
 void ptz_stats_init(struct log *log);
-void ptz_stats_count(const struct ccpacket *pkt, enum domain d);
+bool ptz_stats_enabled(void);
+void ptz_stats_report(struct chn_stats *st, const char *name,
+	const char *service, unsigned int ms);
+void ptz_stats_report_rcv(struct rcv_stats *st, const char *name,
+	const char *service, int receiver, unsigned int ms);
+void ptz_stats_report_totals(void);
+void ptz_stats_defer(unsigned int n_pkts);
+void ptz_stats_encode_saved(void);
+void ptz_stats_retry(unsigned int delay);
+void ptz_stats_write(unsigned int n_msgs);
+void ptz_stats_response(bool keepalive, long ms);
+void ptz_stats_cross(bool dropped);
 
 #endif
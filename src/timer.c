@@ -1,6 +1,6 @@
 /*
  * protozoa -- CCTV transcoder / mixer for PTZ
- * Copyright (C) 2008-2011  Minnesota Department of Transportation
+ * Copyright (C) 2008-2014  Minnesota Department of Transportation
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -13,133 +13,121 @@
  * GNU General Public License for more details.
  */
 #include <errno.h>	/* for errno */
-#include <fcntl.h>	/* for fcntl, F_SETFL, O_NONBLOCK */
-#include <signal.h>	/* for sigfillset, sigaction, SA_RESTART, SIGALRM */
+#include <stdint.h>	/* for uint64_t */
 #include <stdio.h>	/* for NULL */
-#include <sys/time.h>	/* for setitimer, ITIMER_REAL, struct itimerval */
-#include <unistd.h>	/* for write */
+#include <string.h>	/* for memset */
+#include <time.h>	/* for CLOCK_MONOTONIC */
+#include <unistd.h>	/* for read, close */
 #include "timer.h"
 
-static struct timer timer_singleton;
-
 /*
- * timer_handler		Signal handler for timer signals.
+ * timer_init			Initialize a timer.
+ *
+ * The timer uses a timerfd on the monotonic clock, so that expirations
+ * are delivered through poll instead of a signal, and setting the system
+ * clock does not affect deferred packets.
  */
-static void timer_handler(int signo) {
-	static const char c = 0;
-
-	write(timer_singleton.pipe_fd[PIPE_WRITE], &c, 1);
+struct timer *timer_init(struct timer *tmr) {
+	memset(tmr, 0, sizeof(struct timer));
+	tmr->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(tmr->fd < 0)
+		return NULL;
+	return tmr;
 }
 
 /*
- * timer_install_handler	Install the timer signal handler.
+ * timer_destroy		Destroy a timer.
  */
-static int timer_install_handler() {
-	struct sigaction sa;
-
-	sa.sa_handler = &timer_handler;
-	sa.sa_flags = SA_RESTART;
-	if(sigfillset(&sa.sa_mask) < 0)
-		return -1;
-	return sigaction(SIGALRM, &sa, &timer_singleton.sa_original);
+void timer_destroy(struct timer *tmr) {
+	if(tmr->fd >= 0)
+		close(tmr->fd);
+	tmr->fd = -1;
 }
 
 /*
- * timer_init			Initialize the timer.
+ * timer_read			Read all pending events from the timer.
+ *
+ * return: number of bytes read; -1 on error (EAGAIN if nothing pending)
  */
-struct timer *timer_init() {
-	if(pipe(timer_singleton.pipe_fd) < 0)
-		return NULL;
-	if(fcntl(timer_singleton.pipe_fd[PIPE_READ], F_SETFL, O_NONBLOCK) < 0)
-		goto fail;
-	if(fcntl(timer_singleton.pipe_fd[PIPE_WRITE], F_SETFL, O_NONBLOCK) < 0)
-		goto fail;
-	if(timer_install_handler() < 0)
-		goto fail;
-	return &timer_singleton;
-fail:
-	close(timer_singleton.pipe_fd[PIPE_WRITE]);
-	close(timer_singleton.pipe_fd[PIPE_READ]);
-	return NULL;
-}
+int timer_read(struct timer *tmr) {
+	ssize_t b;
+	uint64_t n_exp;
 
-/*
- * timer_remove_handler		Remove the timer signal handler.
- */
-static void timer_remove_handler() {
-	sigaction(SIGALRM, &timer_singleton.sa_original, NULL);
+	if(tmr->fd < 0)
+		return 0;
+	do {
+		b = read(tmr->fd, &n_exp, sizeof(n_exp));
+	} while(b < 0 && errno == EINTR);
+	return b;
 }
 
 /*
- * timer_destroy		Destroy the timer.
+ * timer_set		Set the timer expiration.
  */
-void timer_destroy() {
-	timer_remove_handler();
-	close(timer_singleton.pipe_fd[PIPE_WRITE]);
-	close(timer_singleton.pipe_fd[PIPE_READ]);
+static int timer_set(struct timer *tmr, int flags) {
+	if(tmr->fd < 0) {
+		tmr->changed = true;
+		return 0;
+	}
+	return timerfd_settime(tmr->fd, flags, &tmr->itimer, NULL);
 }
 
 /*
- * timer_read			Read one event from the timer.
+ * timer_arm			Arm the timer to fire at the specified time.
+ *
+ * tv: absolute expiration time (from timeval_set_now)
  */
-int timer_read() {
-	ssize_t b;
-	char c;
-	int fd = timer_singleton.pipe_fd[PIPE_READ];
-
-	do {
-		b = read(fd, &c, 1);
-	} while(b < 0 && errno == EINTR);
-	return b;
+int timer_arm(struct timer *tmr, const struct timeval *tv) {
+	struct itimerspec *it = &tmr->itimer;
+
+	it->it_interval.tv_sec = 0;
+	it->it_interval.tv_nsec = 0;
+	it->it_value.tv_sec = tv->tv_sec;
+	it->it_value.tv_nsec = tv->tv_usec * 1000;
+	/* A zero value would disarm the timer instead of firing now */
+	if(it->it_value.tv_sec == 0 && it->it_value.tv_nsec == 0)
+		it->it_value.tv_nsec = 1;
+	/* An absolute time in the past fires immediately */
+	return timer_set(tmr, TFD_TIMER_ABSTIME);
 }
 
 /*
- * timer_write			Write one event to the timer.
+ * timer_disarm			Stop the timer from firing for now.
  */
-static int timer_write() {
-	ssize_t b;
-	char c = 0;
-	int fd = timer_singleton.pipe_fd[PIPE_WRITE];
-
-	do {
-		b = write(fd, &c, 1);
-	} while(b < 0 && errno == EINTR);
-	return b;
+int timer_disarm(struct timer *tmr) {
+	memset(&tmr->itimer, 0, sizeof(struct itimerspec));
+	return timer_set(tmr, 0);
 }
 
 /*
- * timer_arm			Arm the timer with specified timeout.
+ * timer_get_fd			Get the file descriptor for timer events.
  */
-int timer_arm(unsigned int msec) {
-	if(msec == 0) {
-		// Too late to arm timer, just write to the pipe
-		int b = timer_write();
-		if(b < 0)
-			return b;
-	}
-	timer_singleton.itimer.it_interval.tv_sec = 0;
-	timer_singleton.itimer.it_interval.tv_usec = 0;
-	timer_singleton.itimer.it_value.tv_sec = msec / 1000;
-	timer_singleton.itimer.it_value.tv_usec = msec % 1000 * 1000;
-
-	return setitimer(ITIMER_REAL, &timer_singleton.itimer, NULL);
+int timer_get_fd(const struct timer *tmr) {
+	return tmr->fd;
 }
 
 /*
- * timer_disarm			Stop the timer from firing for now.
+ * timer_detach			Detach the timer from its timerfd.  A detached
+ *				timer only records its expiration, which must be
+ *				checked with timer_get_change and waited for some
+ *				other way (such as an io_uring timeout).
  */
-int timer_disarm() {
-	timer_singleton.itimer.it_interval.tv_sec = 0;
-	timer_singleton.itimer.it_interval.tv_usec = 0;
-	timer_singleton.itimer.it_value.tv_sec = 0;
-	timer_singleton.itimer.it_value.tv_usec = 0;
-
-	return setitimer(ITIMER_REAL, &timer_singleton.itimer, NULL);
+void timer_detach(struct timer *tmr) {
+	if(tmr->fd >= 0)
+		close(tmr->fd);
+	tmr->fd = -1;
+	tmr->changed = true;
 }
 
 /*
- * timer_get_fd			Get the file descriptor for timer events.
+ * timer_get_change		Get the expiration of a detached timer, if it
+ *				has changed since the previous call.
+ *
+ * return: absolute expiration (zero if disarmed), or NULL if unchanged
  */
-int timer_get_fd() {
-	return timer_singleton.pipe_fd[PIPE_READ];
+const struct timespec *timer_get_change(struct timer *tmr) {
+	if(!tmr->changed)
+		return NULL;
+	tmr->changed = false;
+	return &tmr->itimer.it_value;
 }
@@ -1,25 +1,23 @@
 #ifndef TIMER_H
 #define TIMER_H
 
-#include <signal.h>	/* for struct sigaction */
-#include <sys/time.h>	/* for struct itimerval */
-
-enum {
-	PIPE_READ = 0,
-	PIPE_WRITE = 1
-};
+#include <stdbool.h>		/* for bool */
+#include <sys/time.h>		/* for struct timeval */
+#include <sys/timerfd.h>	/* for struct itimerspec */
 
 struct timer {
-	struct itimerval	itimer;
-	int			pipe_fd[2];
-	struct sigaction	sa_original;
+	struct itimerspec	itimer;
+	int			fd;
+	bool			changed;
 };
 
-struct timer *timer_init();
-void timer_destroy();
-int timer_arm(unsigned int msec);
-int timer_disarm();
-int timer_read();
-int timer_get_fd();
+struct timer *timer_init(struct timer *tmr);
+void timer_destroy(struct timer *tmr);
+int timer_arm(struct timer *tmr, const struct timeval *tv);
+int timer_disarm(struct timer *tmr);
+int timer_read(struct timer *tmr);
+int timer_get_fd(const struct timer *tmr);
+void timer_detach(struct timer *tmr);
+const struct timespec *timer_get_change(struct timer *tmr);
 
 #endif
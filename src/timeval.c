@@ -1,6 +1,6 @@
 /*
  * protozoa -- CCTV transcoder / mixer for PTZ
- * Copyright (C) 2008  Minnesota Department of Transportation
+ * Copyright (C) 2008-2014  Minnesota Department of Transportation
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -12,14 +12,82 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
  */
+#include <stdint.h>	/* for uint64_t */
 #include <stdlib.h>
+#include <time.h>	/* for clock_gettime, CLOCK_MONOTONIC */
 #include "timeval.h"
 
+#define NS_PER_SEC (1000000000ULL)
+
+/* Cached monotonic time (ns) for the calling thread, or 0 if not cached */
+static __thread uint64_t now_ns;
+
+/*
+ * clock_now_ns		Read the monotonic clock (ns).
+ */
+static uint64_t clock_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * timeval_from_ns	Set a timeval from a monotonic time (ns).
+ */
+static void timeval_from_ns(struct timeval *tv, uint64_t ns) {
+	tv->tv_sec = ns / NS_PER_SEC;
+	tv->tv_usec = (ns % NS_PER_SEC) / 1000;
+}
+
+/*
+ * timeval_refresh	Refresh the cached time of the calling thread.  A
+ *			poller loop calls this once each time its poll returns,
+ *			so all the work for one pass reads the clock only once.
+ */
+void timeval_refresh(void) {
+	now_ns = clock_now_ns();
+}
+
+/*
+ * timeval_uncache	Stop caching the time for the calling thread.
+ */
+void timeval_uncache(void) {
+	now_ns = 0;
+}
+
+/*
+ * time_now_ns		Get the current monotonic time (ns), from the cache if
+ *			the calling thread has one.
+ */
+uint64_t time_now_ns(void) {
+	return now_ns ? now_ns : clock_now_ns();
+}
+
+/*
+ * time_precise_ns	Get the current monotonic time (ns), reading the clock
+ *			even if the time is cached.
+ */
+uint64_t time_precise_ns(void) {
+	return clock_now_ns();
+}
+
 /*
- * timeval_set_now	Set a timeval to current time.
+ * timeval_set_now	Set a timeval to current time.  The monotonic clock is
+ *			used, so these timevals are not wall-clock times, but
+ *			they are not affected by setting the system clock.  In
+ *			a poller loop, this is the time its poll returned.
  */
 void timeval_set_now(struct timeval *tv) {
-	gettimeofday(tv, NULL);
+	timeval_from_ns(tv, time_now_ns());
+}
+
+/*
+ * timeval_set_precise	Set a timeval to current time, reading the clock
+ *			even if the time is cached.
+ */
+void timeval_set_precise(struct timeval *tv) {
+	timeval_from_ns(tv, clock_now_ns());
 }
 
 /*
@@ -33,6 +101,22 @@ void timeval_adjust(struct timeval *tv, unsigned int ms) {
 	}
 }
 
+/*
+ * timeval_adjust_us	Adjust a timeval by the given number of us (which may
+ *			be negative)
+ */
+void timeval_adjust_us(struct timeval *tv, long us) {
+	tv->tv_sec += us / 1000000;
+	tv->tv_usec += us % 1000000;
+	if(tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	} else if(tv->tv_usec < 0) {
+		tv->tv_sec--;
+		tv->tv_usec += 1000000;
+	}
+}
+
 /*
  * time_elapsed		Calculate the time elapsed between two timevals
  */
@@ -41,6 +125,14 @@ long time_elapsed(const struct timeval *start, const struct timeval *end) {
 		(end->tv_usec - start->tv_usec) / 1000;
 }
 
+/*
+ * time_elapsed_us	Calculate the time elapsed between two timevals (us)
+ */
+long time_elapsed_us(const struct timeval *start, const struct timeval *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000 +
+		(end->tv_usec - start->tv_usec);
+}
+
 /*
  * time_from_now	Determine milliseconds a timeval is in the future.
  */
@@ -48,7 +140,7 @@ long time_from_now(const struct timeval *tv) {
 	struct timeval now;
 	long ms;
 
-	gettimeofday(&now, NULL);
+	timeval_set_now(&now);
 
 	ms = time_elapsed(&now, tv);
 	if(ms < 0)
@@ -64,7 +156,7 @@ long time_since(const struct timeval *tv) {
 	struct timeval now;
 	long ms;
 
-	gettimeofday(&now, NULL);
+	timeval_set_now(&now);
 
 	ms = time_elapsed(tv, &now);
 	if(ms < 0)
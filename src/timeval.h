@@ -1,13 +1,21 @@
 #ifndef TIMEVAL_H
 #define TIMEVAL_H
 
+#include <stdint.h>
 #include <sys/time.h>
 #include <stdbool.h>
 #include "clump.h"
 
+void timeval_refresh(void);
+void timeval_uncache(void);
+uint64_t time_now_ns(void);
+uint64_t time_precise_ns(void);
 void timeval_set_now(struct timeval *tv);
+void timeval_set_precise(struct timeval *tv);
 void timeval_adjust(struct timeval *tv, unsigned int ms);
+void timeval_adjust_us(struct timeval *tv, long us);
 long time_elapsed(const struct timeval *start, const struct timeval *end);
+long time_elapsed_us(const struct timeval *start, const struct timeval *end);
 long time_from_now(const struct timeval *tv);
 long time_since(const struct timeval *tv);
 cl_compare_t timeval_compare(const void *value0, const void *value1);
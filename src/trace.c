@@ -0,0 +1,139 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <fcntl.h>		/* for open, O_RDWR, O_CREAT, O_TRUNC */
+#include <stdio.h>		/* for snprintf */
+#include <string.h>		/* for memcpy, memset, strcmp */
+#include <sys/mman.h>		/* for mmap, munmap */
+#include <time.h>		/* for clock_gettime, CLOCK_REALTIME */
+#include <unistd.h>		/* for close, ftruncate */
+#include "timeval.h"		/* for time_now_ns */
+#include "trace.h"		/* for struct trace_header, prototypes */
+
+/** Mapped trace file header, or NULL if not tracing */
+static struct trace_header *hdr;
+
+/** Records in the mapped trace file */
+static struct trace_record *records;
+
+/** Size of the mapped trace file */
+static size_t map_sz;
+
+/*
+ * trace_open		Open a trace file, replacing any previous contents.
+ *			Channel ID 0 is reserved for unknown channels.
+ *
+ * path: path of trace file
+ * return: 0 on success; -1 on error
+ */
+int trace_open(const char *path) {
+	struct timespec wall, mono;
+	void *map;
+	int fd;
+
+	map_sz = sizeof(struct trace_header) +
+		TRACE_RECORDS * sizeof(struct trace_record);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+		return -1;
+	if(ftruncate(fd, map_sz) < 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return -1;
+	hdr = map;
+	records = (struct trace_record *)(hdr + 1);
+	memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+	hdr->n_records = TRACE_RECORDS;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	hdr->wall_ns = (wall.tv_sec - mono.tv_sec) * 1000000000LL +
+		(wall.tv_nsec - mono.tv_nsec);
+	atomic_init(&hdr->head, 0);
+	strcpy(hdr->names[0], "?");
+	hdr->n_channels = 1;
+	return 0;
+}
+
+/*
+ * trace_close		Close the trace file.
+ */
+void trace_close(void) {
+	if(hdr) {
+		munmap(hdr, map_sz);
+		hdr = NULL;
+		records = NULL;
+	}
+}
+
+/*
+ * trace_channel	Get the ID of a channel, adding it to the name table if
+ *			it is not there yet.  This is only called while the
+ *			configuration is loaded, before any shards are running.
+ *
+ * name: channel name
+ * service: service (port or serial baud rate)
+ * return: channel ID, or 0 if not tracing (or the table is full)
+ */
+uint16_t trace_channel(const char *name, const char *service) {
+	char buf[TRACE_NAME_SZ];
+	unsigned int i;
+
+	if(hdr == NULL)
+		return 0;
+	snprintf(buf, sizeof(buf), "%s:%s", name, service);
+	for(i = 1; i < hdr->n_channels; i++) {
+		if(strcmp(hdr->names[i], buf) == 0)
+			return i;
+	}
+	if(hdr->n_channels >= TRACE_CHANNELS)
+		return 0;
+	memcpy(hdr->names[i], buf, sizeof(buf));
+	hdr->n_channels++;
+	return i;
+}
+
+/*
+ * trace_packet		Add a record for a packet to the trace file, if it is
+ *			open.
+ *
+ * chn: channel ID (from trace_channel)
+ * d: direction
+ */
+void trace_packet(const struct ccpacket *pkt, uint16_t chn, enum domain d) {
+	struct trace_record *rec;
+	uint64_t seq;
+
+	if(hdr == NULL)
+		return;
+	seq = atomic_fetch_add_explicit(&hdr->head, 1, memory_order_relaxed);
+	rec = records + (seq & (TRACE_RECORDS - 1));
+	/* the slot may still hold a valid record from the previous lap, so
+	 * mark it incomplete before any field changes */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->ns = time_now_ns();
+	rec->flags = ccpacket_get_flags(pkt);
+	rec->chn = chn;
+	rec->dir = d;
+	rec->receiver = ccpacket_get_receiver(pkt);
+	rec->preset = ccpacket_get_preset_number(pkt);
+	rec->pan = ccpacket_get_pan_speed(pkt);
+	rec->tilt = ccpacket_get_tilt_speed(pkt);
+	/* store the sequence number last, once the record is complete */
+	__atomic_store_n(&rec->seq, (uint32_t)(seq + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>		/* for atomic_uint_least64_t */
+#include <stdint.h>		/* for uint8_t, uint16_t, uint32_t, uint64_t */
+#include "ccpacket.h"		/* for struct ccpacket, enum domain */
+
+#define TRACE_MAGIC "PZTRACE1"	/* magic bytes at start of trace file */
+#define TRACE_RECORDS (1 << 16)	/* records in trace ring (power of two) */
+#define TRACE_CHANNELS (256)	/* entries in channel name table */
+#define TRACE_NAME_SZ (48)	/* size of one channel name entry */
+
+/*
+ * A trace record is one camera control packet, read or written on a channel.
+ * Records are claimed in order, but may be filled out of order by different
+ * shards.  The sequence number is cleared first and stored last, so a record
+ * which does not match its position is incomplete (or was overwritten).  A
+ * reader of the live ring checks it again after copying the record.
+ */
+struct trace_record {
+	uint64_t	ns;		/* monotonic time stamp (ns) */
+	uint32_t	seq;		/* sequence number + 1 (low 32 bits) */
+	uint32_t	flags;		/* packet flags (enum cc_flags) */
+	uint16_t	chn;		/* channel ID (name table index) */
+	uint8_t		dir;		/* direction (enum domain) */
+	uint8_t		reserved;
+	uint16_t	receiver;	/* receiver address */
+	uint16_t	preset;		/* preset number */
+	uint16_t	pan;		/* pan speed */
+	uint16_t	tilt;		/* tilt speed */
+	uint32_t	reserved2;
+};
+
+/*
+ * A trace file is a header followed by a ring of records.  It is mapped
+ * into memory, so the kernel writes it back; no system calls are needed to
+ * add a record.  Channel names are kept in the header, so the IDs stay the
+ * same when the configuration is reloaded.
+ */
+struct trace_header {
+	char		magic[8];	/* TRACE_MAGIC */
+	uint32_t	n_records;	/* records in ring */
+	uint32_t	n_channels;	/* entries used in name table */
+	int64_t		wall_ns;	/* wall clock minus monotonic (ns) */
+	atomic_uint_least64_t head;	/* number of records claimed */
+	char		names[TRACE_CHANNELS][TRACE_NAME_SZ];	/* name:service */
+};
+
+int trace_open(const char *path);
+void trace_close(void);
+uint16_t trace_channel(const char *name, const char *service);
+void trace_packet(const struct ccpacket *pkt, uint16_t chn, enum domain d);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * protozoa-trace	Render, filter and aggregate a packet trace file
+ *			written by protozoa --trace FILE.
+ *
+ * usage: protozoa-trace [--channel NAME] [--receiver N] [--in | --out]
+ *                       [--summary] FILE
+ */
+#include <fcntl.h>		/* for open, O_RDONLY */
+#include <stdbool.h>		/* for bool */
+#include <stdio.h>		/* for printf, fprintf */
+#include <stdlib.h>		/* for atoi, calloc */
+#include <string.h>		/* for memcmp, strcmp, strstr */
+#include <sys/mman.h>		/* for mmap */
+#include <sys/stat.h>		/* for fstat */
+#include <time.h>		/* for localtime_r, strftime */
+#include <unistd.h>		/* for close */
+#include "trace.h"		/* for struct trace_header, trace_record */
+
+/** Flags which are not covered by pan and tilt speeds */
+#define OTHER_FLAGS (~(CC_PAN_LEFT | CC_PAN_RIGHT | CC_TILT))
+
+/** Names of packet flags, in bit order */
+static const char *flag_name[] = {
+	"pan left", "pan right", "auto-pan", "manual-pan",
+	"tilt up", "tilt down",
+	"recall", "store", "clear",
+	"menu-open", "menu-enter", "menu-cancel",
+	"camera-on", "camera-off",
+	"ack-alarm",
+	"zoom IN", "zoom OUT",
+	"focus NEAR", "focus FAR", "focus AUTO",
+	"iris CLOSE", "iris OPEN", "iris AUTO",
+	"lens SPEED",
+	"wiper-on", "wiper-off",
+};
+
+/** Record filter */
+struct filter {
+	const char	*channel;	/* channel name substring, or NULL */
+	int		receiver;	/* receiver address, or 0 for all */
+	int		dir;		/* direction, or -1 for both */
+};
+
+/** Totals for one channel and direction */
+struct total {
+	unsigned long	n_pkts;		/* number of packets */
+	uint64_t	first;		/* time of first packet (ns) */
+	uint64_t	last;		/* time of last packet (ns) */
+	unsigned long	n_stops;	/* packets with no motion */
+	unsigned long	n_presets;	/* preset commands */
+	bool		rcv[1024];	/* receivers seen */
+};
+
+/*
+ * print_record		Print one trace record.
+ */
+static void print_record(const struct trace_header *hdr,
+	const struct trace_record *rec)
+{
+	uint64_t ns = rec->ns + hdr->wall_ns;
+	time_t sec = ns / 1000000000;
+	struct tm tm;
+	char buf[32];
+	unsigned int i;
+
+	localtime_r(&sec, &tm);
+	strftime(buf, sizeof(buf), "%Y %b %d %H:%M:%S", &tm);
+	printf("%s.%06u %-3s %s rcv: %u", buf,
+		(unsigned int)(ns % 1000000000 / 1000),
+		(rec->dir == CC_DOM_IN) ? "IN" : "OUT",
+		hdr->names[rec->chn < TRACE_CHANNELS ? rec->chn : 0],
+		rec->receiver);
+	if(rec->pan == 0)
+		printf(" pan: 0");
+	else
+		printf(" pan %s: %u", (rec->flags & CC_PAN_LEFT) ? "left" :
+			"right", rec->pan);
+	if(rec->tilt == 0)
+		printf(" tilt: 0");
+	else
+		printf(" tilt %s: %u", (rec->flags & CC_TILT_UP) ? "up" :
+			"down", rec->tilt);
+	for(i = 0; i < sizeof(flag_name) / sizeof(flag_name[0]); i++) {
+		if(!(rec->flags & OTHER_FLAGS & (1 << i)))
+			continue;
+		printf(" %s", flag_name[i]);
+		if((1 << i) & CC_PRESET)
+			printf(" preset: %u", rec->preset);
+	}
+	printf("\n");
+}
+
+/*
+ * filter_match		Test if a record matches a filter.
+ */
+static bool filter_match(const struct filter *flt,
+	const struct trace_header *hdr, const struct trace_record *rec)
+{
+	if(flt->channel && (rec->chn >= hdr->n_channels ||
+	   strstr(hdr->names[rec->chn], flt->channel) == NULL))
+		return false;
+	if(flt->receiver && rec->receiver != flt->receiver)
+		return false;
+	if(flt->dir >= 0 && rec->dir != flt->dir)
+		return false;
+	return true;
+}
+
+/*
+ * total_add		Add a record to the totals.
+ */
+static void total_add(struct total *tot, const struct trace_record *rec) {
+	if(tot->n_pkts == 0)
+		tot->first = rec->ns;
+	tot->last = rec->ns;
+	tot->n_pkts++;
+	if(rec->pan == 0 && rec->tilt == 0 && !(rec->flags & OTHER_FLAGS))
+		tot->n_stops++;
+	if(rec->flags & CC_PRESET)
+		tot->n_presets++;
+	if(rec->receiver > 0 && rec->receiver <= 1024)
+		tot->rcv[rec->receiver - 1] = true;
+}
+
+/*
+ * print_totals		Print the totals for all channels.
+ */
+static void print_totals(const struct trace_header *hdr,
+	struct total tot[][CC_DOM_OUT + 1])
+{
+	unsigned int c, d, i;
+
+	printf("%-32s %-3s %10s %9s %8s %8s %6s\n", "channel", "dir",
+		"packets", "rate/s", "stops", "presets", "rcvs");
+	for(c = 0; c < hdr->n_channels && c < TRACE_CHANNELS; c++) {
+		for(d = 0; d <= CC_DOM_OUT; d++) {
+			struct total *t = &tot[c][d];
+			double span = (t->last - t->first) / 1e9;
+			unsigned int n_rcv = 0;
+			if(t->n_pkts == 0)
+				continue;
+			for(i = 0; i < 1024; i++)
+				n_rcv += t->rcv[i];
+			printf("%-32s %-3s %10lu %9.1f %8lu %8lu %6u\n",
+				hdr->names[c], d ? "OUT" : "IN", t->n_pkts,
+				(span > 0) ? t->n_pkts / span : 0.0,
+				t->n_stops, t->n_presets, n_rcv);
+		}
+	}
+}
+
+/*
+ * trace_read		Read all complete records in a trace file, oldest
+ *			first.  Records which are incomplete, or have been
+ *			overwritten, are skipped.
+ *
+ * return: 0 on success; 1 on error
+ */
+static int trace_read(const char *path, const struct filter *flt,
+	bool summary)
+{
+	const struct trace_header *hdr;
+	const struct trace_record *records;
+	struct total (*tot)[CC_DOM_OUT + 1] = NULL;
+	uint64_t head, seq;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		perror(path);
+		return 1;
+	}
+	hdr = map;
+	records = (const struct trace_record *)(hdr + 1);
+	if((size_t)st.st_size < sizeof(struct trace_header) ||
+	   memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	   (size_t)st.st_size < sizeof(struct trace_header) +
+	   hdr->n_records * sizeof(struct trace_record))
+	{
+		fprintf(stderr, "%s: not a protozoa trace file\n", path);
+		return 1;
+	}
+	if(summary) {
+		tot = calloc(TRACE_CHANNELS, sizeof(*tot));
+		if(tot == NULL) {
+			perror("calloc");
+			return 1;
+		}
+	}
+	head = atomic_load((atomic_uint_least64_t *)&hdr->head);
+	seq = (head > hdr->n_records) ? head - hdr->n_records : 0;
+	for(; seq < head; seq++) {
+		const struct trace_record *slot = records +
+			(seq & (hdr->n_records - 1));
+		struct trace_record copy;
+		const struct trace_record *rec = &copy;
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		   (uint32_t)(seq + 1))
+			continue;
+		copy = *slot;
+		/* the slot may have been reused while it was copied */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) !=
+		   (uint32_t)(seq + 1))
+			continue;
+		if(!filter_match(flt, hdr, rec))
+			continue;
+		if(tot) {
+			if(rec->chn < TRACE_CHANNELS && rec->dir <= CC_DOM_OUT)
+				total_add(&tot[rec->chn][rec->dir], rec);
+		} else
+			print_record(hdr, rec);
+	}
+	if(tot)
+		print_totals(hdr, tot);
+	return 0;
+}
+
+/*
+ * usage		Print usage message.
+ */
+static int usage(void) {
+	fprintf(stderr, "usage: protozoa-trace [--channel NAME] "
+		"[--receiver N] [--in | --out] [--summary] FILE\n");
+	return 2;
+}
+
+int main(int argc, char *argv[]) {
+	struct filter flt = { NULL, 0, -1 };
+	const char *path = NULL;
+	bool summary = false;
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--channel") == 0 && i + 1 < argc)
+			flt.channel = argv[++i];
+		else if(strcmp(argv[i], "--receiver") == 0 && i + 1 < argc)
+			flt.receiver = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--in") == 0)
+			flt.dir = CC_DOM_IN;
+		else if(strcmp(argv[i], "--out") == 0)
+			flt.dir = CC_DOM_OUT;
+		else if(strcmp(argv[i], "--summary") == 0)
+			summary = true;
+		else if(argv[i][0] == '-' || path)
+			return usage();
+		else
+			path = argv[i];
+	}
+	if(path == NULL)
+		return usage();
+	return trace_read(path, &flt, summary);
+}
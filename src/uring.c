@@ -0,0 +1,330 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <errno.h>		/* for errno, EINTR */
+#include <stdlib.h>		/* for malloc, free */
+#include <string.h>		/* for memset */
+#include <sys/mman.h>		/* for mmap, munmap */
+#include <sys/syscall.h>	/* for __NR_io_uring_setup, etc. */
+#include <unistd.h>		/* for syscall, close */
+#include "uring.h"		/* for struct uring, prototypes */
+
+/*
+ * The kernel and user space share the ring indices, so every access to an
+ * index owned by the other side needs acquire / release ordering.
+ */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/*
+ * uring_init		Initialize an io_uring.
+ *
+ * entries: number of submission queue entries
+ * return: pointer to uring, or NULL on error
+ */
+struct uring *uring_init(struct uring *ur, unsigned int entries) {
+	struct io_uring_params p;
+	unsigned int *sq_array;
+	size_t sq_sz, cq_sz;
+	unsigned int i;
+	void *ring;
+
+	memset(ur, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(struct io_uring_params));
+	/* Multishot polls post many completions for each submission */
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = entries * 8;
+	ur->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(ur->fd < 0)
+		return NULL;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	   !(p.features & IORING_FEAT_NODROP))
+	{
+		errno = ENOSYS;
+		goto fail;
+	}
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->ring_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+	ring = mmap(NULL, ur->ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if(ring == MAP_FAILED)
+		goto fail;
+	ur->ring = ring;
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if(ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto fail;
+	}
+	ur->sq_head = (unsigned int *)((char *)ring + p.sq_off.head);
+	ur->sq_tail = (unsigned int *)((char *)ring + p.sq_off.tail);
+	ur->sq_mask = *(unsigned int *)((char *)ring + p.sq_off.ring_mask);
+	ur->sq_entries = p.sq_entries;
+	ur->tail = *ur->sq_tail;
+	ur->cq_head = (unsigned int *)((char *)ring + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)((char *)ring + p.cq_off.tail);
+	ur->cq_mask = *(unsigned int *)((char *)ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ring + p.cq_off.cqes);
+	/* SQEs are always submitted in order, so the index array is fixed */
+	sq_array = (unsigned int *)((char *)ring + p.sq_off.array);
+	for(i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	return ur;
+fail:
+	uring_destroy(ur);
+	return NULL;
+}
+
+/*
+ * uring_cancel		Cancel operations, and wait until they are done.
+ *
+ * fd: file descriptor to cancel operations on, or -1 for all operations
+ * return: 0 on success; -1 on error
+ */
+static int uring_cancel(struct uring *ur, int fd) {
+	struct io_uring_sync_cancel_reg reg;
+
+	memset(&reg, 0, sizeof(struct io_uring_sync_cancel_reg));
+	reg.fd = fd;
+	reg.flags = IORING_ASYNC_CANCEL_ALL |
+		((fd < 0) ? IORING_ASYNC_CANCEL_ANY : IORING_ASYNC_CANCEL_FD);
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	if(syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_SYNC_CANCEL,
+		&reg, 1) < 0 && errno != ENOENT)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * uring_cancel_fd	Cancel all operations on a file descriptor, and wait
+ *			until they are done.  This must be called before the
+ *			file descriptor is closed, because in-flight operations
+ *			hold a reference to the file (keeping a socket open).
+ *			Their completions are still posted.
+ *
+ * fd: file descriptor
+ * return: 0 on success; -1 on error
+ */
+int uring_cancel_fd(struct uring *ur, int fd) {
+	/* operations not yet submitted would not be cancelled */
+	if(uring_enter(ur, false) < 0)
+		return -1;
+	return uring_cancel(ur, fd);
+}
+
+/*
+ * uring_destroy	Destroy an io_uring.  All operations in flight are
+ *			cancelled first, so that the kernel cannot touch any
+ *			buffers after they are freed.
+ */
+void uring_destroy(struct uring *ur) {
+	if(ur->ring)
+		uring_cancel(ur, -1);
+	if(ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if(ur->ring)
+		munmap(ur->ring, ur->ring_sz);
+	if(ur->fd >= 0)
+		close(ur->fd);
+	if(ur->br)
+		munmap(ur->br, ur->n_bufs * sizeof(struct io_uring_buf));
+	free(ur->bufs);
+	memset(ur, 0, sizeof(struct uring));
+	ur->fd = -1;
+}
+
+/*
+ * uring_is_supported	Test if the kernel supports all io_uring features
+ *			which are needed for polling channels (provided buffer
+ *			rings and synchronous cancel).
+ *
+ * return: true if io_uring can be used; otherwise false
+ */
+bool uring_is_supported(void) {
+	struct uring ur;
+	bool sup;
+
+	if(uring_init(&ur, 4) == NULL)
+		return false;
+	sup = (uring_init_bufs(&ur, 1, 64) == 0) && (uring_cancel(&ur, -1) == 0);
+	uring_destroy(&ur);
+	return sup;
+}
+
+/*
+ * uring_add_buf	Add one buffer to the provided buffer ring.
+ *
+ * bid: buffer ID
+ */
+static void uring_add_buf(struct uring *ur, unsigned int bid) {
+	struct io_uring_buf *buf = ur->br->bufs +
+		(ur->br_tail & (ur->n_bufs - 1));
+
+	buf->addr = (unsigned long)(ur->bufs + bid * ur->buf_sz);
+	buf->len = ur->buf_sz;
+	buf->bid = bid;
+	ur->br_tail++;
+}
+
+/*
+ * uring_init_bufs	Register a ring of provided buffers for reads.
+ *
+ * n_bufs: number of buffers (power of two)
+ * buf_sz: size of each buffer (bytes)
+ * return: 0 on success; -1 on error
+ */
+int uring_init_bufs(struct uring *ur, unsigned int n_bufs, size_t buf_sz) {
+	struct io_uring_buf_reg reg;
+	size_t br_sz = n_bufs * sizeof(struct io_uring_buf);
+	unsigned int i;
+	void *br;
+
+	/* the buffer ring must be page aligned */
+	br = mmap(NULL, br_sz, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(br == MAP_FAILED)
+		return -1;
+	ur->br = br;
+	ur->n_bufs = n_bufs;
+	ur->buf_sz = buf_sz;
+	ur->bufs = malloc(n_bufs * buf_sz);
+	if(ur->bufs == NULL)
+		return -1;
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (unsigned long)br;
+	reg.ring_entries = n_bufs;
+	reg.bgid = URING_BGID;
+	if(syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) < 0)
+	{
+		return -1;
+	}
+	ur->br_tail = 0;
+	for(i = 0; i < n_bufs; i++)
+		uring_add_buf(ur, i);
+	store_release(&ur->br->tail, ur->br_tail);
+	return 0;
+}
+
+/*
+ * uring_get_sqe	Get a cleared submission queue entry.  If the queue is
+ *			full, pending entries are submitted first.
+ *
+ * return: borrowed pointer to SQE, or NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ur) {
+	struct io_uring_sqe *sqe;
+
+	if(ur->tail - load_acquire(ur->sq_head) >= ur->sq_entries) {
+		if(uring_enter(ur, false) < 0)
+			return NULL;
+		if(ur->tail - load_acquire(ur->sq_head) >= ur->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	sqe = ur->sqes + (ur->tail & ur->sq_mask);
+	ur->tail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/*
+ * uring_reserve	Make sure there is room for a number of entries, so
+ *			that a chain of linked entries is submitted together.
+ *
+ * n_sqes: number of entries needed
+ * return: 0 on success; -1 on error
+ */
+int uring_reserve(struct uring *ur, unsigned int n_sqes) {
+	if(ur->tail - load_acquire(ur->sq_head) + n_sqes <= ur->sq_entries)
+		return 0;
+	if(uring_enter(ur, false) < 0)
+		return -1;
+	if(ur->tail - load_acquire(ur->sq_head) + n_sqes <= ur->sq_entries)
+		return 0;
+	errno = EBUSY;
+	return -1;
+}
+
+/*
+ * uring_enter		Submit all pending entries, and optionally wait for
+ *			at least one completion, with a single system call.
+ *
+ * wait: true to wait for a completion
+ * return: 0 on success; -1 on error
+ */
+int uring_enter(struct uring *ur, bool wait) {
+	unsigned int to_submit;
+	int r;
+
+	store_release(ur->sq_tail, ur->tail);
+	do {
+		to_submit = ur->tail - load_acquire(ur->sq_head);
+		if(to_submit == 0 && !wait)
+			return 0;
+		r = syscall(__NR_io_uring_enter, ur->fd, to_submit,
+			wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+			NULL, 0);
+	} while(r < 0 && errno == EINTR);
+	/* completions are backed up; they will be reaped before retrying */
+	if(r < 0 && errno == EBUSY)
+		return 0;
+	return (r < 0) ? -1 : 0;
+}
+
+/*
+ * uring_peek		Get the next completion queue entry, if any.
+ *
+ * return: borrowed pointer to CQE, or NULL if none are ready
+ */
+struct io_uring_cqe *uring_peek(struct uring *ur) {
+	unsigned int head = *ur->cq_head;
+
+	if(head == load_acquire(ur->cq_tail))
+		return NULL;
+	return ur->cqes + (head & ur->cq_mask);
+}
+
+/*
+ * uring_seen		Mark the entry from uring_peek as consumed.
+ */
+void uring_seen(struct uring *ur) {
+	store_release(ur->cq_head, *ur->cq_head + 1);
+}
+
+/*
+ * uring_buf		Get the memory of a provided buffer.
+ *
+ * bid: buffer ID (from CQE flags)
+ * return: borrowed pointer to buffer
+ */
+uint8_t *uring_buf(struct uring *ur, unsigned int bid) {
+	return ur->bufs + bid * ur->buf_sz;
+}
+
+/*
+ * uring_recycle	Give a provided buffer back to the kernel.
+ *
+ * bid: buffer ID (from CQE flags)
+ */
+void uring_recycle(struct uring *ur, unsigned int bid) {
+	uring_add_buf(ur, bid);
+	store_release(&ur->br->tail, ur->br_tail);
+}
@@ -0,0 +1,52 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>		/* for bool */
+#include <stddef.h>		/* for size_t */
+#include <stdint.h>		/* for uint8_t, uint16_t */
+#include <linux/io_uring.h>	/* for struct io_uring_sqe, io_uring_cqe */
+
+/*
+ * A uring is an io_uring submission / completion queue pair, mapped into
+ * user memory.  Submissions are batched until the next uring_enter call.
+ * Reads pick buffers from a ring of provided buffers, which must be recycled
+ * after each completion.
+ */
+struct uring {
+	int			fd;		/* io_uring file descriptor */
+	void			*ring;		/* mapped SQ / CQ rings */
+	size_t			ring_sz;	/* size of mapped rings */
+	struct io_uring_sqe	*sqes;		/* submission queue entries */
+	size_t			sqes_sz;	/* size of mapped SQEs */
+	unsigned int		*sq_head;	/* SQ head (kernel) */
+	unsigned int		*sq_tail;	/* SQ tail (user) */
+	unsigned int		sq_mask;	/* SQ ring mask */
+	unsigned int		sq_entries;	/* SQ ring entries */
+	unsigned int		tail;		/* SQ tail, not yet published */
+	unsigned int		*cq_head;	/* CQ head (user) */
+	unsigned int		*cq_tail;	/* CQ tail (kernel) */
+	unsigned int		cq_mask;	/* CQ ring mask */
+	struct io_uring_cqe	*cqes;		/* completion queue entries */
+	struct io_uring_buf_ring *br;		/* provided buffer ring */
+	uint16_t		br_tail;	/* buffer ring tail */
+	unsigned int		n_bufs;		/* number of provided buffers */
+	size_t			buf_sz;		/* size of each buffer */
+	uint8_t			*bufs;		/* provided buffer memory */
+};
+
+#define URING_BGID (0)		/* buffer group of provided buffers */
+
+struct uring *uring_init(struct uring *ur, unsigned int entries);
+void uring_destroy(struct uring *ur);
+bool uring_is_supported(void);
+int uring_init_bufs(struct uring *ur, unsigned int n_bufs, size_t buf_sz);
+struct io_uring_sqe *uring_get_sqe(struct uring *ur);
+int uring_reserve(struct uring *ur, unsigned int n_sqes);
+int uring_enter(struct uring *ur, bool wait);
+int uring_cancel_fd(struct uring *ur, int fd);
+struct io_uring_cqe *uring_peek(struct uring *ur);
+void uring_seen(struct uring *ur);
+uint8_t *uring_buf(struct uring *ur, unsigned int bid);
+void uring_recycle(struct uring *ur, unsigned int bid);
+
+#endif
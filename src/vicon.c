@@ -216,6 +216,7 @@ static enum decode_t vicon_decode_extended(struct ccreader *rdr,
 	} else
 		decode_ex_speed(rdr->packet, mess);
 	buffer_consume(rxbuf, SIZE_EXTENDED);
+	ccreader_set_frame(rdr, mess, SIZE_EXTENDED);
 	ccreader_process_packet(rdr);
 	return DECODE_MORE;
 }
@@ -236,6 +237,7 @@ static enum decode_t vicon_decode_command(struct ccreader *rdr,
 	decode_aux(rdr->packet, mess);
 	decode_preset(rdr->packet, mess);
 	buffer_consume(rxbuf, SIZE_COMMAND);
+	ccreader_set_frame(rdr, mess, SIZE_COMMAND);
 	ccreader_process_packet(rdr);
 	return DECODE_MORE;
 }
@@ -263,6 +265,7 @@ static enum decode_t vicon_decode_message(struct ccreader *rdr,
 	if ((mess[0] & FLAG) == 0) {
 		log_println(rdr->log, "Vicon: unexpected byte %02X", mess[0]);
 		buffer_consume(rxbuf, 1);
+		ccreader_decode_error(rdr);
 		return DECODE_MORE;
 	}
 	if (is_extended_command(mess))
@@ -0,0 +1,341 @@
+/*
+ * protozoa -- CCTV transcoder / mixer for PTZ
+ * Copyright (C) 2014  Minnesota Department of Transportation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>	/* for memset */
+#include "timeval.h"	/* for timeval_compare */
+#include "wheel.h"	/* for struct wheel and prototypes */
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/*
+ * wheel_tick		Get the wheel tick (ms) of a timeval.
+ */
+static inline uint64_t wheel_tick(const struct timeval *tv) {
+	return (uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+/*
+ * wheel_block		Get the block number of a wheel tick.
+ */
+static inline uint64_t wheel_block(uint64_t tick) {
+	return tick >> WHEEL_BITS;
+}
+
+/*
+ * map_set		Set a bit in a slot bitmap.
+ */
+static inline void map_set(uint64_t *map, unsigned int i) {
+	map[i >> 6] |= 1ULL << (i & 63);
+}
+
+/*
+ * map_clear		Clear a bit in a slot bitmap.
+ */
+static inline void map_clear(uint64_t *map, unsigned int i) {
+	map[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+/*
+ * map_test		Test a bit in a slot bitmap.
+ */
+static inline bool map_test(const uint64_t *map, unsigned int i) {
+	return (map[i >> 6] >> (i & 63)) & 1;
+}
+
+/*
+ * map_find		Find the first set bit in a slot bitmap.
+ *
+ * i: index to start searching
+ * return: index of first set bit at or after i; -1 if none
+ */
+static int map_find(const uint64_t *map, unsigned int i) {
+	unsigned int w = i >> 6;
+	uint64_t bits = map[w] & (~0ULL << (i & 63));
+	while(true) {
+		if(bits)
+			return (w << 6) + __builtin_ctzll(bits);
+		if(++w >= WHEEL_WORDS)
+			return -1;
+		bits = map[w];
+	}
+}
+
+/*
+ * map_find_cyclic	Find the next set bit in a slot bitmap, wrapping
+ *			around to the start.
+ *
+ * i: index to start searching
+ * return: index of next set bit; -1 if none
+ */
+static int map_find_cyclic(const uint64_t *map, unsigned int i) {
+	int s = map_find(map, i);
+	if(s < 0 && i > 0)
+		s = map_find(map, 0);
+	return s;
+}
+
+/*
+ * wheel_init		Initialize a timer wheel.
+ *
+ * now: current time
+ */
+struct wheel *wheel_init(struct wheel *whl, const struct timeval *now) {
+	memset(whl, 0, sizeof(struct wheel));
+	whl->tick = wheel_tick(now);
+	return whl;
+}
+
+/*
+ * wheel_node_init	Initialize a wheel node.
+ */
+void wheel_node_init(struct wheel_node *node) {
+	memset(node, 0, sizeof(struct wheel_node));
+}
+
+/*
+ * wheel_node_is_linked	Test if a node is linked into a wheel.
+ */
+bool wheel_node_is_linked(const struct wheel_node *node) {
+	return node->pprev != NULL;
+}
+
+/*
+ * wheel_link		Link a node into a slot list.
+ */
+static void wheel_link(struct wheel_node **head, struct wheel_node *node) {
+	node->next = *head;
+	if(node->next)
+		node->next->pprev = &node->next;
+	*head = node;
+	node->pprev = head;
+	node->head = head;
+}
+
+/*
+ * wheel_insert		Insert a node into the proper slot for its time.
+ */
+static void wheel_insert(struct wheel *whl, struct wheel_node *node) {
+	uint64_t t = wheel_tick(&node->tv);
+	uint64_t b;
+
+	/* Nodes which are already due go in the current slot */
+	if(t < whl->tick)
+		t = whl->tick;
+	b = wheel_block(t);
+	if(b == wheel_block(whl->tick)) {
+		wheel_link(whl->near + (t & WHEEL_MASK), node);
+		map_set(whl->near_map, t & WHEEL_MASK);
+	} else if(b - wheel_block(whl->tick) < WHEEL_SLOTS) {
+		wheel_link(whl->far + (b & WHEEL_MASK), node);
+		map_set(whl->far_map, b & WHEEL_MASK);
+	} else
+		wheel_link(&whl->overflow, node);
+}
+
+/*
+ * wheel_unlink		Unlink a node from its slot list.
+ */
+static void wheel_unlink(struct wheel *whl, struct wheel_node *node) {
+	struct wheel_node **head = node->head;
+
+	*node->pprev = node->next;
+	if(node->next)
+		node->next->pprev = node->pprev;
+	node->next = NULL;
+	node->pprev = NULL;
+	node->head = NULL;
+	if(*head == NULL) {
+		if(head >= whl->near && head < whl->near + WHEEL_SLOTS)
+			map_clear(whl->near_map, head - whl->near);
+		else if(head >= whl->far && head < whl->far + WHEEL_SLOTS)
+			map_clear(whl->far_map, head - whl->far);
+	}
+}
+
+/*
+ * wheel_catch_up	Move an empty wheel up to the current time.  Otherwise,
+ *			after a long idle period new nodes would start out on
+ *			the overflow list.
+ *
+ * now: current time
+ */
+void wheel_catch_up(struct wheel *whl, const struct timeval *now) {
+	uint64_t nt = wheel_tick(now);
+	if(whl->n_nodes == 0 && nt > whl->tick)
+		whl->tick = nt;
+}
+
+/*
+ * wheel_add		Add a node to the timer wheel.  The node expiration
+ *			time must be set first.
+ */
+void wheel_add(struct wheel *whl, struct wheel_node *node) {
+	wheel_insert(whl, node);
+	if(whl->n_nodes == 0) {
+		whl->first = node;
+		whl->first_valid = true;
+	} else if(whl->first_valid &&
+	          timeval_compare(&node->tv, &whl->first->tv) == CL_LESS)
+		whl->first = node;
+	whl->n_nodes++;
+}
+
+/*
+ * wheel_remove		Remove a node from the timer wheel (if linked).
+ */
+void wheel_remove(struct wheel *whl, struct wheel_node *node) {
+	if(wheel_node_is_linked(node)) {
+		wheel_unlink(whl, node);
+		whl->n_nodes--;
+		if(node == whl->first) {
+			whl->first = NULL;
+			whl->first_valid = false;
+		}
+	}
+}
+
+/*
+ * wheel_slot_min	Find the earliest node in a slot list.
+ */
+static struct wheel_node *wheel_slot_min(struct wheel_node *node) {
+	struct wheel_node *min = node;
+	for(node = node->next; node; node = node->next) {
+		if(timeval_compare(&node->tv, &min->tv) == CL_LESS)
+			min = node;
+	}
+	return min;
+}
+
+/*
+ * wheel_find_first	Find the node which will expire first.  Near nodes are
+ *			always earliest, but an overflow node added long ago
+ *			can be due before the first far slot.
+ */
+static struct wheel_node *wheel_find_first(struct wheel *whl) {
+	struct wheel_node *node = NULL;
+	int s;
+
+	s = map_find(whl->near_map, whl->tick & WHEEL_MASK);
+	if(s >= 0)
+		return wheel_slot_min(whl->near[s]);
+	s = map_find_cyclic(whl->far_map,
+		(wheel_block(whl->tick) + 1) & WHEEL_MASK);
+	if(s >= 0)
+		node = wheel_slot_min(whl->far[s]);
+	if(whl->overflow) {
+		struct wheel_node *onode = wheel_slot_min(whl->overflow);
+		if(node == NULL ||
+		   timeval_compare(&onode->tv, &node->tv) == CL_LESS)
+			node = onode;
+	}
+	return node;
+}
+
+/*
+ * wheel_peek		Get the node which will expire first.  The slots are
+ *			only searched after the cached earliest node has been
+ *			removed.
+ *
+ * return: borrowed pointer to the earliest node; NULL if empty
+ */
+struct wheel_node *wheel_peek(struct wheel *whl) {
+	if(whl->n_nodes == 0)
+		return NULL;
+	if(!whl->first_valid) {
+		whl->first = wheel_find_first(whl);
+		whl->first_valid = true;
+	}
+	return whl->first;
+}
+
+/*
+ * wheel_reinsert	Remove all nodes from a slot list and insert them again
+ *			relative to the current tick.
+ */
+static void wheel_reinsert(struct wheel *whl, struct wheel_node **head) {
+	struct wheel_node *node = *head;
+	while(node) {
+		struct wheel_node *next = node->next;
+		wheel_unlink(whl, node);
+		wheel_insert(whl, node);
+		node = next;
+	}
+}
+
+/*
+ * wheel_advance	Advance the wheel to the next block which needs
+ *			attention, without passing the current time.
+ *
+ * nt: current tick
+ * return: true if the wheel advanced; false if nothing more is due
+ */
+static bool wheel_advance(struct wheel *whl, uint64_t nt) {
+	uint64_t cb = wheel_block(whl->tick);
+	uint64_t target = wheel_block(nt);
+	uint64_t nb_ovf = UINT64_MAX;
+	int s;
+
+	if(target <= cb)
+		return false;
+	s = map_find_cyclic(whl->far_map, (cb + 1) & WHEEL_MASK);
+	if(s >= 0) {
+		uint64_t nb_far = cb + ((s - cb) & WHEEL_MASK);
+		if(nb_far < target)
+			target = nb_far;
+	}
+	if(whl->overflow) {
+		/* overflow nodes may enter the far wheel after it wraps */
+		nb_ovf = ((cb >> WHEEL_BITS) + 1) << WHEEL_BITS;
+		if(nb_ovf < target)
+			target = nb_ovf;
+	}
+	whl->tick = target << WHEEL_BITS;
+	if(map_test(whl->far_map, target & WHEEL_MASK))
+		wheel_reinsert(whl, whl->far + (target & WHEEL_MASK));
+	if(target == nb_ovf)
+		wheel_reinsert(whl, &whl->overflow);
+	return true;
+}
+
+/*
+ * wheel_expire		Remove the next expired node from the timer wheel.
+ *
+ * now: current time
+ * return: borrowed pointer to an expired node; NULL if none have expired
+ */
+struct wheel_node *wheel_expire(struct wheel *whl, const struct timeval *now) {
+	uint64_t nt = wheel_tick(now);
+
+	while(whl->n_nodes) {
+		int s = map_find(whl->near_map, whl->tick & WHEEL_MASK);
+		if(s >= 0) {
+			uint64_t t = (whl->tick & ~(uint64_t)WHEEL_MASK) | s;
+			struct wheel_node *node;
+			if(t > nt)
+				return NULL;
+			whl->tick = t;
+			for(node = whl->near[s]; node; node = node->next) {
+				if(timeval_compare(&node->tv, now) != CL_GREATER){
+					wheel_remove(whl, node);
+					return node;
+				}
+			}
+			/* remaining nodes expire later in this tick */
+			return NULL;
+		}
+		if(!wheel_advance(whl, nt))
+			return NULL;
+	}
+	return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdbool.h>	/* for bool */
+#include <stdint.h>	/* for uint64_t */
+#include <sys/time.h>	/* for struct timeval */
+
+#define WHEEL_BITS (8)
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+
+/*
+ * A wheel node is embedded in each object which can be scheduled on a timer
+ * wheel.  Nodes are linked into slot lists, so adding and removing them does
+ * not allocate any memory.
+ */
+struct wheel_node {
+	struct timeval		tv;		/* expiration time */
+	struct wheel_node	*next;		/* next node in slot */
+	struct wheel_node	**pprev;	/* link pointing to this node */
+	struct wheel_node	**head;		/* head of slot list */
+};
+
+/*
+ * A timer wheel is a two-level hierarchical timing wheel.  The near wheel has
+ * one slot per millisecond tick for the current block of 256 ticks.  The far
+ * wheel has one slot per block for the next 255 blocks (about 65 seconds).
+ * Nodes further out than that wait on an overflow list.  Far slots are
+ * cascaded into the near wheel as each block is reached.  Bitmaps of the
+ * occupied slots make finding the next expiration cheap, and the earliest
+ * node is cached until it is removed.
+ */
+struct wheel {
+	struct wheel_node	*near[WHEEL_SLOTS];	/* 1 tick per slot */
+	struct wheel_node	*far[WHEEL_SLOTS];	/* 1 block per slot */
+	struct wheel_node	*overflow;		/* beyond far wheel */
+	uint64_t		near_map[WHEEL_WORDS];	/* occupied near slots */
+	uint64_t		far_map[WHEEL_WORDS];	/* occupied far slots */
+	uint64_t		tick;			/* current tick (ms) */
+	unsigned int		n_nodes;		/* number of nodes */
+	struct wheel_node	*first;			/* earliest node */
+	bool			first_valid;		/* first is up to date */
+};
+
+struct wheel *wheel_init(struct wheel *whl, const struct timeval *now);
+void wheel_node_init(struct wheel_node *node);
+bool wheel_node_is_linked(const struct wheel_node *node);
+void wheel_catch_up(struct wheel *whl, const struct timeval *now);
+void wheel_add(struct wheel *whl, struct wheel_node *node);
+void wheel_remove(struct wheel *whl, struct wheel_node *node);
+struct wheel_node *wheel_peek(struct wheel *whl);
+struct wheel_node *wheel_expire(struct wheel *whl, const struct timeval *now);
+
+#endif